@@ -0,0 +1,558 @@
+// Agent: Agent Mode, Date: 2026-10-14, Observation: Benchmark suite comparing consumption models under multi-device uinput load, with percentile and machine-readable output
+// Creates synthetic uinput keyboards, 8 kHz mice and multitouch screens,
+// drives them at configurable rates and burst sizes, and runs the same load
+// once per consumption model: callback, batch (frame callback), poll and
+// zero-copy (ni_poll_acquire). For every model it reports p50/p99/p99.9 of
+// kernel timestamp to consumer, CPU time per million events and losses.
+//
+// Usage: ./asyncinput_bench [-k n[:hz]] [-m n[:hz]] [-t n[:hz]] [-b frames]
+//            [-s seconds] [-c models] [-q capacity] [-C cpu] [-T]
+//            [-f text|json|csv] [-P p99_us] [-Q p999_us] [-E mev_s] [-X drops]
+//        ./asyncinput_bench -r trace [-c models] [-f ...] [-E mev_s] [-X drops]
+//
+// -r replays a trace (ni_record_start() or benchmark_asyncinput -w) as fast
+// as possible instead, which needs neither root nor /dev/uinput; it measures
+// throughput and CPU only. -P, -Q, -E and -X turn the run into a release
+// gate: the exit status is 3 when any model misses one of them.
+
+#include "asyncinput.h"
+
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_NAME "asyncinput-bench"
+#define MAX_GEN 64
+#define MAX_BURST 64
+#define TOUCH_CONTACTS 2
+// the first touch frame: tracking ids, BTN_TOUCH, positions and SYN_REPORT
+#define FRAME_EVENTS_MAX (5 * TOUCH_CONTACTS + 2)
+
+enum { MODEL_CALLBACK, MODEL_BATCH, MODEL_POLL, MODEL_ZEROCOPY, MODEL_COUNT };
+static const char *const model_names[MODEL_COUNT] = { "callback", "batch", "poll", "zerocopy" };
+
+enum { KIND_KEYBOARD, KIND_MOUSE, KIND_TOUCH, KIND_COUNT };
+static const char *const kind_names[KIND_COUNT] = { "keyboard", "mouse", "touch" };
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long process_cpu_ns(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((long long)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+           ((long long)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+static long long thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ---- load generation ------------------------------------------------------
+
+struct generator {
+    int fd;
+    int kind;
+    int hz;
+    int burst;              // frames per write()
+    volatile bool stop;
+    unsigned long long seq;     // frames built, kept across runs so setup frames happen once
+    unsigned long long frames;  // frames the kernel accepted in this run
+    long long cpu_ns;       // of the generator thread, not charged to the library
+    pthread_t thread;
+};
+
+static void uinput_abs(int fd, int code, int max) {
+    struct uinput_abs_setup abs = {0};
+    abs.code = (uint16_t)code;
+    abs.absinfo.maximum = max;
+    ioctl(fd, UI_SET_ABSBIT, code);
+    ioctl(fd, UI_ABS_SETUP, &abs);
+}
+
+static int create_device(int kind, int index) {
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    ioctl(fd, UI_SET_EVBIT, EV_SYN);
+    switch (kind) {
+    case KIND_KEYBOARD:
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        ioctl(fd, UI_SET_EVBIT, EV_MSC);
+        ioctl(fd, UI_SET_MSCBIT, MSC_SCAN);
+        for (int k = KEY_Q; k <= KEY_P; k++) ioctl(fd, UI_SET_KEYBIT, k);
+        break;
+    case KIND_MOUSE:
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+        ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+        ioctl(fd, UI_SET_EVBIT, EV_REL);
+        ioctl(fd, UI_SET_RELBIT, REL_X);
+        ioctl(fd, UI_SET_RELBIT, REL_Y);
+        ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+        break;
+    case KIND_TOUCH:
+        ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+        ioctl(fd, UI_SET_EVBIT, EV_KEY);
+        ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH);
+        ioctl(fd, UI_SET_EVBIT, EV_ABS);
+        uinput_abs(fd, ABS_X, 4095);
+        uinput_abs(fd, ABS_Y, 4095);
+        uinput_abs(fd, ABS_MT_SLOT, 9);
+        uinput_abs(fd, ABS_MT_TRACKING_ID, 65535);
+        uinput_abs(fd, ABS_MT_POSITION_X, 4095);
+        uinput_abs(fd, ABS_MT_POSITION_Y, 4095);
+        break;
+    }
+    struct uinput_setup us = {0};
+    snprintf(us.name, sizeof(us.name), BENCH_NAME "-%s-%d", kind_names[kind], index);
+    us.id.bustype = BUS_VIRTUAL;
+    us.id.vendor = 0x1111;
+    us.id.product = (uint16_t)(0x5000 + kind);
+    if (ioctl(fd, UI_DEV_SETUP, &us) != 0 || ioctl(fd, UI_DEV_CREATE) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int put_ev(struct input_event *out, int n, int type, int code, int value) {
+    memset(&out[n], 0, sizeof(out[n]));
+    out[n].type = (uint16_t)type;
+    out[n].code = (uint16_t)code;
+    out[n].value = value;
+    return n + 1;
+}
+
+// One frame of the device's kind; every value changes so the input core
+// never filters one out as a duplicate.
+static int build_frame(int kind, unsigned long long seq, struct input_event *out, int n) {
+    switch (kind) {
+    case KIND_KEYBOARD: {
+        int key = KEY_Q + (int)((seq / 2) % (KEY_P - KEY_Q + 1));
+        n = put_ev(out, n, EV_MSC, MSC_SCAN, 0x70000 + key);
+        n = put_ev(out, n, EV_KEY, key, (seq & 1) ? 0 : 1);
+        break;
+    }
+    case KIND_MOUSE:
+        n = put_ev(out, n, EV_REL, REL_X, (seq & 1) ? 1 : -1);
+        n = put_ev(out, n, EV_REL, REL_Y, (seq & 2) ? 1 : -1);
+        break;
+    case KIND_TOUCH:
+        if (seq == 0) {
+            for (int c = 0; c < TOUCH_CONTACTS; c++) {
+                n = put_ev(out, n, EV_ABS, ABS_MT_SLOT, c);
+                n = put_ev(out, n, EV_ABS, ABS_MT_TRACKING_ID, c);
+            }
+            n = put_ev(out, n, EV_KEY, BTN_TOUCH, 1);
+        }
+        for (int c = 0; c < TOUCH_CONTACTS; c++) {
+            int pos = (int)((seq + (unsigned long long)c * 1000) % 4000);
+            n = put_ev(out, n, EV_ABS, ABS_MT_SLOT, c);
+            n = put_ev(out, n, EV_ABS, ABS_MT_POSITION_X, pos);
+            n = put_ev(out, n, EV_ABS, ABS_MT_POSITION_Y, 4000 - pos);
+        }
+        break;
+    }
+    return put_ev(out, n, EV_SYN, SYN_REPORT, 0);
+}
+
+static void *generator_thread(void *arg) {
+    struct generator *gen = arg;
+    struct input_event buf[MAX_BURST * FRAME_EVENTS_MAX];
+    const long long period_ns = 1000000000LL * gen->burst / gen->hz;
+    long long next_ns = now_ns();
+    while (!gen->stop) {
+        int n = 0;
+        for (int f = 0; f < gen->burst; f++)
+            n = build_frame(gen->kind, gen->seq++, buf, n);
+        ssize_t w = write(gen->fd, buf, (size_t)n * sizeof(buf[0]));
+        if (w > 0) {
+            for (int k = 0; k < (int)(w / (ssize_t)sizeof(buf[0])); k++)
+                if (buf[k].type == EV_SYN) gen->frames++;
+        }
+        next_ns += period_ns;
+        struct timespec abs = { .tv_sec = next_ns / 1000000000LL, .tv_nsec = next_ns % 1000000000LL };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abs, NULL);
+    }
+    gen->cpu_ns = thread_cpu_ns();
+    return NULL;
+}
+
+// ---- measurement -----------------------------------------------------------
+
+// Written by the single consuming thread of a run, read after ni_shutdown().
+static struct ni_latency_histogram g_hist;
+static unsigned long long g_seen;
+static unsigned long long g_frames;
+static bool g_measure_latency = true;
+
+static inline void account(const struct ni_event *ev) {
+    // losses are counted in frames, which NI_INIT_FLAG_TOUCH and the
+    // input core's duplicate filter leave intact
+    if (ev->type == NI_EV_SYN) {
+        if (ev->code == NI_SYN_REPORT) g_frames++;
+        return;
+    }
+    g_seen++;
+    if (!g_measure_latency) return;
+    long long lat = ni_now_ns() - ev->timestamp_ns;
+    uint64_t ns = lat > 0 ? (uint64_t)lat : 0;
+    g_hist.buckets[ni_hist_bucket(ns)]++;
+    g_hist.count++;
+    if (ns > g_hist.max_ns) g_hist.max_ns = ns;
+}
+
+static void on_event(const struct ni_event *ev, void *ud) {
+    (void)ud;
+    account(ev);
+}
+
+static void on_frame(const struct ni_event *evs, int count, void *ud) {
+    (void)ud;
+    for (int i = 0; i < count; i++) account(&evs[i]);
+}
+
+// Poll-side consumers; return false once nothing was queued.
+static bool consume_poll(void) {
+    struct ni_event evs[256];
+    int n = ni_poll(evs, 256);
+    for (int i = 0; i < n; i++) account(&evs[i]);
+    return n > 0;
+}
+
+static bool consume_zerocopy(void) {
+    struct ni_event_batch batch;
+    int n = ni_poll_acquire(&batch, 256);
+    if (n <= 0) return false;
+    for (int part = 0; part < 2; part++)
+        for (int i = 0; i < batch.count[part]; i++) account(&batch.events[part][i]);
+    ni_poll_release(&batch);
+    return true;
+}
+
+static int bench_filter(const struct ni_device_info *info, void *ud) {
+    (void)ud;
+    // grabbed so the synthetic keys and pointer never reach the desktop
+    return strncmp(info->name, BENCH_NAME, strlen(BENCH_NAME)) == 0 ? 1 | NI_FILTER_GRAB : 0;
+}
+
+struct config {
+    int count[KIND_COUNT];
+    int hz[KIND_COUNT];
+    int burst;
+    int seconds;
+    bool models[MODEL_COUNT];
+    size_t queue_capacity;
+    int cpu;
+    int flags;
+    const char *trace;
+    const char *format;
+    double max_p99_us, max_p999_us, min_mev_s;
+    long long max_drops;
+};
+
+struct result {
+    int model;
+    unsigned long long sent, frames, seen, dropped, missing; // sent, frames and missing in frames
+    double seconds;
+    double p50_us, p99_us, p999_us, max_us;
+    double cpu_ms_per_mev;
+    double mev_s;
+    double reads_per_wakeup;
+    unsigned queue_high_water;
+    double lib_p99_us;
+    bool pass;
+};
+
+static int run_model(const struct config *cfg, struct generator *gens, int ngens, int model,
+                     struct result *res) {
+    memset(&g_hist, 0, sizeof(g_hist));
+    g_seen = 0;
+    g_frames = 0;
+    memset(res, 0, sizeof(*res));
+    res->model = model;
+
+    struct ni_worker_config wc;
+    ni_worker_config_defaults(&wc);
+    wc.cpu_affinity = cfg->cpu;
+    wc.queue_capacity = cfg->queue_capacity;
+    int flags = cfg->flags | NI_INIT_FLAG_STATS;
+    if (cfg->trace) {
+        setenv("ASYNCINPUT_REPLAY", cfg->trace, 1);
+        flags |= NI_INIT_FLAG_REPLAY;
+    }
+    long long cpu0 = process_cpu_ns();
+    long long t0 = now_ns();
+    if (ni_init_with_worker_config(flags, &wc) != 0) {
+        fprintf(stderr, "ni_init failed for %s\n", model_names[model]);
+        return -1;
+    }
+    if (!cfg->trace) ni_set_device_filter(bench_filter, NULL);
+    if (model == MODEL_CALLBACK) ni_register_callback(on_event, NULL, 0);
+    if (model == MODEL_BATCH) ni_register_batch_callback(on_frame, NULL, 0);
+    // whatever a replay queued before the callback existed
+    while (model <= MODEL_BATCH && consume_poll()) {}
+
+    if (!cfg->trace) {
+        usleep(100000);
+        cpu0 = process_cpu_ns();
+        t0 = now_ns();
+        for (int i = 0; i < ngens; i++) {
+            gens[i].stop = false;
+            gens[i].frames = 0;
+            pthread_create(&gens[i].thread, NULL, generator_thread, &gens[i]);
+        }
+    }
+    long long end = t0 + (long long)cfg->seconds * 1000000000LL;
+    for (;;) {
+        bool running = cfg->trace ? ni_replay_pending() > 0 : now_ns() < end;
+        if (!running) break;
+        if (model == MODEL_POLL || model == MODEL_ZEROCOPY) {
+            if (ni_wait_events(10000000LL) > 0)
+                while (model == MODEL_POLL ? consume_poll() : consume_zerocopy()) {}
+        } else {
+            usleep(cfg->trace ? 1000 : 10000);
+        }
+    }
+    long long gen_cpu = 0;
+    if (!cfg->trace) {
+        for (int i = 0; i < ngens; i++) gens[i].stop = true;
+        for (int i = 0; i < ngens; i++) {
+            pthread_join(gens[i].thread, NULL);
+            res->sent += gens[i].frames;
+            gen_cpu += gens[i].cpu_ns;
+        }
+        usleep(20000); // let the reader catch up with the last bursts
+    }
+    while (model == MODEL_ZEROCOPY ? consume_zerocopy() : consume_poll()) {}
+    long long t1 = now_ns();
+    long long cpu = process_cpu_ns() - cpu0 - gen_cpu;
+
+    struct ni_stats st;
+    if (ni_get_stats(&st) == 0) {
+        res->reads_per_wakeup = st.wakeups ? (double)st.reads / (double)st.wakeups : 0.0;
+        res->queue_high_water = st.queue_high_water;
+        res->lib_p99_us = ni_hist_percentile(&st.kernel_to_enqueue, 0.99) / 1000.0;
+    }
+    res->dropped = ni_dropped_events();
+    ni_shutdown();
+
+    res->seen = g_seen;
+    res->frames = g_frames;
+    if (cfg->trace) res->sent = res->frames; // every replayed frame is either seen or dropped
+    res->missing = res->sent > res->frames ? res->sent - res->frames : 0;
+    res->seconds = (t1 - t0) / 1e9;
+    res->mev_s = res->seconds > 0 ? res->seen / res->seconds / 1e6 : 0.0;
+    res->cpu_ms_per_mev = res->seen ? (double)cpu / (double)res->seen : 0.0; // ns/event == ms/Mevent
+    res->p50_us = ni_hist_percentile(&g_hist, 0.50) / 1000.0;
+    res->p99_us = ni_hist_percentile(&g_hist, 0.99) / 1000.0;
+    res->p999_us = ni_hist_percentile(&g_hist, 0.999) / 1000.0;
+    res->max_us = g_hist.max_ns / 1000.0;
+
+    res->pass = true;
+    if (g_measure_latency && cfg->max_p99_us > 0 && res->p99_us > cfg->max_p99_us) res->pass = false;
+    if (g_measure_latency && cfg->max_p999_us > 0 && res->p999_us > cfg->max_p999_us) res->pass = false;
+    if (cfg->min_mev_s > 0 && res->mev_s < cfg->min_mev_s) res->pass = false;
+    if (cfg->max_drops >= 0 && (long long)(res->dropped + res->missing) > cfg->max_drops) res->pass = false;
+    return 0;
+}
+
+// ---- reporting -------------------------------------------------------------
+
+static void report_header(const struct config *cfg) {
+    if (strcmp(cfg->format, "csv") == 0) {
+        printf("model,seconds,frames_sent,frames_seen,events,dropped,missing_frames,mev_s,cpu_ms_per_mev,"
+               "p50_us,p99_us,p999_us,max_us,lib_p99_us,reads_per_wakeup,queue_high_water,pass\n");
+    } else if (strcmp(cfg->format, "json") == 0) {
+        printf("{\"source\":\"%s\",\"devices\":{", cfg->trace ? "replay" : "uinput");
+        for (int k = 0; k < KIND_COUNT; k++)
+            printf("%s\"%s\":{\"count\":%d,\"hz\":%d}", k ? "," : "", kind_names[k],
+                   cfg->trace ? 0 : cfg->count[k], cfg->hz[k]);
+        printf("},\"burst\":%d,\"queue_capacity\":%zu,\"results\":[", cfg->burst, cfg->queue_capacity);
+    } else if (cfg->trace) {
+        printf("replay %s\n", cfg->trace);
+    } else {
+        printf("load: %d keyboard @%d Hz, %d mouse @%d Hz, %d touch @%d Hz, burst %d, %d s per model\n",
+               cfg->count[KIND_KEYBOARD], cfg->hz[KIND_KEYBOARD], cfg->count[KIND_MOUSE],
+               cfg->hz[KIND_MOUSE], cfg->count[KIND_TOUCH], cfg->hz[KIND_TOUCH],
+               cfg->burst, cfg->seconds);
+    }
+}
+
+static void report(const struct config *cfg, const struct result *r, bool first) {
+    const char *name = model_names[r->model];
+    if (strcmp(cfg->format, "csv") == 0) {
+        printf("%s,%.3f,%llu,%llu,%llu,%llu,%llu,%.3f,%.2f,", name, r->seconds, r->sent, r->frames,
+               r->seen, r->dropped, r->missing, r->mev_s, r->cpu_ms_per_mev);
+        if (g_measure_latency)
+            printf("%.2f,%.2f,%.2f,%.2f,%.2f,", r->p50_us, r->p99_us, r->p999_us, r->max_us, r->lib_p99_us);
+        else
+            printf(",,,,,"); // empty fields: no kernel timestamps in a replay
+        printf("%.2f,%u,%d\n", r->reads_per_wakeup, r->queue_high_water, r->pass);
+    } else if (strcmp(cfg->format, "json") == 0) {
+        printf("%s{\"model\":\"%s\",\"seconds\":%.3f,\"frames_sent\":%llu,\"frames_seen\":%llu,"
+               "\"events\":%llu,\"dropped\":%llu,\"missing_frames\":%llu,\"mev_s\":%.3f,\"cpu_ms_per_mev\":%.2f,",
+               first ? "" : ",", name, r->seconds, r->sent, r->frames, r->seen, r->dropped, r->missing,
+               r->mev_s, r->cpu_ms_per_mev);
+        if (g_measure_latency)
+            printf("\"latency_us\":{\"p50\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f},"
+                   "\"lib_p99_us\":%.2f,", r->p50_us, r->p99_us, r->p999_us, r->max_us, r->lib_p99_us);
+        else
+            printf("\"latency_us\":null,");
+        printf("\"reads_per_wakeup\":%.2f,\"queue_high_water\":%u,\"pass\":%s}",
+               r->reads_per_wakeup, r->queue_high_water, r->pass ? "true" : "false");
+    } else {
+        printf("%-9s %10llu events %8.3f Mev/s  cpu %8.2f ms/Mev  dropped %llu missing %llu frames",
+               name, r->seen, r->mev_s, r->cpu_ms_per_mev, r->dropped, r->missing);
+        if (g_measure_latency)
+            printf("  p50 %.1f p99 %.1f p99.9 %.1f max %.1f us", r->p50_us, r->p99_us, r->p999_us, r->max_us);
+        printf("  reads/wakeup %.1f  high-water %u%s\n", r->reads_per_wakeup, r->queue_high_water,
+               r->pass ? "" : "  FAIL");
+    }
+    fflush(stdout);
+}
+
+static void report_footer(const struct config *cfg, bool pass) {
+    if (strcmp(cfg->format, "json") == 0)
+        printf("],\"pass\":%s}\n", pass ? "true" : "false");
+}
+
+// ---- driver ----------------------------------------------------------------
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "Usage: %s [-k n[:hz]] [-m n[:hz]] [-t n[:hz]] [-b frames] [-s seconds]\n"
+        "       [-c callback,batch,poll,zerocopy] [-q capacity] [-C cpu] [-T]\n"
+        "       [-r trace] [-f text|json|csv] [-P p99_us] [-Q p999_us] [-E mev_s] [-X drops]\n"
+        "  -k/-m/-t  keyboards (default 1:1000), mice (1:8000), touch screens (1:240)\n"
+        "  -b        frames per write(), a burst of input the reader sees at once (1)\n"
+        "  -s        seconds per model (3)\n"
+        "  -T        decode multitouch with NI_INIT_FLAG_TOUCH\n"
+        "  -r        replay a trace as fast as possible instead of uinput devices\n"
+        "  -P/-Q/-E/-X  gates: max p99, max p99.9, min Mevents/s, max dropped events\n"
+        "            plus missing frames; exit status 3 when a model misses one\n", argv0);
+}
+
+static void parse_devices(const char *arg, int *count, int *hz) {
+    *count = atoi(arg);
+    const char *colon = strchr(arg, ':');
+    if (colon && atoi(colon + 1) > 0) *hz = atoi(colon + 1);
+}
+
+static bool parse_models(const char *arg, bool *models) {
+    memset(models, 0, MODEL_COUNT * sizeof(*models));
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", arg);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        int m = 0;
+        while (m < MODEL_COUNT && strcmp(tok, model_names[m]) != 0) m++;
+        if (m == MODEL_COUNT) return false;
+        models[m] = true;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    struct config cfg = {
+        .count = { 1, 1, 1 },
+        .hz = { 1000, 8000, 240 },
+        .burst = 1,
+        .seconds = 3,
+        .models = { true, true, true, true },
+        .queue_capacity = 1 << 16,
+        .cpu = -1,
+        .format = "text",
+        .max_drops = -1,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "k:m:t:b:s:c:q:C:Tr:f:P:Q:E:X:h")) != -1) {
+        switch (opt) {
+        case 'k': parse_devices(optarg, &cfg.count[KIND_KEYBOARD], &cfg.hz[KIND_KEYBOARD]); break;
+        case 'm': parse_devices(optarg, &cfg.count[KIND_MOUSE], &cfg.hz[KIND_MOUSE]); break;
+        case 't': parse_devices(optarg, &cfg.count[KIND_TOUCH], &cfg.hz[KIND_TOUCH]); break;
+        case 'b': cfg.burst = atoi(optarg); break;
+        case 's': cfg.seconds = atoi(optarg); break;
+        case 'c':
+            if (!parse_models(optarg, cfg.models)) { usage(argv[0]); return 2; }
+            break;
+        case 'q': cfg.queue_capacity = (size_t)strtoull(optarg, NULL, 0); break;
+        case 'C': cfg.cpu = atoi(optarg); break;
+        case 'T': cfg.flags |= NI_INIT_FLAG_TOUCH; break;
+        case 'r': cfg.trace = optarg; break;
+        case 'f': cfg.format = optarg; break;
+        case 'P': cfg.max_p99_us = atof(optarg); break;
+        case 'Q': cfg.max_p999_us = atof(optarg); break;
+        case 'E': cfg.min_mev_s = atof(optarg); break;
+        case 'X': cfg.max_drops = atoll(optarg); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (cfg.burst < 1 || cfg.burst > MAX_BURST || cfg.seconds < 1 ||
+        (strcmp(cfg.format, "text") && strcmp(cfg.format, "json") && strcmp(cfg.format, "csv"))) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct generator gens[MAX_GEN];
+    int ngens = 0;
+    if (cfg.trace) {
+        // replayed timestamps are rebased, not kernel times
+        g_measure_latency = false;
+    } else {
+        for (int kind = 0; kind < KIND_COUNT; kind++) {
+            for (int i = 0; i < cfg.count[kind]; i++) {
+                if (ngens == MAX_GEN) {
+                    fprintf(stderr, "at most %d devices\n", MAX_GEN);
+                    return 2;
+                }
+                int fd = create_device(kind, i);
+                if (fd < 0) {
+                    fprintf(stderr, "cannot create a uinput %s (permissions? try -r trace)\n", kind_names[kind]);
+                    for (int j = 0; j < ngens; j++) { ioctl(gens[j].fd, UI_DEV_DESTROY); close(gens[j].fd); }
+                    return 1;
+                }
+                gens[ngens++] = (struct generator){ .fd = fd, .kind = kind, .hz = cfg.hz[kind], .burst = cfg.burst };
+            }
+        }
+        if (!ngens) {
+            usage(argv[0]);
+            return 2;
+        }
+        sleep(1); // udev creates the nodes asynchronously
+    }
+
+    report_header(&cfg);
+    bool pass = true, first = true;
+    int rc = 0;
+    for (int model = 0; model < MODEL_COUNT && rc == 0; model++) {
+        if (!cfg.models[model]) continue;
+        struct result res;
+        rc = run_model(&cfg, gens, ngens, model, &res);
+        if (rc != 0) break;
+        report(&cfg, &res, first);
+        first = false;
+        pass &= res.pass;
+    }
+    report_footer(&cfg, pass);
+
+    for (int i = 0; i < ngens; i++) {
+        ioctl(gens[i].fd, UI_DEV_DESTROY);
+        close(gens[i].fd);
+    }
+    if (rc != 0) return 1;
+    return pass ? 0 : 3;
+}
@@ -1,7 +1,15 @@
 // Agent: Agent Mode, Date: 2025-08-16
 // Benchmark using libasyncinput zero-cost abstraction. Generates high-rate events
 // with uinput and measures kernel->userspace latency via ni_event.timestamp_ns.
-// Usage: ./benchmark_asyncinput [seconds] [hz]
+// Runs once with the blocking worker and once busy-polling for spin_us after each
+// wakeup (0 skips that run), then prints the latency delta.
+// Usage: ./benchmark_asyncinput [seconds] [hz] [spin_us] [cpu]
+//
+// Without /dev/uinput or root, -w writes a synthetic trace of the same
+// frames and -r replays a trace (synthetic or from ni_record_start()) as
+// fast as possible to measure the library's dispatch throughput.
+// Usage: ./benchmark_asyncinput -w trace [frames]
+//        ./benchmark_asyncinput -r trace
 
 #include "asyncinput.h"
 
@@ -10,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -91,9 +100,7 @@ static long long g_max_lat = 0;
 static void on_event(const struct ni_event *ev, void *ud) {
     (void)ud;
     if (!ni_is_key_event(ev) && ev->type != NI_EV_MSC) return;
-    struct timeval tv; gettimeofday(&tv, NULL);
-    long long recv = (long long)tv.tv_sec * 1000000000LL + (long long)tv.tv_usec * 1000LL;
-    long long lat = recv - ev->timestamp_ns;
+    long long lat = ni_now_ns() - ev->timestamp_ns;
     if (lat < 0) return;
     pthread_mutex_lock(&g_stats_lock);
     g_count++;
@@ -103,31 +110,31 @@ static void on_event(const struct ni_event *ev, void *ud) {
     pthread_mutex_unlock(&g_stats_lock);
 }
 
-int main(int argc, char** argv) {
-    int seconds = 5;
-    int hz = 10000;
-    if (argc > 1) { int s = atoi(argv[1]); if (s > 0) seconds = s; }
-    if (argc > 2) { int h = atoi(argv[2]); if (h > 0) hz = h; }
+struct phase_result {
+    unsigned long long count;
+    double avg_us, min_us, max_us;
+};
 
-    int ufd = create_uinput_device();
-    if (ufd < 0) {
-        fprintf(stderr, "Failed to open /dev/uinput (permissions)\n");
-        return 1;
-    }
-
-    if (ni_init(0) != 0) {
+static int run_phase(int ufd, int seconds, int hz, int spin_us, int cpu, struct phase_result *res) {
+    struct ni_worker_config cfg;
+    ni_worker_config_defaults(&cfg);
+    cfg.spin_us = spin_us;
+    cfg.cpu_affinity = cpu;
+    const char *mode = spin_us ? "busy-poll" : "blocking";
+    if (ni_init_with_worker_config(0, &cfg) != 0) {
         fprintf(stderr, "ni_init failed\n");
-        ioctl(ufd, UI_DEV_DESTROY); close(ufd);
-        return 1;
+        return -1;
     }
 
     // Use worker-thread callback path (zero-copy from library pov)
     if (ni_register_callback(on_event, NULL, 0) != 0) {
         fprintf(stderr, "ni_register_callback failed\n");
         ni_shutdown();
-        ioctl(ufd, UI_DEV_DESTROY); close(ufd);
-        return 1;
+        return -1;
     }
+    pthread_mutex_lock(&g_stats_lock);
+    g_count = 0; g_sum_lat = 0; g_min_lat = 0x7fffffffffffffffLL; g_max_lat = 0;
+    pthread_mutex_unlock(&g_stats_lock);
 
     pthread_t gen_thr; gen_args_t ga = { .fd = ufd, .hz = hz, .seconds = seconds, .stop = false };
     pthread_create(&gen_thr, NULL, generator_thread, &ga);
@@ -141,16 +148,17 @@ int main(int argc, char** argv) {
             pthread_mutex_lock(&g_stats_lock);
             count = g_count; sum = g_sum_lat; minl = g_min_lat; maxl = g_max_lat;
             pthread_mutex_unlock(&g_stats_lock);
-            double avg_us = 0.0, min_us = 0.0, max_us = 0.0;
+            res->count = count;
+            res->avg_us = res->min_us = res->max_us = 0.0;
             if (count) {
                 unsigned long long sum_ull = (unsigned long long)sum;
-                avg_us = (double)(sum_ull / count) / 1000.0;
-                if (minl != 0x7fffffffffffffffLL) min_us = (double)minl / 1000.0;
-                max_us = (double)maxl / 1000.0;
+                res->avg_us = (double)(sum_ull / count) / 1000.0;
+                if (minl != 0x7fffffffffffffffLL) res->min_us = (double)minl / 1000.0;
+                res->max_us = (double)maxl / 1000.0;
             }
-            printf("[%.2fs] events=%llu, avg=%.3f us, min=%.3f us, max=%.3f us\n",
-                   (t - start) / 1e9,
-                   count, avg_us, min_us, max_us);
+            printf("[%s %.2fs] events=%llu, avg=%.3f us, min=%.3f us, max=%.3f us\n",
+                   mode, (t - start) / 1e9,
+                   count, res->avg_us, res->min_us, res->max_us);
             fflush(stdout);
             next_print += 100000000LL;
         }
@@ -159,10 +167,124 @@ int main(int argc, char** argv) {
 
     ga.stop = true;
     pthread_join(gen_thr, NULL);
+    ni_shutdown();
+    return 0;
+}
 
-    ioctl(ufd, UI_DEV_DESTROY);
-    close(ufd);
+// One device, frames of MSC_SCAN + SYN_REPORT 100 us apart (10 kHz),
+// written in records of 32 frames like a busy reader would see them.
+static int write_trace(const char *path, long long frames) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    struct ni_trace_header h = {0};
+    h.magic = NI_TRACE_MAGIC;
+    h.version = NI_TRACE_VERSION;
+    h.event_size = sizeof(struct ni_event);
+    h.info_size = sizeof(struct ni_device_info);
+    h.clock = NI_CLOCK_MONOTONIC;
+    fwrite(&h, sizeof(h), 1, f);
+
+    struct ni_device_info info = {0};
+    info.id = 0;
+    snprintf(info.path, sizeof(info.path), "/dev/input/event0");
+    snprintf(info.name, sizeof(info.name), "asyncinput-bench-10khz");
+    info.vendor = 0x1111;
+    info.product = 0x4444;
+    struct ni_trace_record r = { NI_TRACE_DEVICE, ni_trace_record_size(sizeof(info)), 0, 0 };
+    static const char pad[8];
+    fwrite(&r, sizeof(r), 1, f);
+    fwrite(&info, sizeof(info), 1, f);
+    fwrite(pad, r.size - sizeof(r) - sizeof(info), 1, f);
+
+    struct ni_event evs[64];
+    for (long long frame = 0; frame < frames; frame += 32) {
+        int n = 0;
+        for (long long k = frame; k < frame + 32 && k < frames; k++) {
+            struct ni_event scan = { .device_id = 0, .type = NI_EV_MSC, .code = NI_MSC_SCAN,
+                                     .value = (int)k, .timestamp_ns = k * 100000LL };
+            struct ni_event syn = scan;
+            syn.type = NI_EV_SYN; syn.code = NI_SYN_REPORT; syn.value = 0;
+            evs[n++] = scan;
+            evs[n++] = syn;
+        }
+        size_t len = (size_t)n * sizeof(evs[0]);
+        r = (struct ni_trace_record){ NI_TRACE_EVENTS, ni_trace_record_size(len), 0, (uint32_t)n };
+        fwrite(&r, sizeof(r), 1, f);
+        fwrite(evs, len, 1, f);
+        fwrite(pad, r.size - sizeof(r) - len, 1, f);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// the replay thread is the only caller, no lock needed
+static unsigned long long g_replayed = 0;
+
+static void on_replay_event(const struct ni_event *ev, void *ud) {
+    (void)ev; (void)ud;
+    g_replayed++;
+}
+
+static int run_replay(const char *path) {
+    setenv("ASYNCINPUT_REPLAY", path, 1);
+    long long start = now_ns();
+    if (ni_init(NI_INIT_FLAG_REPLAY) != 0) {
+        fprintf(stderr, "cannot replay %s\n", path);
+        return -1;
+    }
+    ni_register_callback(on_replay_event, NULL, 0);
+    while (ni_replay_pending() > 0)
+        usleep(1000);
+    // events replayed before the callback was registered were queued
+    struct ni_event early[256];
+    int n;
+    while ((n = ni_poll(early, 256)) > 0)
+        g_replayed += (unsigned long long)n;
+    double secs = (now_ns() - start) / 1e9;
+    printf("replayed %llu events in %.3f s: %.2f Mevents/s, dropped=%llu\n",
+           g_replayed, secs, g_replayed / secs / 1e6,
+           (unsigned long long)ni_dropped_events());
     ni_shutdown();
     return 0;
 }
 
+int main(int argc, char** argv) {
+    if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+        long long frames = argc > 3 ? atoll(argv[3]) : 1000000;
+        if (write_trace(argv[2], frames) != 0) {
+            fprintf(stderr, "cannot write %s\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "-r") == 0)
+        return run_replay(argv[2]) == 0 ? 0 : 1;
+
+    int seconds = 5;
+    int hz = 10000;
+    int spin_us = 200;
+    int cpu = -1;
+    if (argc > 1) { int s = atoi(argv[1]); if (s > 0) seconds = s; }
+    if (argc > 2) { int h = atoi(argv[2]); if (h > 0) hz = h; }
+    if (argc > 3) spin_us = atoi(argv[3]);
+    if (argc > 4) cpu = atoi(argv[4]);
+
+    int ufd = create_uinput_device();
+    if (ufd < 0) {
+        fprintf(stderr, "Failed to open /dev/uinput (permissions)\n");
+        return 1;
+    }
+
+    struct phase_result blocking = {0}, spin = {0};
+    int rc = run_phase(ufd, seconds, hz, 0, cpu, &blocking);
+    if (rc == 0 && spin_us != 0) {
+        rc = run_phase(ufd, seconds, hz, spin_us, cpu, &spin);
+        if (rc == 0 && blocking.count && spin.count)
+            printf("busy-poll delta (spin_us=%d): avg %+.3f us, min %+.3f us, max %+.3f us\n",
+                   spin_us, spin.avg_us - blocking.avg_us,
+                   spin.min_us - blocking.min_us, spin.max_us - blocking.max_us);
+    }
+
+    ioctl(ufd, UI_DEV_DESTROY);
+    close(ufd);
+    return rc == 0 ? 0 : 1;
+}
@@ -46,40 +46,44 @@ static void mouse_handler(const struct ni_event *ev, const struct ni_device_info
     }
 }
 
-// Device filter to identify device types
+// Device filter to identify device types. Runs while devices are opened and
+// records the ids of keyboards and mice so callbacks can be bound per device.
+#define MAX_TRACKED 32
+static int g_keyboards[MAX_TRACKED], g_nkeyboards;
+static int g_mice[MAX_TRACKED], g_nmice;
+
+static int is_keyboard(const struct ni_device_info *info) {
+    // Match keyboards (usually contain "keyboard" in name or specific vendors)
+    return (strstr(info->name, "keyboard") != NULL ||
+            strstr(info->name, "Keyboard") != NULL ||
+            info->vendor == 0x04f2);  // Example: Chicony vendor
+}
+
+static int is_mouse(const struct ni_device_info *info) {
+    // Match mice (contain "mouse" in name or specific vendors)
+    return (strstr(info->name, "mouse") != NULL ||
+            strstr(info->name, "Mouse") != NULL ||
+            info->vendor == 0x046d);  // Example: Logitech vendor
+}
+
 static int device_type_filter(const struct ni_device_info *info, void *user_data) {
-    const char *device_type = (const char*)user_data;
-    
-    if (strcmp(device_type, "keyboard") == 0) {
-        // Match keyboards (usually contain "keyboard" in name or specific vendors)
-        return (strstr(info->name, "keyboard") != NULL || 
-                strstr(info->name, "Keyboard") != NULL ||
-                info->vendor == 0x04f2);  // Example: Chicony vendor
-    } else if (strcmp(device_type, "mouse") == 0) {
-        // Match mice (contain "mouse" in name or specific vendors)
-        return (strstr(info->name, "mouse") != NULL || 
-                strstr(info->name, "Mouse") != NULL ||
-                info->vendor == 0x046d);  // Example: Logitech vendor
+    (void)user_data;
+    if (is_keyboard(info)) {
+        if (g_nkeyboards < MAX_TRACKED) g_keyboards[g_nkeyboards++] = info->id;
+        return 1;
     }
-    return 0;  // Don't match other devices
+    if (is_mouse(info)) {
+        if (g_nmice < MAX_TRACKED) g_mice[g_nmice++] = info->id;
+        return 1;
+    }
+    return 0;  // Don't open other devices
 }
 
-// Global fallback handler moved to file scope (C89/C99 portable)
-static void global_fallback_handler(const struct ni_event *ev, void *user_data) {
-    // This is the complex approach we want to avoid:
-    // Need to look up device info and branch on device type
+// Global handler: sees every event without device context, shown for comparison
+static void global_handler(const struct ni_event *ev, void *user_data) {
     (void)user_data;
-    
-    // Simulate what device-specific callbacks would avoid:
-    // Complex branching logic that hurts performance
-    if (ni_is_key_event(ev) && ev->value == 1) {
-        printf("GLOBAL: Key event 0x%x (no device context available)\n", ev->code);
-    } else if (ni_is_rel_event(ev) && (ev->code == NI_REL_X || ev->code == NI_REL_Y)) {
-        printf("GLOBAL: %s movement %+d (no device context)\n",
-               (ev->code == NI_REL_X) ? "X" : "Y", ev->value);
-    } else if (ni_button_down(ev)) {
-        printf("GLOBAL: Button 0x%x pressed (no device context)\n", ev->code);
-    }
+    if (ni_is_key_event(ev) && ev->value == 1)
+        printf("GLOBAL: Key event 0x%x from device %d\n", ev->code, ev->device_id);
 }
 
 int main(int argc, char** argv) {
@@ -96,44 +100,43 @@ int main(int argc, char** argv) {
         fprintf(stderr, "ni_init failed (permissions for /dev/input/event*?)\n");
         return 1;
     }
-    
-    // Register device-specific callbacks instead of one global callback
-    
-    // First, register callback for all keyboards
-    // (In the future API, this would work. For now, this is conceptual)
-    /*
-    ni_set_device_filter(device_type_filter, "keyboard");
-    int kb_cb_id = ni_register_device_callback(-1, keyboard_handler, NULL, 
-                                               NI_CB_FLAG_HIGH_PRIORITY);
-    
-    // Then register callback for all mice
-    ni_set_device_filter(device_type_filter, "mouse");
-    int mouse_cb_id = ni_register_device_callback(-1, mouse_handler, NULL,
-                                                  NI_CB_FLAG_HIGH_PRIORITY);
-    */
-    
-    // For now, fall back to global callback with device type detection
-    // This demonstrates the benefit of the future device-specific API
-    
-    if (ni_register_callback(global_fallback_handler, NULL, 0) != 0) {
+
+    // Setting the filter re-evaluates every open device, recording the ids
+    ni_set_device_filter(device_type_filter, NULL);
+
+    // Bind one handler per device: no device type checks in the hot path
+    int cb_ids[2 * MAX_TRACKED];
+    int ncb = 0;
+    for (int i = 0; i < g_nkeyboards; i++) {
+        int id = ni_register_device_callback(g_keyboards[i], keyboard_handler, NULL,
+                                             NI_CB_FLAG_HIGH_PRIORITY);
+        if (id > 0) cb_ids[ncb++] = id;
+    }
+    for (int i = 0; i < g_nmice; i++) {
+        int id = ni_register_device_callback(g_mice[i], mouse_handler, NULL, 0);
+        if (id > 0) cb_ids[ncb++] = id;
+    }
+    printf("Bound %d keyboard(s) and %d mouse/mice\n", g_nkeyboards, g_nmice);
+
+    // The global callback still works alongside device callbacks
+    if (ni_register_callback(global_handler, NULL, 0) != 0) {
         fprintf(stderr, "ni_register_callback failed\n");
         ni_shutdown();
         return 1;
     }
-    
+
     long long start = now_ns();
-    printf("Listening for input events...\n");
-    printf("(Note: Device-specific callbacks would eliminate the branching overhead)\n\n");
-    
+    printf("Listening for input events...\n\n");
+
     while (now_ns() - start < (long long)seconds * 1000000000LL) {
         usleep(10000);  // 10ms
     }
-    
+
     printf("\nShutting down...\n");
-    
-    // In future API: ni_unregister_device_callback(kb_cb_id);
-    // In future API: ni_unregister_device_callback(mouse_cb_id);
-    
+
+    for (int i = 0; i < ncb; i++)
+        ni_unregister_device_callback(cb_ids[i]);
+
     ni_shutdown();
     return 0;
 }
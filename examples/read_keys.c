@@ -2,7 +2,6 @@
 #include "asyncinput.h"
 
 #include <stdio.h>
-#include <unistd.h>
 #include <time.h>
 #include <stdint.h>
 #include <limits.h>
@@ -34,7 +33,10 @@ main(int argc, char** argv)
     long long min_latency = LLONG_MAX;
     long long max_latency = 0;
 
-    while (now_ns() < end_time) {
+    long long t;
+    while ((t = now_ns()) < end_time) {
+        // Block until events arrive instead of sleeping between polls
+        if (ni_wait_events(end_time - t) <= 0) continue;
         struct ni_event ev[64];
         int n = ni_poll(ev, 64);
         long long recv_ns = now_ns();
@@ -46,7 +48,6 @@ main(int argc, char** argv)
             if (lat < min_latency) min_latency = lat;
             if (lat > max_latency) max_latency = lat;
         }
-        usleep(5000);
     }
 
     double avg_us = 0.0;
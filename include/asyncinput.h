@@ -814,6 +814,14 @@ extern "C" {
 #  define NI_BTN_MIDDLE   0x112
 #  define NI_BTN_SIDE     0x113
 #  define NI_BTN_EXTRA    0x114
+#  define NI_BTN_MOUSE    0x110
+#  define NI_BTN_TASK     0x117
+   /* array sizes of struct ni_device_state, same as Linux */
+#  define NI_EV_CNT       0x20
+#  define NI_KEY_CNT      0x300
+#  define NI_INPUT_PROP_CNT 0x20
+#  define NI_REL_CNT      0x10
+#  define NI_ABS_CNT      0x40
 
    /* When building the SDL stub backend, align NI_KEY_* to SDL scancodes so we can support all keys. */
 #  if defined(ASYNCINPUT_STUB_SDL)
@@ -1062,19 +1070,73 @@ extern "C" {
 #  define NI_MOUSE_BUTTON 2
 #endif
 
+/* Synthetic event of the multitouch decoder, see NI_INIT_FLAG_TOUCH: code
+ * is the slot, value its tracking id (-1 once the contact lifts), x/y the
+ * ABS_MT_POSITION_X/Y and extra ABS_MT_PRESSURE. */
+#ifndef NI_EV_TOUCH
+#  define NI_EV_TOUCH 0x2FE
+#endif
+
 /* Public event structure */
 struct ni_event {
 	int device_id;     /* stable ID assigned by library for the device */
 	int type;          /* NI_EV_* (maps to platform native type) */
 	int code;          /* NI_KEY_* (for EV_KEY) or platform native for other types */
 	int value;         /* 1=down, 0=up, or axis delta/value */
-	long long timestamp_ns; /* kernel/device-provided timestamp if available; otherwise CLOCK_MONOTONIC */
+	long long timestamp_ns; /* kernel/device-provided timestamp if available, in the ni_now_ns() timebase */
 	/* Optional compatibility fields for NI_EV_MOUSE synthetic events */
 	int x;             /* relative X for NI_MOUSE_MOVE (if provided) */
 	int y;             /* relative Y for NI_MOUSE_MOVE (if provided) */
 	int extra;         /* button id or extra data for NI_MOUSE_BUTTON, etc. */
 };
 
+/*
+ * 16-byte event for ni_poll_compact(), queued in this layout when the
+ * library is initialized with NI_INIT_FLAG_COMPACT. timestamp_ns is
+ * base_ns + ts_delta_ns, with base_ns returned per ni_poll_compact() call.
+ * device is device_id truncated to 16 bits (0xFFFF = -1, 0xFFFE = -2).
+ * NI_MOUSE_MOVE packs x in the low and y in the high 16 bits of value and
+ * NI_MOUSE_BUTTON keeps extra in aux. NI_EV_TOUCH packs x/y the same way
+ * and keeps the low 15 bits of the tracking id in aux (0xFFFF = -1); its
+ * pressure is not kept.
+ */
+struct ni_event_compact {
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+	uint16_t device;
+	uint16_t aux;
+	uint32_t ts_delta_ns;
+};
+
+/*
+ * Events handed out in place by ni_poll_acquire(), oldest first: events[0]
+ * then events[1], which is only set when the ring wrapped. reserved belongs
+ * to the library.
+ */
+struct ni_event_batch {
+	const struct ni_event *events[2];
+	int count[2];
+	int total;
+	void *reserved;
+};
+
+static inline void ni_event_from_compact(const struct ni_event_compact *c, int64_t base_ns, struct ni_event *out) {
+    out->device_id = (int16_t)c->device;
+    out->type = c->type;
+    out->code = c->code;
+    out->value = c->value;
+    out->timestamp_ns = base_ns + c->ts_delta_ns;
+    out->x = out->y = out->extra = 0;
+    if ((c->type == NI_EV_MOUSE && c->code == NI_MOUSE_MOVE) || c->type == NI_EV_TOUCH) {
+        out->x = (int16_t)(c->value & 0xffff);
+        out->y = (int16_t)((uint32_t)c->value >> 16);
+        out->value = c->type == NI_EV_TOUCH ? (c->aux == 0xffff ? -1 : c->aux) : 0;
+    } else if (c->type == NI_EV_MOUSE) {
+        out->extra = c->aux;
+    }
+}
+
 /* Device info for filtering */
 struct ni_device_info {
     int id;                 /* library-assigned id (proposed) */
@@ -1084,19 +1146,122 @@ struct ni_device_info {
     unsigned short product; /* from EVIOCGID */
     unsigned short version; /* from EVIOCGID */
     char name[256];         /* from EVIOCGNAME if available */
+    /* capabilities from EVIOCGBIT and EVIOCGPROP, test with ni_bit_test() */
+    unsigned char ev_bits[(NI_EV_CNT + 7) / 8];     /* NI_EV_* */
+    unsigned char key_bits[(NI_KEY_CNT + 7) / 8];   /* NI_KEY_* and NI_BTN_* */
+    unsigned char rel_bits[(NI_REL_CNT + 7) / 8];   /* NI_REL_* */
+    unsigned char abs_bits[(NI_ABS_CNT + 7) / 8];   /* NI_ABS_* */
+    unsigned char prop_bits[(NI_INPUT_PROP_CNT + 7) / 8]; /* NI_INPUT_PROP_* */
 };
 
+static inline int ni_bit_test(const unsigned char *bits, int bit) {
+    return (bits[bit / 8] >> (bit % 8)) & 1;
+}
+
 typedef int (*ni_device_filter)(const struct ni_device_info *info, void *user_data);
 
+/* Filter result flag: return 1 | NI_FILTER_GRAB to keep a device and grab
+ * it with ni_grab_device() as it is opened. The flag only ever grabs. */
+#define NI_FILTER_GRAB 0x100
+
 /* Set a device filter; only matching devices will be opened.
  * If called after ni_init, the library will rescan devices and close non-matching ones.
+ * On Linux the filter first sees the info sysfs has for a node, so a device it
+ * rejects is never opened; an accepted one is asked again with the ioctl info.
  * Returns 0 on success.
  */
 int ni_set_device_filter(ni_device_filter filter, void *user_data);
 
+/*
+ * Grab (enable != 0) or release an open device for exclusive access: while
+ * grabbed, other readers such as the X server or a Wayland compositor stop
+ * receiving its events. device_id -1 applies to every open device. Closing
+ * a device, ni_shutdown() included, releases its grab.
+ *
+ * Linux uses EVIOCGRAB, which fails while another process holds the grab;
+ * mice and client mode cannot be grabbed. Windows supports device_id -1
+ * only and registers Raw Input with RIDEV_NOLEGACY | RIDEV_CAPTUREMOUSE:
+ * this process stops getting legacy keyboard and mouse messages, but other
+ * processes still see the input. Returns 0, or -1 on failure.
+ */
+int ni_grab_device(int device_id, int enable);
+
 /* Return number of currently opened devices that passed the filter */
 int ni_device_count(void);
 
+/* Copy the info of an open device, read once when it was opened. Returns 0,
+ * or -1 if no such device is open (Linux; -1 where unsupported). */
+int ni_get_device_info(int device_id, struct ni_device_info *out);
+
+/*
+ * Choose which events reach the library, in the style of EVIOCSMASK. With
+ * type NI_EV_SYN, codes selects the event types that pass (bits NI_EV_*);
+ * with any other type it selects the codes of that type that pass. codes
+ * has the ni_device_info bitmap layout with nbits valid bits, so later codes
+ * are masked; NULL lets the whole type pass again. SYN events always pass,
+ * and frames left without events are dropped. device_id -1 sets the mask of
+ * every open device and of devices opened later.
+ *
+ * On Linux the kernel discards masked events before they are read; mice,
+ * client mode and kernels without EVIOCSMASK are filtered by the library,
+ * as is every backend elsewhere (device_id -1 only). Masked events do not
+ * update ni_get_device_state(). Returns 0, or -1 for an unknown device or a
+ * type whose codes cannot be masked.
+ */
+int ni_set_event_mask(int device_id, int type, const unsigned char *codes, int nbits);
+
+/*
+ * Input state of one device as kept by the reader thread. rel holds running
+ * totals since the device was opened: subtract the previous snapshot for
+ * the motion of a frame. events changes with every applied event.
+ */
+struct ni_device_state {
+    int device_id;
+    uint64_t events;               /* KEY/REL/ABS events applied so far */
+    int64_t timestamp_ns;          /* of the last applied event */
+    uint32_t buttons;              /* bit n: NI_BTN_MOUSE + n is down */
+    uint8_t keys[(NI_KEY_CNT + 7) / 8]; /* bit code % 8 of byte code / 8 */
+    int64_t rel[NI_REL_CNT];
+    int32_t abs[NI_ABS_CNT];       /* latest value, seeded from EVIOCGABS */
+};
+
+static inline int ni_device_state_key_down(const struct ni_device_state *s, int code) {
+    return code >= 0 && code < NI_KEY_CNT && ((s->keys[code / 8] >> (code % 8)) & 1);
+}
+
+/* Copy the current state of an open device without blocking the reader
+ * thread; keys and axes are seeded when the device is opened. Returns 0, or
+ * -1 if the device is not open (Linux; -1 where unsupported). */
+int ni_get_device_state(int device_id, struct ni_device_state *out);
+
+#define NI_TOUCH_MAX_SLOTS 16 /* slots decoded per device, higher ones are dropped */
+
+/* One multitouch protocol-B slot. */
+struct ni_touch_contact {
+    int32_t tracking_id;   /* -1 while the slot is empty */
+    int32_t x, y;          /* ABS_MT_POSITION_X/Y */
+    int32_t pressure;      /* ABS_MT_PRESSURE */
+    int32_t touch_major, touch_minor; /* ABS_MT_TOUCH_MAJOR/MINOR */
+    int32_t orientation;   /* ABS_MT_ORIENTATION */
+    int32_t tool_type;     /* ABS_MT_TOOL_TYPE, MT_TOOL_* */
+};
+
+/* Contacts of a touch device as of its last SYN_REPORT. */
+struct ni_touch_state {
+    int device_id;
+    int nslots;            /* slots of the device, at most NI_TOUCH_MAX_SLOTS */
+    int active;            /* slots with a tracking id */
+    int64_t timestamp_ns;  /* of the SYN_REPORT */
+    uint64_t frames;       /* SYN_REPORTs that changed a contact */
+    struct ni_touch_contact slots[NI_TOUCH_MAX_SLOTS];
+};
+
+/* Copy the contact array of a device decoded with NI_INIT_FLAG_TOUCH, in
+ * the style of ni_get_device_state(). Returns 0, or -1 if the device is not
+ * open, is not a protocol-B touch device or the decoder is off (Linux
+ * only; -1 in client mode and where unsupported). */
+int ni_get_touch_state(int device_id, struct ni_touch_state *out);
+
 /* Zero-cost inline helpers (compile away) */
 static inline int ni_is_key_event(const struct ni_event *ev) {
     return ev && ev->type == NI_EV_KEY;
@@ -1115,14 +1280,19 @@ static inline int ni_button_down(const struct ni_event *ev) {
 }
 
 typedef void (*ni_callback)(const struct ni_event *ev, void *user_data);
+/* Receives one hardware frame: every event of one device up to and including
+ * its terminating NI_SYN_REPORT, as a contiguous array valid only for the
+ * duration of the call. */
+typedef void (*ni_batch_callback)(const struct ni_event *evs, int count, void *user_data);
 typedef void (*ni_device_callback)(const struct ni_event *ev, const struct ni_device_info *device, void *user_data);
 
 /* High-level key event produced by the optional xkb layer. Mirrors SDL-style input. */
 struct ni_key_event {
     int device_id;              /* originating device */
     uint32_t keysym;            /* xkb keysym (XKB_KEY_*), 0 if none */
-    char text[64];              /* UTF-8 text for this key press (if any), NUL-terminated */
-    int down;                   /* 1 on key press, 0 on release */
+    char text[8];               /* UTF-8 text for this key press (if any), NUL-terminated;
+                                 * longer output is cut at a code point */
+    int down;                   /* 1 on key press, 2 on autorepeat, 0 on release */
     uint32_t mods;              /* bitmask of active modifiers (see NI_KMOD_*) */
     long long timestamp_ns;     /* timestamp of underlying kernel event */
 };
@@ -1146,21 +1316,164 @@ typedef void (*ni_key_callback)(const struct ni_key_event *kev, void *user_data)
  * cb: callback function
  * user_data: passed to callback
  * flags: combination of NI_CB_FLAG_*
+ *
+ * Callbacks run on the reading thread. Without flags they run after the
+ * global callback; NI_CB_FLAG_HIGH_PRIORITY runs them before it. An
+ * NI_CB_FLAG_EXCLUSIVE callback is the only consumer of its device's events:
+ * other device callbacks, the global and batch callbacks and the poll queue
+ * do not see them. At most one exclusive callback per device_id; one for a
+ * specific device overrides an exclusive wildcard. NI_CB_FLAG_BATCH_EVENTS is
+ * not accepted here, use ni_register_batch_callback(). Registrations for a
+ * device_id that is not open yet take effect when the device appears. The
+ * device info pointer is only valid during the call.
  */
 int ni_register_device_callback(int device_id, ni_device_callback cb, void *user_data, int flags);
 
 /* Unregister a device-specific callback by ID */
 int ni_unregister_device_callback(int callback_id);
 
-/* Initialize library. flags reserved for future use, must be 0 for now. */
+/* ni_init flags */
+#define NI_INIT_FLAG_CLIENT 0x01  /* Linux: attach to a running asyncinput-worker */
+#define NI_INIT_FLAG_COMPACT 0x02 /* Linux: queue struct ni_event_compact, see ni_poll_compact() */
+#define NI_INIT_FLAG_IO_URING 0x04 /* Linux: read devices through io_uring, epoll if unavailable */
+#define NI_INIT_FLAG_TOUCH 0x08 /* Linux: decode multitouch slots into NI_EV_TOUCH */
+#define NI_INIT_FLAG_REPLAY 0x10 /* Linux: read the trace in ASYNCINPUT_REPLAY instead of devices */
+#define NI_INIT_FLAG_REPLAY_REALTIME 0x20 /* with NI_INIT_FLAG_REPLAY: keep the recorded pace */
+#define NI_INIT_FLAG_STATS 0x40 /* Linux: keep the counters of ni_get_stats() */
+
+/* Shared memory object asyncinput-worker publishes by default. Clients use
+ * the ASYNCINPUT_SHM environment variable instead when it is set. */
+#define NI_WORKER_SHM_DEFAULT "/asyncinput"
+
+/* Initialize library. flags is 0 or NI_INIT_FLAG_*.
+ *
+ * With NI_INIT_FLAG_CLIENT the library opens no devices itself. It maps the
+ * event ring of an asyncinput-worker process and sleeps on its futex; all
+ * callback, poll and xkb APIs work as usual and ni_device_count() reports
+ * the worker's devices. The filter only masks devices locally, and
+ * ni_enable_mice() is decided by the worker. Fails if no worker is running.
+ *
+ * NI_INIT_FLAG_IO_URING replaces the epoll + read() loop with io_uring
+ * multishot reads into provided buffers (Linux 6.7), one io_uring_enter()
+ * per wakeup for all devices. Without kernel support, or in builds without
+ * io_uring headers, the library silently keeps using epoll.
+ *
+ * NI_INIT_FLAG_TOUCH runs a protocol-B decoder on every device with
+ * ABS_MT_SLOT. Its ABS_MT_* events are consumed; at each SYN_REPORT the
+ * library emits one NI_EV_TOUCH per slot that changed, in slot order, ahead
+ * of the SYN_REPORT, and updates ni_get_touch_state(). Single-touch
+ * emulation (ABS_X, BTN_TOUCH, ...) passes through unchanged, and the
+ * ABS_MT_* axes of ni_get_device_state() stay at their seeded values.
+ *
+ * NI_INIT_FLAG_REPLAY opens no devices either. A reader thread feeds the
+ * trace file named by the ASYNCINPUT_REPLAY environment variable, see
+ * ni_record_start(), through the same path as read events, so callbacks,
+ * masks and ni_poll() see what the recording session saw; the filter only
+ * masks, as in client mode, and a trace already holds decoded touch frames.
+ * By default events go out as fast as the consumer takes them: with no
+ * callback registered the replay waits for room in the ni_poll() queue
+ * rather than dropping. NI_INIT_FLAG_REPLAY_REALTIME keeps the recorded
+ * gaps instead. Either way timestamp_ns is shifted so the first event is
+ * stamped when the replay starts. Fails if the trace cannot be mapped or
+ * comes from a build with a different ABI. */
 int
 ni_init(int flags);
 
+/* What a full ni_poll() queue does with the next event. Every lost event is
+ * counted in ni_dropped_events() and the stream carries one NI_EV_SYN /
+ * NI_SYN_DROPPED event (device_id -1, value = events lost) where the gap is;
+ * like evdev, consumers tracking state should resynchronize on it. */
+#define NI_OVERFLOW_DROP_NEWEST  0 /* keep the backlog, discard new events */
+#define NI_OVERFLOW_DROP_OLDEST  1 /* discard the backlog, keep new events */
+#define NI_OVERFLOW_COALESCE_REL 2 /* merge motion as NI_COALESCE_REL, drop the rest */
+
+/* Timebase of every timestamp_ns, see ni_worker_config.clock. Linux sets it
+ * on each device with EVIOCSCLOCKID; other backends only offer MONOTONIC. */
+#define NI_CLOCK_MONOTONIC 0 /* CLOCK_MONOTONIC, the default */
+#define NI_CLOCK_BOOTTIME  1 /* CLOCK_BOOTTIME: MONOTONIC plus time suspended */
+#define NI_CLOCK_REALTIME  2 /* CLOCK_REALTIME: wall clock, steps with NTP */
+
+/* Linux, ni_worker_config.workers > 1: which reader thread a newly opened
+ * device is given. Only pointer devices (EV_REL or EV_ABS) are spread out;
+ * keyboards and everything else stay on the first worker, which also owns
+ * hotplug and xkb translation. The choice is made once, at open time. */
+#define NI_SHARD_BALANCED  0 /* the worker with the lowest event rate */
+#define NI_SHARD_DEDICATED 1 /* a worker of its own while one is free */
+
+/* Reader thread configuration for ni_init_with_worker_config(). Initialize
+ * with ni_worker_config_defaults(); the defaults behave like ni_init(). */
+struct ni_worker_config {
+    int cpu_affinity;   /* -1 for any CPU, 0-N to pin the reader thread(s) */
+    int rt_priority;    /* 1-99 for SCHED_FIFO, 0 for SCHED_OTHER */
+    size_t stack_size;  /* reader thread stack size in bytes, 0 for default */
+    int nice_level;     /* -20 to 19, SCHED_OTHER only (best effort) */
+    size_t queue_capacity; /* events per poll/key queue, rounded up to a power
+                            * of two (at most 4M); 0 for 1024 */
+    int overflow_policy;   /* NI_OVERFLOW_* */
+    int clock;             /* NI_CLOCK_*; client mode uses the worker's */
+    int spin_us;           /* Linux: busy-poll this long after each wakeup
+                            * before blocking again; 0 off, -1 never block.
+                            * Costs a core, pair it with cpu_affinity */
+    int workers;           /* Linux: reader threads, each with its own epoll
+                            * set and queue; 0 or 1 for one, at most 8.
+                            * Callbacks then run concurrently on several
+                            * threads; worker i is pinned to cpu_affinity+i.
+                            * io_uring and client mode always use one */
+    int shard_policy;      /* NI_SHARD_*, how devices are spread over them */
+    int dispatch_threads;  /* Linux: 0 runs callbacks on the reader threads;
+                            * 1-8 runs them on a pool of that many threads
+                            * instead, see below */
+};
+
+static inline void ni_worker_config_defaults(struct ni_worker_config *cfg) {
+    cfg->cpu_affinity = -1;
+    cfg->rt_priority = 0;
+    cfg->stack_size = 0;
+    cfg->nice_level = 0;
+    cfg->queue_capacity = 0;
+    cfg->overflow_policy = NI_OVERFLOW_DROP_NEWEST;
+    cfg->clock = NI_CLOCK_MONOTONIC;
+    cfg->spin_us = 0;
+    cfg->workers = 0;
+    cfg->shard_policy = NI_SHARD_BALANCED;
+    cfg->dispatch_threads = 0;
+}
+
+/* With dispatch_threads the reader threads never run user code: they still
+ * fill the ni_poll() queue, and hand every device, global, batch and key
+ * callback and the xkb layer to the pool through per-reader lock-free
+ * queues. Each device is tied to one pool thread, so its events keep their
+ * order; devices without EV_REL/EV_ABS, and with them xkb and the key
+ * callback, all share the first pool thread and the others are spread over
+ * the rest by device_id. A pool thread that falls a queue_capacity behind
+ * drops callback events, reported like any queue overflow. Callbacks see
+ * ni_get_device_state() as of the latest event read, not the one being
+ * delivered. */
+
+/* Like ni_init, but applies config to every reader thread the library
+ * starts: the event worker, which also reads /dev/input/mice, and the
+ * extra shard readers of workers > 1 (or the client and replay reader in
+ * those modes). The dispatch_threads pool runs with default attributes.
+ * config may be NULL for defaults. Returns -1 on invalid values or if the
+ * thread cannot be created as requested, e.g. SCHED_FIFO without
+ * CAP_SYS_NICE / RLIMIT_RTPRIO on Linux. Fields a backend cannot honour
+ * are ignored. */
+int
+ni_init_with_worker_config(int flags, const struct ni_worker_config *config);
+
+/* Current time in the timebase of ni_event.timestamp_ns, so latency is
+ * ni_now_ns() - ev.timestamp_ns. Valid after ni_init(). */
+long long ni_now_ns(void);
+
 /* Enable or disable reading from /dev/input/mice (Linux only). When enabled,
- * a background reader parses PS/2 mouse packets and emits NI_EV_REL for
- * NI_REL_X/NI_REL_Y and NI_EV_KEY for NI_BTN_LEFT/RIGHT/MIDDLE via the same
- * callback/queue. Call before or after ni_init. Returns 0 on success, -1 on
- * unsupported platforms or on failure to start the reader. */
+ * the first event worker also parses PS/2 mouse packets, no extra thread, and
+ * emits NI_EV_REL for NI_REL_X/NI_REL_Y and NI_EV_KEY for
+ * NI_BTN_LEFT/RIGHT/MIDDLE via the same callback/queue. If the device accepts
+ * the ImPS/2 handshake the wheel is reported as NI_REL_WHEEL. Call before or
+ * after ni_init; before, it only records the choice for the next ni_init,
+ * which skips the mice if they cannot be opened. ni_shutdown clears it.
+ * Returns 0 on success, -1 on unsupported platforms or on failure to open
+ * /dev/input/mice. */
 int
 ni_enable_mice(int enabled);
 
@@ -1168,9 +1481,38 @@ ni_enable_mice(int enabled);
 int
 ni_register_callback(ni_callback cb, void *user_data, int flags);
 
+/* Register a frame-batched callback invoked from the worker thread, once per
+ * NI_SYN_REPORT-delimited frame. Frames larger than the library's internal
+ * frame buffer are delivered in several parts; only the last part ends with
+ * NI_SYN_REPORT. May be combined with ni_register_callback(); events are
+ * queued for ni_poll() only while neither callback is registered. Pass NULL
+ * to unregister. flags reserved (0). */
+int
+ni_register_batch_callback(ni_batch_callback cb, void *user_data, int flags);
+
+/* ni_set_coalescing flags */
+#define NI_COALESCE_BUTTONS 0x01 /* emit mouse buttons/axes only when they change */
+#define NI_COALESCE_REL     0x02 /* merge queued motion until ni_poll() drains it */
+
+/* Opt-in coalescing, off by default. NI_COALESCE_BUTTONS makes the
+ * /dev/input/mice reader emit button events only on edges and skip zero
+ * deltas (evdev and Raw Input already report edges only). NI_COALESCE_REL
+ * applies to the ni_poll() queue: consecutive NI_EV_REL and NI_MOUSE_MOVE
+ * deltas of one device are summed, across frames, until the consumer catches
+ * up; any other event ends the merge, so ordering is preserved. Callbacks
+ * always see every event. Returns -1 for flags the backend cannot honour. */
+int ni_set_coalescing(int flags);
+
+/* ni_enable_xkb modes */
+#define NI_XKB_EAGER 1 /* translate on the thread that dispatches the event */
+#define NI_XKB_LAZY  2 /* translate inside ni_poll_key_events() */
+
 /* Optional xkb layer control (Linux/evdev-focused). When enabled, the library
  * will translate EV_KEY events to xkb keysyms and UTF-8 text and expose them
  * via a separate callback/queue API below. Defaults to disabled. Returns 0 on success.
+ * NI_XKB_LAZY only queues the raw key events, so keys nobody polls for cost
+ * the reader nothing; a registered key callback still gets eager events.
+ * Either mode runs on the callback pool when dispatch_threads is set.
  */
 int ni_enable_xkb(int enabled);
 
@@ -1185,10 +1527,205 @@ int ni_register_key_callback(ni_key_callback cb, void *user_data, int flags);
 /* Poll high-level key events. Returns count. */
 int ni_poll_key_events(struct ni_key_event *evts, int max_events);
 
-/* Poll queued events into evts (main-thread consumption). Returns count. */
+/* Poll queued events into evts (main-thread consumption). Returns count.
+ * With several workers the per-worker queues are merged in timestamp_ns
+ * order; ni_poll_compact() and ni_poll_acquire() drain them in turn. */
 int
 ni_poll(struct ni_event *evts, int max_events);
 
+/* Poll queued events in the compact layout; needs NI_INIT_FLAG_COMPACT.
+ * *base_ns receives the timestamp base of this batch. A batch ends early
+ * when the next event is more than ~4.29 s away from the base. Returns
+ * count, or -1 without NI_INIT_FLAG_COMPACT or where unsupported. */
+int
+ni_poll_compact(struct ni_event_compact *evts, int max_events, int64_t *base_ns);
+
+/* Zero-copy ni_poll(): points batch at up to max_events queued events
+ * inside the queue and returns batch->total. The events stay valid until
+ * ni_poll_release(batch), which any thread may call. Until then ni_poll()
+ * finds nothing in that queue and another ni_poll_acquire() of it returns
+ * -1; no lock is held in between. A batch with total 0 needs no release.
+ * A batch comes from one queue: with workers > 1 or ni_enable_mice() the
+ * queues are handed out one after the other, not merged by timestamp_ns
+ * as ni_poll() does, so events of different queues can arrive out of
+ * order. Returns -1 with NI_OVERFLOW_DROP_OLDEST or NI_INIT_FLAG_COMPACT,
+ * whose queues cannot expose events in place, and where unsupported. */
+int
+ni_poll_acquire(struct ni_event_batch *batch, int max_events);
+
+/* Consumes the events of the last ni_poll_acquire(). Returns 0, or -1 for
+ * a batch that was not acquired. */
+int
+ni_poll_release(struct ni_event_batch *batch);
+
+/* Events lost to full queues (ni_poll() and key queues) since ni_init().
+ * Safe to call from any thread. */
+uint64_t
+ni_dropped_events(void);
+
+/*
+ * Latency histogram of ni_get_stats(), log-linear like HdrHistogram:
+ * values below 8 ns have a bucket each, then every power of two is split
+ * into 8 buckets, so a bucket is at most 12.5% wide. The last bucket,
+ * from ~16 s, also holds everything above.
+ */
+#define NI_HIST_BUCKETS 256
+
+struct ni_latency_histogram {
+    uint64_t count;
+    uint64_t max_ns;
+    uint64_t buckets[NI_HIST_BUCKETS];
+};
+
+static inline int ni_hist_bucket(uint64_t ns) {
+    if (ns < 8) return (int)ns;
+#if defined(__GNUC__)
+    int e = 63 - __builtin_clzll(ns);
+#else
+    int e = 3;
+    while (e < 63 && (ns >> (e + 1))) e++;
+#endif
+    int b = (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+    return b < NI_HIST_BUCKETS ? b : NI_HIST_BUCKETS - 1;
+}
+
+/* Smallest value that falls into bucket b. */
+static inline uint64_t ni_hist_bucket_floor(int b) {
+    if (b < 8) return (uint64_t)b;
+    return (uint64_t)(8 + b % 8) << (b / 8 - 1);
+}
+
+/* Upper bound of the q-quantile (0..1), e.g. 0.99 for p99; 0 when empty. */
+static inline uint64_t ni_hist_percentile(const struct ni_latency_histogram *h, double q) {
+    if (!h->count) return 0;
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < NI_HIST_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            uint64_t hi = ni_hist_bucket_floor(b + 1) - 1;
+            return hi < h->max_ns ? hi : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+/* Library-wide counters, all growing from ni_init(); subtract two
+ * snapshots, histograms too, for the numbers of an interval. */
+struct ni_stats {
+    uint64_t wakeups;         /* reader thread returns from epoll_wait() or
+                               * io_uring_enter() with work to do */
+    uint64_t reads;           /* read()s of devices, io_uring completions;
+                               * reads / wakeups is the batching */
+    uint64_t events_read;     /* events read from devices, before masks */
+    uint64_t events_dropped;  /* ni_dropped_events() */
+    uint32_t queue_high_water; /* most slots one ni_poll() queue held */
+    uint32_t queue_capacity;  /* slots of each ni_poll() queue */
+    /* timestamp_ns to dispatch on the reader thread: kernel, scheduling
+     * and conversion, for every event */
+    struct ni_latency_histogram kernel_to_enqueue;
+    /* time in the ni_poll() queue, for every event taken from a queue slot
+     * by ni_poll(), ni_poll_compact() or ni_poll_release() (merged motion
+     * of NI_COALESCE_REL has no slot) */
+    struct ni_latency_histogram enqueue_to_dequeue;
+};
+
+/* Counters of one device since it was opened. */
+struct ni_device_stats {
+    uint64_t events_read;    /* events read, before masks */
+    uint64_t events_dropped; /* ni_poll() queue losses while queueing them */
+};
+
+/* Needs NI_INIT_FLAG_STATS: the reader threads then count with per-thread
+ * single-writer counters and read the clock once per read(), and every
+ * queue slot is timestamped. Safe to call from any thread; the snapshot is
+ * not atomic across fields. Returns 0, or -1 without the flag or where
+ * unsupported. */
+int
+ni_get_stats(struct ni_stats *out);
+
+/* Per-device counters, NI_INIT_FLAG_STATS. Returns 0, or -1 for an unknown
+ * device, without the flag or where unsupported. */
+int
+ni_get_device_stats(int device_id, struct ni_device_stats *out);
+
+/* Block until ni_poll() has events to return. timeout_ns < 0 waits forever,
+ * 0 only checks. Returns 1 when events are queued, 0 on timeout or
+ * ni_shutdown(), -1 if not initialized. Events consumed by a callback are
+ * never queued and do not wake the caller; the key queue is not covered. */
+int
+ni_wait_events(int64_t timeout_ns);
+
+/* Descriptor for embedding the event queue in an external epoll/poll/
+ * io_uring loop (Linux). It is readable while ni_poll() has events and
+ * stays readable until a ni_poll() call returns fewer than max_events. Do
+ * not read from or close it. Returns -1 where unsupported or before
+ * ni_init(). */
+int
+ni_get_event_fd(void);
+
+/* Windows counterpart of ni_get_event_fd(): a manual-reset event HANDLE
+ * signaled under the same rules, for WaitForMultipleObjects(). Returns NULL
+ * on other platforms. Do not reset or close it. */
+void *
+ni_get_event_handle(void);
+
+/*
+ * Trace file of ni_record_start() and NI_INIT_FLAG_REPLAY: a struct
+ * ni_trace_header, then records up to the end of the file. A record is a
+ * struct ni_trace_record and its payload, padded to a multiple of 8 bytes,
+ * so a mapped trace is walked in place. Byte order and struct layout are
+ * the writer's own; the header sizes reject traces of another ABI. Other
+ * tools may write traces too, e.g. synthetic benchmark input.
+ */
+#define NI_TRACE_MAGIC 0x5254494eu /* "NITR" */
+#define NI_TRACE_VERSION 1u
+#define NI_TRACE_DEVICE 1u /* payload: struct ni_device_info */
+#define NI_TRACE_EVENTS 2u /* payload: count struct ni_event of device_id */
+
+struct ni_trace_header {
+    uint32_t magic;      /* NI_TRACE_MAGIC */
+    uint32_t version;    /* NI_TRACE_VERSION */
+    uint32_t event_size; /* sizeof(struct ni_event) */
+    uint32_t info_size;  /* sizeof(struct ni_device_info) */
+    int32_t clock;       /* NI_CLOCK_* of every timestamp_ns */
+    uint32_t reserved;
+    int64_t start_ns;    /* ni_now_ns() when the recording started */
+};
+
+struct ni_trace_record {
+    uint32_t type;      /* NI_TRACE_*; readers skip types they do not know */
+    uint32_t size;      /* bytes including this header and the padding */
+    int32_t device_id;
+    uint32_t count;     /* NI_TRACE_EVENTS: events in the payload */
+};
+
+static inline uint32_t ni_trace_record_size(size_t payload) {
+    return (uint32_t)((sizeof(struct ni_trace_record) + payload + 7) & ~(size_t)7);
+}
+
+/* Linux: start writing a trace to path, created or truncated. Every chunk
+ * of events the library reads is recorded as it enters dispatch, before
+ * masks and callbacks, and the ni_device_info of a device ahead of its
+ * first chunk. Reader threads only copy into a staging buffer that a
+ * background thread writes out, so the disk never stalls input; a chunk
+ * that finds the buffer full is left out. Returns 0, or -1 before
+ * ni_init(), while recording, or if path cannot be created. */
+int
+ni_record_start(const char *path);
+
+/* Stop recording and close the trace once everything staged is written.
+ * Returns the number of events left out, or -1 if not recording or a write
+ * to the trace failed. ni_shutdown() stops a recording too. */
+long long
+ni_record_stop(void);
+
+/* NI_INIT_FLAG_REPLAY: events of the trace not dispatched yet, 0 once the
+ * replay is over. Returns -1 without a replay. */
+long long
+ni_replay_pending(void);
+
 /* Shutdown library and free resources. */
 int
 ni_shutdown(void);
@@ -0,0 +1,194 @@
+// Agent: Agent Mode, Date: 2026-10-14, Observation: Shared-memory event ring shared by asyncinput-worker and the library client mode
+#ifndef ASYNCINPUT_SHM_H
+#define ASYNCINPUT_SHM_H
+
+#include "asyncinput.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Layout of the POSIX shared memory object published by asyncinput-worker.
+ *
+ * The event ring is a single-producer broadcast ring: the worker never waits
+ * for readers and every client keeps a private cursor. A slot carries a
+ * sequence number, 2 * pos + 1 while the worker writes it and 2 * pos + 2
+ * once stable, so a reader that was lapped sees a larger sequence than it
+ * expects and resynchronizes instead of returning torn events.
+ *
+ * Readers that find the ring empty bump `waiters` and FUTEX_WAIT on `futex`,
+ * which the worker increments after every publish; the wake syscall is only
+ * issued while someone is waiting.
+ */
+
+#define NI_SHM_MAGIC 0x4e495348u /* "NISH" */
+#define NI_SHM_VERSION 4u /* 2: ni_device_info capability bitmaps, 3: clock,
+                           * 4: event0..1023 in the device table */
+#define NI_SHM_RING_SIZE 4096u /* must be a power of two */
+#define NI_SHM_MAX_DEVICES 1026 /* event0..1023, the mice pseudo device, one spare */
+
+struct ni_shm_slot {
+	_Atomic uint64_t seq;
+	struct ni_event ev;
+};
+
+struct ni_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	uint32_t event_size; /* sizeof(struct ni_event), ABI check */
+	_Atomic int32_t alive; /* cleared by the worker on exit */
+	_Atomic int32_t device_count; /* ni_device_count() in the worker */
+	int32_t clock; /* NI_CLOCK_* of every timestamp_ns */
+
+	_Alignas(64) _Atomic uint64_t head; /* next position to write */
+	_Alignas(64) _Atomic uint32_t futex;
+	_Atomic uint32_t waiters;
+
+	/* device table, seqlock protected: odd while being written */
+	_Alignas(64) _Atomic uint32_t dev_seq;
+	int32_t ndevices;
+	struct ni_device_info devices[NI_SHM_MAX_DEVICES];
+
+	_Alignas(64) struct ni_shm_slot slots[NI_SHM_RING_SIZE];
+};
+
+/* Device table slot for a library device id: event0..1023 and mice (-2). */
+static inline int
+ni_shm_device_slot(int device_id)
+{
+	if (device_id >= 0 && device_id < NI_SHM_MAX_DEVICES - 2)
+		return device_id;
+	if (device_id == -2)
+		return NI_SHM_MAX_DEVICES - 2;
+	return -1;
+}
+
+static inline int
+ni_shm_futex_wait(_Atomic uint32_t *addr, uint32_t val,
+		  const struct timespec *timeout)
+{
+	return (int)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val,
+			    timeout, NULL, 0);
+}
+
+static inline void
+ni_shm_futex_wake_all(_Atomic uint32_t *addr)
+{
+	(void)syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX,
+		      NULL, NULL, 0);
+}
+
+/* Bump the futex word and wake every sleeper, used on publish and to kick
+ * a local reader out of its wait. */
+static inline void
+ni_shm_notify(struct ni_shm_header *h, int force)
+{
+	atomic_fetch_add_explicit(&h->futex, 1, memory_order_release);
+	if (force || atomic_load_explicit(&h->waiters, memory_order_seq_cst))
+		ni_shm_futex_wake_all(&h->futex);
+}
+
+/* Producer side, asyncinput-worker only. */
+static inline void
+ni_shm_publish(struct ni_shm_header *h, const struct ni_event *ev, int count)
+{
+	uint64_t pos = atomic_load_explicit(&h->head, memory_order_relaxed);
+	for (int i = 0; i < count; i++, pos++) {
+		struct ni_shm_slot *s = &h->slots[pos & (NI_SHM_RING_SIZE - 1)];
+		atomic_store_explicit(&s->seq, 2 * pos + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		s->ev = ev[i];
+		atomic_store_explicit(&s->seq, 2 * pos + 2, memory_order_release);
+	}
+	atomic_store_explicit(&h->head, pos, memory_order_seq_cst);
+	ni_shm_notify(h, 0);
+}
+
+/*
+ * Consumer side. Copies up to max events starting at *cursor. Sets *lost to
+ * the number of events the reader was lapped by (cursor is moved forward
+ * past them). Returns the number of events copied.
+ */
+static inline int
+ni_shm_read(const struct ni_shm_header *h, uint64_t *cursor,
+	    struct ni_event *out, int max, uint64_t *lost)
+{
+	uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+	*lost = 0;
+	if (head - *cursor > NI_SHM_RING_SIZE) {
+		*lost = head - NI_SHM_RING_SIZE - *cursor;
+		*cursor = head - NI_SHM_RING_SIZE;
+	}
+	int n = 0;
+	while (n < max && *cursor < head) {
+		const struct ni_shm_slot *s =
+			&h->slots[*cursor & (NI_SHM_RING_SIZE - 1)];
+		uint64_t want = 2 * *cursor + 2;
+		uint64_t s1 = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (s1 == want) {
+			out[n] = s->ev;
+			atomic_thread_fence(memory_order_acquire);
+			uint64_t s2 = atomic_load_explicit(&s->seq,
+							   memory_order_relaxed);
+			if (s2 == s1) {
+				n++;
+				(*cursor)++;
+				continue;
+			}
+		}
+		/* overwritten under us: skip to the oldest slot still valid */
+		head = atomic_load_explicit(&h->head, memory_order_acquire);
+		uint64_t oldest = head > NI_SHM_RING_SIZE ?
+				  head - NI_SHM_RING_SIZE + 1 : 0;
+		if (oldest > *cursor) {
+			*lost += oldest - *cursor;
+			*cursor = oldest;
+		}
+	}
+	return n;
+}
+
+/* Producer side: record the metadata of a device seen by the worker. */
+static inline void
+ni_shm_set_device_info(struct ni_shm_header *h, const struct ni_device_info *info)
+{
+	int slot = ni_shm_device_slot(info->id);
+	if (slot < 0)
+		return;
+	atomic_fetch_add_explicit(&h->dev_seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	h->devices[slot] = *info;
+	if (slot >= h->ndevices)
+		h->ndevices = slot + 1;
+	atomic_fetch_add_explicit(&h->dev_seq, 1, memory_order_release);
+}
+
+/* Consumer side. Returns 0 and fills out if the worker published the
+ * device, -1 otherwise. */
+static inline int
+ni_shm_get_device_info(const struct ni_shm_header *h, int device_id,
+		       struct ni_device_info *out)
+{
+	int slot = ni_shm_device_slot(device_id);
+	if (slot < 0)
+		return -1;
+	for (;;) {
+		uint32_t s1 = atomic_load_explicit(&h->dev_seq, memory_order_acquire);
+		if (s1 & 1)
+			continue;
+		*out = h->devices[slot];
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&h->dev_seq, memory_order_relaxed) == s1)
+			break;
+	}
+	return out->path[0] ? 0 : -1;
+}
+
+#endif /* ASYNCINPUT_SHM_H */
@@ -0,0 +1,269 @@
+// Agent: Agent Mode, Date: 2026-10-14, Observation: Minimal raw-syscall io_uring wrapper for the NI_INIT_FLAG_IO_URING reader engine
+#ifndef ASYNCINPUT_URING_H
+#define ASYNCINPUT_URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Just enough io_uring for the reader thread, without liburing: one ring
+ * with a single submitter, a sparse registered file table and one provided
+ * buffer ring. The SQ and CQ indices live in memory shared with the kernel,
+ * so pushing and reaping entries costs no syscall; only ni_uring_enter()
+ * does, and it both submits and waits.
+ */
+
+/* IORING_OP_READ_MULTISHOT, Linux 6.7; older uapi headers stop before it */
+#define NI_IORING_OP_READ_MULTISHOT 49
+
+struct ni_uring {
+	int fd;
+	unsigned sq_entries;
+	_Atomic unsigned *sq_tail;
+	unsigned *sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local; /* tail of entries prepared but not yet published */
+	unsigned to_submit;
+	_Atomic unsigned *cq_head;
+	_Atomic unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *rings;
+	size_t rings_size;
+	size_t sqes_size;
+
+	/* provided buffers, group bgid, buffer id = index into bufs */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned br_entries;
+	unsigned short br_tail;
+	unsigned short bgid;
+	unsigned char *bufs;
+	size_t buf_size;
+};
+
+static inline int
+ni_uring_sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+ni_uring_sys_register(int fd, unsigned op, const void *arg, unsigned nargs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static inline void
+ni_uring_free(struct ni_uring *u)
+{
+	if (u->fd >= 0)
+		close(u->fd); /* cancels every request and drops the files */
+	if (u->rings)
+		munmap(u->rings, u->rings_size);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->br)
+		munmap(u->br, u->br_size);
+	free(u->bufs);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/* Create the ring; needs IORING_FEAT_SINGLE_MMAP (5.4). Returns 0 or -1. */
+static inline int
+ni_uring_init(struct ni_uring *u, unsigned entries)
+{
+	memset(u, 0, sizeof(*u));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	/* completions are reaped by the submitter, skip the IPI */
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+	u->fd = ni_uring_sys_setup(entries, &p);
+	if (u->fd < 0 && errno == EINVAL) {
+		p.flags = 0;
+		u->fd = ni_uring_sys_setup(entries, &p);
+	}
+	if (u->fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ni_uring_free(u);
+		return -1;
+	}
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->rings == MAP_FAILED) {
+		u->rings = NULL;
+		ni_uring_free(u);
+		return -1;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		ni_uring_free(u);
+		return -1;
+	}
+	char *r = u->rings;
+	u->sq_entries = p.sq_entries;
+	u->sq_tail = (_Atomic unsigned *)(r + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(r + p.sq_off.ring_mask);
+	u->sq_local = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+	/* identity map, slot i always names sqes[i] */
+	unsigned *array = (unsigned *)(r + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	u->cq_head = (_Atomic unsigned *)(r + p.cq_off.head);
+	u->cq_tail = (_Atomic unsigned *)(r + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(r + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(r + p.cq_off.cqes);
+	return 0;
+}
+
+/* True if the running kernel implements every opcode in ops. */
+static inline bool
+ni_uring_probe(const struct ni_uring *u, const unsigned char *ops, int nops)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+		      256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (!probe)
+		return false;
+	bool ok = ni_uring_sys_register(u->fd, IORING_REGISTER_PROBE,
+					probe, 256) == 0;
+	for (int i = 0; ok && i < nops; i++)
+		ok = ops[i] <= probe->last_op &&
+		     (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+/* Register nfiles empty fixed file slots, filled by ni_uring_set_file(). */
+static inline int
+ni_uring_register_files(struct ni_uring *u, unsigned nfiles)
+{
+	struct io_uring_rsrc_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = nfiles;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	return ni_uring_sys_register(u->fd, IORING_REGISTER_FILES2, &reg,
+				     sizeof(reg)) == 0 ? 0 : -1;
+}
+
+/* Point fixed file slot at fd, or empty it with fd -1. */
+static inline int
+ni_uring_set_file(struct ni_uring *u, unsigned slot, int fd)
+{
+	struct io_uring_files_update up;
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+	return ni_uring_sys_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up,
+				     1) == 1 ? 0 : -1;
+}
+
+/* Hand buffer bid back to the kernel; visible after ni_uring_buf_publish(). */
+static inline void
+ni_uring_buf_add(struct ni_uring *u, unsigned short bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->br_entries - 1)];
+	b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * u->buf_size);
+	b->len = (uint32_t)u->buf_size;
+	b->bid = bid;
+	u->br_tail++;
+}
+
+static inline void
+ni_uring_buf_publish(struct ni_uring *u)
+{
+	atomic_store_explicit((_Atomic unsigned short *)&u->br->tail,
+			      u->br_tail, memory_order_release);
+}
+
+/* Register count (a power of two) buffers of size bytes as group bgid. */
+static inline int
+ni_uring_setup_buffers(struct ni_uring *u, unsigned short bgid,
+		       unsigned count, size_t size)
+{
+	u->br_size = count * sizeof(struct io_uring_buf);
+	void *ring = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return -1;
+	u->br = ring;
+	u->bufs = malloc(count * size);
+	if (!u->bufs)
+		return -1;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring;
+	reg.ring_entries = count;
+	reg.bgid = bgid;
+	if (ni_uring_sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return -1;
+	u->br_entries = count;
+	u->bgid = bgid;
+	u->buf_size = size;
+	for (unsigned i = 0; i < count; i++)
+		ni_uring_buf_add(u, (unsigned short)i);
+	ni_uring_buf_publish(u);
+	return 0;
+}
+
+/* Next free SQE, zeroed, or NULL if the SQ is full until the next enter. */
+static inline struct io_uring_sqe *
+ni_uring_get_sqe(struct ni_uring *u)
+{
+	if (u->to_submit == u->sq_entries)
+		return NULL;
+	struct io_uring_sqe *sqe = &u->sqes[u->sq_local & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_local++;
+	u->to_submit++;
+	return sqe;
+}
+
+/* Submit everything prepared, post pending completions and, with wait,
+ * block until there is one. */
+static inline int
+ni_uring_enter(struct ni_uring *u, bool wait)
+{
+	atomic_store_explicit(u->sq_tail, u->sq_local, memory_order_release);
+	unsigned n = u->to_submit;
+	int r = (int)syscall(__NR_io_uring_enter, u->fd, n, wait ? 1 : 0,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+	if (r >= 0)
+		u->to_submit -= (unsigned)r < n ? (unsigned)r : n;
+	return r;
+}
+
+/* Oldest unreaped completion or NULL; release it with ni_uring_cqe_seen(). */
+static inline struct io_uring_cqe *
+ni_uring_peek_cqe(struct ni_uring *u)
+{
+	unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+	if (head == atomic_load_explicit(u->cq_tail, memory_order_acquire))
+		return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void
+ni_uring_cqe_seen(struct ni_uring *u)
+{
+	unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+	atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+}
+
+#endif /* ASYNCINPUT_URING_H */
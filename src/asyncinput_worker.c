@@ -0,0 +1,227 @@
+// Agent: Agent Mode, Date: 2026-10-14, Observation: Out-of-process reader publishing ni_events into a shared-memory ring for NI_INIT_FLAG_CLIENT consumers
+#define _GNU_SOURCE
+#include "asyncinput.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asyncinput_shm.h"
+
+/*
+ * asyncinput-worker owns /dev/input/event* and publishes every frame into a
+ * POSIX shared memory ring that unprivileged NI_INIT_FLAG_CLIENT processes
+ * map. Any number of clients can read the same ring. Run it with
+ * CAP_SYS_NICE to use -r.
+ */
+
+static struct ni_shm_header *shm;
+/* the device table has two writers, the reader thread and main() */
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char known[NI_SHM_MAX_DEVICES];
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n name] [-m mode] [-g group] [-c cpu] [-r prio] [-t clock]\n"
+		"       [-M] [-G] [-T]\n"
+		"  -n name   shared memory object (default %s)\n"
+		"  -m mode   octal permissions of the object (default 0660)\n"
+		"  -g group  group owning the object\n"
+		"  -c cpu    pin the reader thread to cpu\n"
+		"  -r prio   SCHED_FIFO priority of the reader thread (1-99)\n"
+		"  -t clock  monotonic (default), boottime or realtime timestamps\n"
+		"  -M        also read /dev/input/mice\n"
+		"  -G        grab every device so only clients see its input\n"
+		"  -T        decode multitouch slots into NI_EV_TOUCH events\n",
+		argv0, NI_WORKER_SHM_DEFAULT);
+}
+
+static int
+grab_all(const struct ni_device_info *info, void *user_data)
+{
+	(void)info;
+	(void)user_data;
+	return 1 | NI_FILTER_GRAB;
+}
+
+/* Runs before publish_frame for every event, records new devices once. */
+static void
+record_device(const struct ni_event *ev,
+	      const struct ni_device_info *info,
+	      void *user_data)
+{
+	(void)ev;
+	(void)user_data;
+	int slot = ni_shm_device_slot(info->id);
+	if (slot < 0 || known[slot])
+		return;
+	pthread_mutex_lock(&devices_lock);
+	ni_shm_set_device_info(shm, info);
+	known[slot] = 1;
+	pthread_mutex_unlock(&devices_lock);
+}
+
+/* Mirror the library's device table, including devices that were removed
+ * or have not produced an event yet. Only changed entries are written, so
+ * readers rarely have to retry. */
+static void
+publish_devices(void)
+{
+	pthread_mutex_lock(&devices_lock);
+	for (int slot = 0; slot < NI_SHM_MAX_DEVICES; slot++) {
+		int id = slot == NI_SHM_MAX_DEVICES - 2 ? -2 : slot;
+		if (ni_shm_device_slot(id) != slot)
+			continue;
+		struct ni_device_info info;
+		if (ni_get_device_info(id, &info) != 0) {
+			memset(&info, 0, sizeof(info));
+			info.id = id;
+		}
+		/* we are the only writer, no seqlock needed to read */
+		if (memcmp(&shm->devices[slot], &info, sizeof(info)) != 0)
+			ni_shm_set_device_info(shm, &info);
+		known[slot] = info.path[0] != 0;
+	}
+	pthread_mutex_unlock(&devices_lock);
+}
+
+static void
+publish_frame(const struct ni_event *evs, int count, void *user_data)
+{
+	(void)user_data;
+	ni_shm_publish(shm, evs, count);
+}
+
+static struct ni_shm_header *
+create_shm(const char *name, mode_t mode, const char *group)
+{
+	/* a stale object from a crashed worker would keep dead clients mapped */
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	if (fd < 0) {
+		fprintf(stderr, "shm_open %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	fchmod(fd, mode); /* not subject to umask */
+	if (group) {
+		struct group *gr = getgrnam(group);
+		if (!gr || fchown(fd, (uid_t)-1, gr->gr_gid) != 0)
+			fprintf(stderr, "cannot hand %s to group %s\n", name, group);
+	}
+	if (ftruncate(fd, sizeof(struct ni_shm_header)) != 0) {
+		fprintf(stderr, "ftruncate %s: %s\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	void *p = mmap(NULL, sizeof(struct ni_shm_header),
+		       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(name);
+		return NULL;
+	}
+	struct ni_shm_header *h = p;
+	h->magic = NI_SHM_MAGIC;
+	h->version = NI_SHM_VERSION;
+	h->ring_size = NI_SHM_RING_SIZE;
+	h->event_size = sizeof(struct ni_event);
+	atomic_store(&h->alive, 1);
+	return h;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *name = NI_WORKER_SHM_DEFAULT;
+	const char *group = NULL;
+	mode_t mode = 0660;
+	int mice = 0;
+	int grab = 0;
+	int flags = 0;
+	struct ni_worker_config cfg;
+	ni_worker_config_defaults(&cfg);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:m:g:c:r:t:MGTh")) != -1) {
+		switch (opt) {
+		case 'n': name = optarg; break;
+		case 'm': mode = (mode_t)strtoul(optarg, NULL, 8); break;
+		case 'g': group = optarg; break;
+		case 'c': cfg.cpu_affinity = atoi(optarg); break;
+		case 'r': cfg.rt_priority = atoi(optarg); break;
+		case 't':
+			if (strcmp(optarg, "monotonic") == 0)
+				cfg.clock = NI_CLOCK_MONOTONIC;
+			else if (strcmp(optarg, "boottime") == 0)
+				cfg.clock = NI_CLOCK_BOOTTIME;
+			else if (strcmp(optarg, "realtime") == 0)
+				cfg.clock = NI_CLOCK_REALTIME;
+			else {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'M': mice = 1; break;
+		case 'G': grab = 1; break;
+		case 'T': flags |= NI_INIT_FLAG_TOUCH; break;
+		default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	/* blocked before ni_init so the reader thread inherits the mask */
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	shm = create_shm(name, mode, group);
+	if (!shm)
+		return 1;
+	shm->clock = cfg.clock;
+	if (ni_init_with_worker_config(flags, &cfg) != 0) {
+		fprintf(stderr, "ni_init failed (permissions or SCHED_FIFO?)\n");
+		munmap(shm, sizeof(*shm));
+		shm_unlink(name);
+		return 1;
+	}
+	ni_register_device_callback(-1, record_device, NULL,
+				    NI_CB_FLAG_HIGH_PRIORITY);
+	ni_register_batch_callback(publish_frame, NULL, 0);
+	if (mice)
+		ni_enable_mice(1);
+	/* after ni_init, which resets the filter; grabs the open devices too */
+	if (grab)
+		ni_set_device_filter(grab_all, NULL);
+
+	/* the main thread only refreshes the device table and waits for a
+	 * signal; everything else runs on the library reader thread */
+	for (;;) {
+		atomic_store(&shm->device_count, ni_device_count());
+		publish_devices();
+		struct timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
+		int sig = sigtimedwait(&sigs, NULL, &timeout);
+		if (sig > 0)
+			break;
+	}
+
+	ni_shutdown();
+	atomic_store(&shm->alive, 0);
+	ni_shm_notify(shm, 1);
+	munmap(shm, sizeof(*shm));
+	shm_unlink(name);
+	return 0;
+}
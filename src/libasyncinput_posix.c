@@ -1,49 +1,312 @@
 // Agent: Agent Mode, Date: 2025-08-16, Observation: Initial linux MVP implementation, worker thread reads /dev/input/event* with epoll, ring buffer for polling
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np, CPU_SET */
 #include "asyncinput.h"
 #if defined(ASYNCINPUT_HAVE_XKBCOMMON)
 #include <xkbcommon/xkbcommon.h>
 #endif
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/input.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+
+#include "asyncinput_shm.h"
+#ifdef ASYNCINPUT_HAVE_IO_URING
+#include "asyncinput_uring.h"
+#endif
 /* Non-Linux builds compile an empty translation unit here; platform code lives elsewhere. */
 
 
-#define MAX_DEVICES 128
-#define RING_SIZE 1024
+#define MAX_DEVICES 1024 /* device ids, the kernel's eventN minors */
+_Static_assert(NI_SHM_MAX_DEVICES == MAX_DEVICES + 2,
+	       "the shm device table must cover every device id");
+#define DEVICE_CHUNK 32 /* device table slots allocated at once */
+#define RING_DEFAULT_CAPACITY 1024
+#define RING_MAX_CAPACITY (1u << 22)
+#define HUGEPAGE_SIZE (2u << 20)
 #define MAX_EPOLL_EVENTS 16
+#define READ_BATCH 64 /* input_events fetched per read() */
+#define FRAME_MAX 64 /* events buffered per SYN_REPORT frame */
+#define CACHELINE_SIZE 64
+#define PENDING_MAX 20 /* coalesced REL codes, NI_MOUSE_MOVE and SYN_REPORT */
+#define COMPACT_BASE_MARK 0xFFFFu /* ni_event_compact.type of a base marker */
+#define RETRY_FIRST_NS 10000000LL /* first reopen 10 ms after a failed open */
+#define RETRY_MAX_ATTEMPTS 8 /* doubling backoff, ~2.5 s in total */
+#define MAX_SHARDS 8 /* ni_worker_config.workers */
+#define MAX_DISPATCH 8 /* ni_worker_config.dispatch_threads */
+#define XKB_CACHE_SIZE 256 /* direct-mapped, power of two */
+#define MERGE_LOOKAHEAD 32 /* events per queue staged by the ni_poll() merge */
+#define URING_ENTRIES 256 /* SQEs, enough to rearm every device at once */
+#define URING_BUFFERS 64 /* provided buffers of READ_BATCH input_events */
+#define TRACE_RING_SIZE (1u << 20) /* bytes staged per reader thread */
+#define TRACE_FLUSH_NS 10000000LL /* trace writer sleep when idle */
+#define REPLAY_SLEEP_MAX_NS 50000000LL /* bounds ni_shutdown() during a gap */
+/* epoll_event.data of the fds that are not devices, see device_epoll_data() */
+#define EPOLL_DATA_INOTIFY 0xFFFFFFFFu
+#define EPOLL_DATA_TIMER 0xFFFFFFFEu
+#define EPOLL_DATA_WAKE 0xFFFFFFFDu
+#define EPOLL_DATA_MICE 0xFFFFFFFCu
+
+/* Registry entry for ni_register_device_callback() */
+struct device_callback {
+	int id;
+	int device_id; /* -1 for wildcard */
+	ni_device_callback callback;
+	void *user_data;
+	int flags;
+	struct device_callback *next;
+};
+
+/*
+ * Immutable snapshot of the callbacks attached to one device. The worker
+ * loads it once per read() chunk without locking; registration publishes a
+ * fresh table and retires the old one until ni_shutdown(), since the worker
+ * may still be walking it.
+ */
+struct device_cb_table {
+	struct device_cb_table *retired_next;
+	int count;
+	int npre; /* entries [0, npre) run before the global callback */
+	bool exclusive;
+	struct device_cb_entry {
+		ni_device_callback callback;
+		void *user_data;
+	} entries[];
+};
+
+/*
+ * State behind ni_get_device_state(), part of struct device. Only the
+ * thread reading the device writes it, under a seqlock: seq is odd while a
+ * chunk of events is applied. Removal, which may run on any thread, only
+ * clears open; readers check device_id, since a slot may be reused.
+ */
+struct device_state {
+	_Atomic uint32_t seq;
+	_Atomic bool open;
+	struct ni_device_state s;
+};
+
+/*
+ * Multitouch decoder of one device, NI_INIT_FLAG_TOUCH, published like
+ * device_state. pending collects the ABS_MT_* events of the frame
+ * being read and is copied to s at SYN_REPORT under the seqlock; all other
+ * fields belong to the reader thread.
+ */
+struct touch_state {
+	_Atomic uint32_t seq;
+	_Atomic bool open;
+	struct ni_touch_state s;
+	int slot; /* ABS_MT_SLOT the next events apply to */
+	uint32_t dirty; /* slots changed since the last SYN_REPORT */
+	bool dropped; /* SYN_DROPPED: ignore MT until the report, then resync */
+	struct ni_touch_contact pending[NI_TOUCH_MAX_SLOTS];
+};
 
 struct device {
 	int fd;
 	int id;
 	char path[128];
+	struct ni_device_info info;
+	_Atomic(struct device_cb_table *) callbacks;
+	_Atomic(struct event_mask *) mask; /* ni_set_event_mask(), NULL: all */
+	_Atomic bool mask_user; /* no EVIOCSMASK, dispatch_events() filters */
+	bool frame_passed; /* mask_user: an event of this frame passed */
+	bool grabbed; /* EVIOCGRAB held, under dev_lock */
+	bool restamp; /* EVIOCSCLOCKID failed, stamp events as they are read */
+	bool touch; /* protocol-B slots decoded by touch_decode() */
+	uint32_t uring_gen; /* io_uring engine: tag of its read, 0 until armed */
+	int shard; /* worker that reads it, see shard_pick() */
+	_Atomic uint64_t event_count; /* events read, for shard balancing */
+	_Atomic uint64_t drop_count; /* stats: queue losses while queueing */
+	long long open_ns;
+	bool filtered_out; /* client mode only: rejected by the local filter */
+	uint32_t trace_epoch; /* recording whose trace has its info */
+	/* tail of a frame that straddled a read() boundary (batch callback) */
+	int frame_len;
+	struct ni_event frame[FRAME_MAX];
+	/* device table, see device_alloc(). gen is bumped whenever the device
+	 * leaves the table, so epoll data naming it stops matching */
+	_Atomic uint32_t gen;
+	int slot;
+	int live; /* index in g.live, -1 once removed */
+	int next_free;
+	struct device *retired_next; /* see shard_reap() */
+	struct device_state state;
+	struct touch_state mt; /* NI_INIT_FLAG_TOUCH decoder */
 };
 
+/* Histogram behind struct ni_latency_histogram. One thread writes it at a
+ * time, see stat_add(). */
+struct stats_hist {
+	_Atomic uint64_t count;
+	_Atomic uint64_t max_ns;
+	_Atomic uint64_t buckets[NI_HIST_BUCKETS];
+};
+
+/*
+ * Single-producer/single-consumer rings. head is written only by the
+ * producing worker thread, tail only by the consumer; both are free-running
+ * counters masked on access. Each side keeps a cached copy of the other
+ * side's index on its own cache line so the shared index is only re-read
+ * when the ring looks full (producer) or empty (consumer).
+ *
+ * consumer_lock serializes concurrent ni_poll() callers against each other
+ * only; the producer never touches it.
+ *
+ * When full, ring_push() applies the overflow policy and counts the loss
+ * in dropped. Dropping the newest event leaves unreported set and the
+ * producer writes one NI_SYN_DROPPED ahead of the next event that fits.
+ * For NI_OVERFLOW_DROP_OLDEST the producer advances tail itself, so under
+ * that policy the consumer publishes tail with a CAS, copies again if the
+ * producer moved it meanwhile, and reports the gap itself when tail is past
+ * the position it last consumed.
+ *
+ * With NI_INIT_FLAG_COMPACT the ring stores struct ni_event_compact in cev
+ * instead of ev. Slot timestamps are 32-bit deltas against a base that the
+ * producer announces with a COMPACT_BASE_MARK slot whenever an event falls
+ * outside the current window; only the producer knows base_ns and only the
+ * consumer cons_base_ns. Markers share a publish with their event and the
+ * ring never drops the oldest in this mode, so the consumer cannot miss one.
+ *
+ * With NI_COALESCE_REL the producer also keeps the newest motion frame in
+ * pending[] instead of the ring and keeps adding deltas to it. The consumer
+ * takes it only once the ring is empty and the producer pushes it before any
+ * other event, so merging never reorders events. pending_lock is the only
+ * lock both sides take, and only while coalescing.
+ */
 struct ringbuf {
-	struct ni_event ev[RING_SIZE];
-	int head;
-	int tail;
-	pthread_mutex_t lock;
+	_Alignas(CACHELINE_SIZE) _Atomic uint32_t head;
+	uint32_t tail_cache;
+	uint32_t unreported; /* drops not yet announced with NI_SYN_DROPPED */
+	_Atomic uint64_t dropped;
+	long long base_ns; /* compact mode, producer side */
+	long long stamp_ns; /* stats: enqueue time of the chunk being pushed */
+	_Atomic uint32_t high_water; /* stats: most slots in use */
+	_Alignas(CACHELINE_SIZE) _Atomic uint32_t tail;
+	uint32_t head_cache;
+	uint32_t consumed; /* tail after the last pop, for drop-oldest gaps */
+	long long cons_base_ns; /* compact mode, consumer side */
+	pthread_mutex_t consumer_lock;
+	/* events handed out by ni_poll_acquire() and not yet released, 0 if
+	 * none; other consumers find nothing meanwhile. Under consumer_lock. */
+	uint32_t acquired_n;
+	bool acquired_pending; /* they are the pending frame, in acquired[] */
+	struct ni_event acquired[PENDING_MAX];
+	/* set by ring_init(), read-only afterwards */
+	_Alignas(CACHELINE_SIZE) uint32_t size; /* power of two */
+	uint32_t mask;
+	int policy; /* NI_OVERFLOW_* */
+	size_t mapped;
+	struct ni_event *ev;
+	struct ni_event_compact *cev; /* NI_INIT_FLAG_COMPACT, ev is NULL */
+	long long *stamp; /* NI_INIT_FLAG_STATS: when each slot was pushed */
+	size_t stamp_mapped;
+	_Alignas(CACHELINE_SIZE) pthread_mutex_t pending_lock;
+	_Atomic int npending; /* written under pending_lock, read as a hint */
+	struct ni_event pending[PENDING_MAX];
+	struct stats_hist wait; /* stats: slot wait, under consumer_lock */
+};
+
+#ifdef ASYNCINPUT_HAVE_XKBCOMMON
+/*
+ * Keysym and text of a keycode under one effective modifier mask and
+ * layout. Without compose there is no other input to the lookup, so the
+ * entry stays valid until the keymap changes. tag is 0 when empty.
+ */
+struct xkb_cache_entry {
+	uint64_t tag;
+	uint32_t keysym;
+	char text[sizeof(((struct ni_key_event *)0)->text)];
 };
+#endif
 
+/* Same layout for key events; always drops the newest when full. */
 struct keyringbuf {
-	struct ni_key_event ev[RING_SIZE];
-	int head;
-	int tail;
-	pthread_mutex_t lock;
+	_Alignas(CACHELINE_SIZE) _Atomic uint32_t head;
+	uint32_t tail_cache;
+	_Atomic uint64_t dropped;
+	_Alignas(CACHELINE_SIZE) _Atomic uint32_t tail;
+	uint32_t head_cache;
+	pthread_mutex_t consumer_lock;
+	_Alignas(CACHELINE_SIZE) uint32_t size;
+	uint32_t mask;
+	size_t mapped;
+	struct ni_key_event *ev;
+};
+
+/*
+ * Extra reader threads for ni_worker_config.workers > 1. Each one owns an
+ * epoll set with its devices and the ring they produce into, so a flooding
+ * device only delays the devices on its own worker. Shard 0 is worker()
+ * itself with g.epoll_fd and g.queue; shards[0] has no thread, epoll_fd
+ * or queue of its own.
+ */
+struct shard {
+	pthread_t thread;
+	int epoll_fd;
+	struct ringbuf queue;
+	/* odd while the reader uses devices it got from epoll, see
+	 * device_release() */
+	_Atomic uint64_t epoch;
+	_Atomic(struct device *) retired; /* pushed under dev_lock */
+	/* NI_INIT_FLAG_STATS, written by the reader only */
+	_Atomic uint64_t wakeups;
+	_Atomic uint64_t reads;
+	_Atomic uint64_t events;
+	struct stats_hist kernel_hist; /* timestamp_ns to dispatch */
+};
+
+/*
+ * Callback pool thread, ni_worker_config.dispatch_threads. It has one SPSC
+ * ring per reader thread, so every ring keeps a single producer and a
+ * device's events stay in order.
+ */
+struct dispatcher {
+	pthread_t thread;
+	int wake_fd; /* blocking eventfd, written when pending goes 0 -> 1 */
+	_Atomic int pending;
+	int nrings;
+	struct ringbuf rings[MAX_SHARDS];
+};
+
+/*
+ * Staging buffer of ni_record_start() between one reader thread and the
+ * trace writer, a byte SPSC ring of whole records. busy is set while the
+ * reader appends, so ni_record_stop() can wait for appends that saw
+ * recording still set.
+ */
+struct trace_ring {
+	_Alignas(CACHELINE_SIZE) _Atomic uint64_t head;
+	_Atomic bool busy;
+	long long dropped; /* events left out, reader only */
+	_Alignas(CACHELINE_SIZE) _Atomic uint64_t tail;
+	unsigned char *buf; /* TRACE_RING_SIZE bytes */
+};
+
+/* Events ni_poll() took from one queue but has not returned yet. */
+struct merge_source {
+	int pos, len;
+	struct ni_event ev[MERGE_LOOKAHEAD];
 };
 
 static struct {
@@ -51,26 +314,108 @@ static struct {
 	int epoll_fd;
 	int inotify_fd;
 	pthread_t thread;
+	int nshards;
+	struct shard shards[MAX_SHARDS];
+	/* ni_poll() k-way merge over the shard queues and mice_queue */
+	pthread_mutex_t merge_lock;
+	struct merge_source merge[MAX_SHARDS + 1];
+	_Atomic int merge_staged; /* events held in merge[] */
+	int ndispatch;
+	struct dispatcher dispatch[MAX_DISPATCH];
 	volatile int stop;
-	struct device devices[MAX_DEVICES];
+	struct ni_worker_config worker_cfg; /* applied to every reader thread */
+	clockid_t clock_id; /* timebase of every timestamp_ns, fixed at init */
+	int clock; /* the NI_CLOCK_* of clock_id */
+	/* NI_INIT_FLAG_CLIENT: events come from asyncinput-worker via shm,
+	 * NI_INIT_FLAG_REPLAY: from a mapped trace. Devices are stand-ins */
+	int client_mode;
+	struct ni_shm_header *shm;
+	uint64_t shm_cursor;
+	const unsigned char *replay_map; /* .. replay_size, whole records */
+	size_t replay_size;
+	size_t replay_mapped;
+	bool replay_realtime;
+	_Atomic long long replay_left; /* events not dispatched yet */
+	/* ni_record_start(); record_lock serializes start and stop */
+	pthread_mutex_t record_lock;
+	_Atomic bool recording;
+	uint32_t trace_epoch; /* bumped per recording, see record_events() */
+	int trace_fd;
+	pthread_t trace_thread;
+	_Atomic bool trace_stop;
+	bool trace_failed; /* writer thread only until joined */
+	struct trace_ring trace[MAX_SHARDS];
+	/* device table, under dev_lock. Slots come in chunks that stay put
+	 * until ni_shutdown(), so struct device pointers remain valid; index
+	 * maps a device id to its slot + 1 for lock-free lookups */
+	struct device *chunks[MAX_DEVICES / DEVICE_CHUNK];
+	int nslots;
+	int free_slot; /* head of the free list, -1 when empty */
+	_Atomic int index[MAX_DEVICES];
+	struct device *live[MAX_DEVICES]; /* open devices, unordered */
 	int ndevi;
+	bool touch_decode; /* NI_INIT_FLAG_TOUCH */
+	bool stats; /* NI_INIT_FLAG_STATS */
+	/* info of nodes the filter rejected, under dev_lock, dropped when the
+	 * node is created or deleted; a rescan skips those still rejected */
+	struct ni_device_info *rejected[MAX_DEVICES];
 	pthread_mutex_t dev_lock;
 	struct ringbuf queue;
+	/* events of the mice pseudo device, also produced by worker 0 */
+	struct ringbuf mice_queue;
+	/* readable while queue or mice_queue hold events, see queue_signal() */
+	int event_fd;
+	_Atomic int event_pending;
 	ni_callback cb;
 	void *cb_user;
+	ni_batch_callback batch_cb;
+	void *batch_cb_user;
 	ni_device_filter filter;
 	void *filter_user;
-	volatile long long rescan_until_ns;
-	/* optional /dev/input/mice reader */
+	volatile int coalesce; /* NI_COALESCE_* */
+	/* udev retry: nodes whose open failed right after IN_CREATE, worker only */
+	int timer_fd;
+	long long retry_due_ns[MAX_DEVICES]; /* 0 when not scheduled */
+	int retry_attempts[MAX_DEVICES];
+	int wake_fd; /* eventfd, written by ni_shutdown() */
+#ifdef ASYNCINPUT_HAVE_IO_URING
+	/* NI_INIT_FLAG_IO_URING engine, uring.fd is -1 when epoll reads */
+	struct ni_uring uring;
+	_Atomic bool uring_dirty; /* devices came or went, uring_reconcile() */
+	uint32_t uring_gen_next;
+	uint32_t uring_slot_gen[MAX_DEVICES]; /* worker only, armed reads */
+	int uring_files; /* registered file slots, one per table slot */
+#endif
+	/* optional /dev/input/mice, read by worker 0 via EPOLL_DATA_MICE */
 	int mice_enabled;
-	int mice_fd;
-	pthread_t mice_thread;
+	bool mice_reading; /* in g.epoll_fd, under dev_lock */
+	int mice_fd; /* opened once, closed by ni_shutdown() */
+	int mice_packet_len; /* 4 with the ImPS/2 wheel byte, else 3 */
+	_Atomic bool mice_resync; /* set by mice_start() for worker 0 */
+	struct device mice_dev; /* pseudo device id -2, never in the table */
+	int mice_frame_len;
+	struct ni_event mice_frame[16];
+	int mice_buttons; /* last PS/2 button byte, -1 before the first packet */
+	int mice_have; /* bytes of mice_pkt received */
+	unsigned char mice_pkt[4];
+	/* device callback registry, protected by dev_lock */
+	struct device_callback *dev_callbacks;
+	struct device_cb_table *cb_retired;
+	int next_cb_id;
+	/* event masks, protected by dev_lock */
+	struct event_mask *mask_default; /* -1, also given to new devices */
+	struct event_mask *masks; /* every table published, see event_mask */
 	/* xkb layer */
 	int xkb_enabled;
+	int xkb_lazy; /* NI_XKB_LAZY: key_raw now, translate in ni_poll_key_events */
+	struct ringbuf key_raw; /* EV_KEY events awaiting lazy translation */
 #ifdef ASYNCINPUT_HAVE_XKBCOMMON
 	struct xkb_context *xkb_ctx;
 	struct xkb_keymap *xkb_keymap;
 	struct xkb_state *xkb_state;
+	/* modifier bits of the keymap in NI_KMOD_* order, see xkb_mods_resolve */
+	xkb_mod_mask_t xkb_mod_bits[4];
+	struct xkb_cache_entry xkb_cache[XKB_CACHE_SIZE];
 	char xkb_rules[32];
 	char xkb_model[32];
 	char xkb_layout[64];
@@ -82,6 +427,15 @@ static struct {
 	void *key_cb_user;
 } g;
 
+/*
+ * Serializes everything that feeds or replaces the xkb state: eager
+ * translation on the reader, lazy translation in ni_poll_key_events() and
+ * keymap rebuilds. key_raw is popped under it as well, so keys are
+ * translated in kernel order whoever drains them. Outside g so the memset
+ * of ni_init() leaves it alone.
+ */
+static pthread_mutex_t xkb_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static long long
 now_ns(void)
 {
@@ -90,483 +444,4378 @@ now_ns(void)
 	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-static void
-ring_init(struct ringbuf *r)
+/* now_ns() drives timers; timestamps handed to users come from here. */
+static long long
+event_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(g.clock_id, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static clockid_t
+clock_from_ni(int clock)
+{
+	switch (clock) {
+	case NI_CLOCK_BOOTTIME: return CLOCK_BOOTTIME;
+	case NI_CLOCK_REALTIME: return CLOCK_REALTIME;
+	default: return CLOCK_MONOTONIC;
+	}
+}
+
+/* Round a requested capacity up to a power of two within the limits. */
+static uint32_t
+ring_capacity(size_t requested)
+{
+	uint32_t size = 16;
+	if (!requested)
+		requested = RING_DEFAULT_CAPACITY;
+	while (size < requested && size < RING_MAX_CAPACITY)
+		size <<= 1;
+	return size;
+}
+
+/*
+ * Ring storage is mmap()ed: explicit huge pages when the ring is at least
+ * one huge page, otherwise normal pages with a transparent huge page hint
+ * for large rings.
+ */
+static void *
+ring_storage_alloc(size_t bytes, size_t *mapped)
+{
+	if (bytes >= HUGEPAGE_SIZE) {
+		size_t len = (bytes + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+		void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			*mapped = len;
+			return p;
+		}
+	}
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t len = (bytes + page - 1) & ~(page - 1);
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if (len >= HUGEPAGE_SIZE)
+		madvise(p, len, MADV_HUGEPAGE);
+	*mapped = len;
+	return p;
+}
+
+static int
+ring_init(struct ringbuf *r, size_t capacity, int policy, bool compact)
 {
 	memset(r, 0, sizeof(*r));
-	pthread_mutex_init(&r->lock, NULL);
+	pthread_mutex_init(&r->consumer_lock, NULL);
+	pthread_mutex_init(&r->pending_lock, NULL);
+	r->size = ring_capacity(capacity);
+	r->mask = r->size - 1;
+	r->policy = policy;
+	if (compact) {
+		r->cev = ring_storage_alloc(r->size * sizeof(*r->cev), &r->mapped);
+		return r->cev ? 0 : -1;
+	}
+	r->ev = ring_storage_alloc(r->size * sizeof(*r->ev), &r->mapped);
+	return r->ev ? 0 : -1;
+}
+
+static void
+ring_free(struct ringbuf *r)
+{
+	if (r->ev)
+		munmap(r->ev, r->mapped);
+	if (r->cev)
+		munmap(r->cev, r->mapped);
+	if (r->stamp)
+		munmap(r->stamp, r->stamp_mapped);
+	r->ev = NULL;
+	r->cev = NULL;
+	r->stamp = NULL;
+}
+
+/* NI_INIT_FLAG_STATS: time every slot of a poll queue. */
+static int
+ring_stamps_init(struct ringbuf *r)
+{
+	r->stamp = ring_storage_alloc(r->size * sizeof(*r->stamp),
+				      &r->stamp_mapped);
+	return r->stamp ? 0 : -1;
+}
+
+/* Add to a counter only its owner thread writes: no locked instruction,
+ * atomic only so readers never see a torn value. */
+static inline void
+stat_add(_Atomic uint64_t *c, uint64_t n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
+
+static void
+hist_add(struct stats_hist *h, long long ns)
+{
+	uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+	stat_add(&h->buckets[ni_hist_bucket(v)], 1);
+	stat_add(&h->count, 1);
+	if (v > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&h->max_ns, v, memory_order_relaxed);
+}
+
+static void
+hist_sum(struct ni_latency_histogram *out, struct stats_hist *h)
+{
+	out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+	uint64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+	if (max > out->max_ns)
+		out->max_ns = max;
+	for (int b = 0; b < NI_HIST_BUCKETS; b++)
+		out->buckets[b] += atomic_load_explicit(&h->buckets[b],
+							memory_order_relaxed);
+}
+
+/* Producer side with stats: stamp the slots [from, to) about to be
+ * published and track the fill level. */
+static void
+ring_stamp(struct ringbuf *r, uint32_t from, uint32_t to)
+{
+	for (uint32_t p = from; p != to; p++)
+		r->stamp[p & r->mask] = r->stamp_ns;
+	uint32_t high = atomic_load_explicit(&r->high_water,
+					     memory_order_relaxed);
+	if (to - r->tail_cache <= high)
+		return;
+	/* tail_cache lags behind, look again before raising the mark */
+	r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (to - r->tail_cache > high)
+		atomic_store_explicit(&r->high_water, to - r->tail_cache,
+				      memory_order_relaxed);
+}
+
+/* Consumer side with stats: queue wait of the slots [tail, tail + n). */
+static void
+ring_waited(struct ringbuf *r, uint32_t tail, uint32_t n)
+{
+	if (!r->stamp || !n)
+		return;
+	long long now = event_now_ns();
+	for (uint32_t k = 0; k < n; k++)
+		hist_add(&r->wait, now - r->stamp[(tail + k) & r->mask]);
+}
+
+static int16_t
+clamp16(int v)
+{
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
 }
 
+/* Inverse of ni_event_from_compact(). */
 static void
+compact_encode(const struct ni_event *ev, long long base_ns,
+	       struct ni_event_compact *c)
+{
+	c->type = (uint16_t)ev->type;
+	c->code = (uint16_t)ev->code;
+	c->value = ev->value;
+	c->device = (uint16_t)ev->device_id;
+	c->aux = 0;
+	if (ev->type == NI_EV_MOUSE && ev->code == NI_MOUSE_MOVE)
+		c->value = (int32_t)((uint32_t)(uint16_t)clamp16(ev->x) |
+				     (uint32_t)(uint16_t)clamp16(ev->y) << 16);
+	else if (ev->type == NI_EV_MOUSE)
+		c->aux = (uint16_t)ev->extra;
+	if (ev->type == NI_EV_TOUCH) {
+		c->value = (int32_t)((uint32_t)(uint16_t)clamp16(ev->x) |
+				     (uint32_t)(uint16_t)clamp16(ev->y) << 16);
+		c->aux = ev->value < 0 ? 0xFFFFu : (uint16_t)(ev->value & 0x7FFF);
+	}
+	c->ts_delta_ns = (uint32_t)(ev->timestamp_ns - base_ns);
+}
+
+/* Producer side of a compact ring; always drops the newest when full. */
+static bool
+ring_push_compact(struct ringbuf *r, const struct ni_event *ev)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t start = head;
+	long long ts = ev->timestamp_ns;
+	bool rebase = ts < r->base_ns || ts - r->base_ns > (long long)UINT32_MAX;
+	uint32_t need = 1 + (r->unreported ? 1 : 0) + (rebase ? 1 : 0);
+	if (head - r->tail_cache > r->size - need) {
+		r->tail_cache = atomic_load_explicit(&r->tail,
+						     memory_order_acquire);
+		if (head - r->tail_cache > r->size - need) {
+			r->unreported++;
+			atomic_fetch_add_explicit(&r->dropped, 1,
+						  memory_order_relaxed);
+			return false;
+		}
+	}
+	if (rebase) {
+		struct ni_event_compact *m = &r->cev[head++ & r->mask];
+		memset(m, 0, sizeof(*m));
+		m->type = COMPACT_BASE_MARK;
+		m->value = (int32_t)((unsigned long long)ts >> 32);
+		m->ts_delta_ns = (uint32_t)ts;
+		r->base_ns = ts;
+	}
+	if (r->unreported) {
+		struct ni_event syn = {0};
+		syn.device_id = -1;
+		syn.type = NI_EV_SYN;
+		syn.code = NI_SYN_DROPPED;
+		syn.value = r->unreported > INT_MAX ? INT_MAX : (int)r->unreported;
+		syn.timestamp_ns = ts;
+		compact_encode(&syn, r->base_ns, &r->cev[head++ & r->mask]);
+		r->unreported = 0;
+	}
+	compact_encode(ev, r->base_ns, &r->cev[head & r->mask]);
+	if (r->stamp)
+		ring_stamp(r, start, head + 1);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+/* Producer side. Applies the overflow policy if the ring is full. */
+static bool
 ring_push(struct ringbuf *r, const struct ni_event *ev)
 {
-	pthread_mutex_lock(&r->lock);
-	int next = (r->head + 1) % RING_SIZE;
-	if (next != r->tail) {
-		r->ev[r->head] = *ev;
-		r->head = next;
+	if (r->cev)
+		return ring_push_compact(r, ev);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t start = head;
+	/* room for a pending NI_SYN_DROPPED as well */
+	uint32_t need = r->unreported ? 2 : 1;
+	if (head - r->tail_cache > r->size - need) {
+		r->tail_cache = atomic_load_explicit(&r->tail,
+						     memory_order_acquire);
+		while (head - r->tail_cache > r->size - need) {
+			if (r->policy != NI_OVERFLOW_DROP_OLDEST) {
+				r->unreported++;
+				atomic_fetch_add_explicit(&r->dropped, 1,
+							  memory_order_relaxed);
+				return false;
+			}
+			/* the consumer reports these, see ring_pop_many() */
+			uint32_t t = r->tail_cache;
+			if (atomic_compare_exchange_weak_explicit(&r->tail, &t, t + 1,
+					memory_order_acq_rel, memory_order_acquire)) {
+				t++;
+				atomic_fetch_add_explicit(&r->dropped, 1,
+							  memory_order_relaxed);
+			}
+			r->tail_cache = t;
+		}
 	}
-	pthread_mutex_unlock(&r->lock);
+	if (r->unreported) {
+		struct ni_event syn = {0};
+		syn.device_id = -1;
+		syn.type = NI_EV_SYN;
+		syn.code = NI_SYN_DROPPED;
+		syn.value = r->unreported > INT_MAX ? INT_MAX : (int)r->unreported;
+		syn.timestamp_ns = ev->timestamp_ns;
+		r->ev[head++ & r->mask] = syn;
+		r->unreported = 0;
+	}
+	r->ev[head & r->mask] = *ev;
+	if (r->stamp)
+		ring_stamp(r, start, head + 1);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+static bool
+ring_full(struct ringbuf *r)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	/* compact rings may also need a slot for a base marker */
+	uint32_t need = (r->unreported ? 2 : 1) + (r->cev ? 1 : 0);
+	return head - tail > r->size - need;
 }
 
+/*
+ * Consumer side of a compact ring. With expand set, fills struct ni_event
+ * (cout unused); otherwise fills cout relative to *batch_base, which is set
+ * from the first event, and stops at the first event outside the 32-bit
+ * window so the next call can start a new batch.
+ */
 static int
-ring_pop_many(struct ringbuf *r, struct ni_event *out, int max)
+ring_pop_compact(struct ringbuf *r, struct ni_event *out,
+		 struct ni_event_compact *cout, int max, long long *batch_base)
 {
+	pthread_mutex_lock(&r->consumer_lock);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (r->head_cache == tail)
+		r->head_cache = atomic_load_explicit(&r->head,
+						     memory_order_acquire);
 	int n = 0;
-	pthread_mutex_lock(&r->lock);
-	while (n < max && r->tail != r->head) {
-		out[n++] = r->ev[r->tail];
-		r->tail = (r->tail + 1) % RING_SIZE;
+	while (n < max && tail != r->head_cache) {
+		const struct ni_event_compact *c = &r->cev[tail & r->mask];
+		if (c->type == COMPACT_BASE_MARK) {
+			r->cons_base_ns = (long long)((unsigned long long)(uint32_t)c->value << 32 |
+						      c->ts_delta_ns);
+			tail++;
+			continue;
+		}
+		long long ts = r->cons_base_ns + c->ts_delta_ns;
+		if (out) {
+			ni_event_from_compact(c, r->cons_base_ns, &out[n]);
+		} else {
+			if (!n && !*batch_base)
+				*batch_base = ts;
+			if (ts < *batch_base ||
+			    ts - *batch_base > (long long)UINT32_MAX)
+				break;
+			cout[n] = *c;
+			cout[n].ts_delta_ns = (uint32_t)(ts - *batch_base);
+		}
+		ring_waited(r, tail, 1);
+		n++;
+		tail++;
 	}
-	pthread_mutex_unlock(&r->lock);
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+	pthread_mutex_unlock(&r->consumer_lock);
 	return n;
 }
 
-static inline void emit_or_queue(struct ni_event *ev)
+/* Consumer side. Copies out at most two contiguous segments. */
+static int
+ring_pop_many(struct ringbuf *r, struct ni_event *out, int max)
+{
+	if (r->cev)
+		return ring_pop_compact(r, out, NULL, max, NULL);
+	pthread_mutex_lock(&r->consumer_lock);
+	if (r->acquired_n) {
+		/* the front of the ring is out with ni_poll_acquire() */
+		pthread_mutex_unlock(&r->consumer_lock);
+		return 0;
+	}
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	uint32_t n;
+	int off;
+	for (;;) {
+		/* events the producer dropped from the front since last time */
+		uint32_t lost = r->policy == NI_OVERFLOW_DROP_OLDEST ?
+				tail - r->consumed : 0;
+		off = lost ? 1 : 0;
+		uint32_t avail = r->head_cache - tail;
+		/* drop-oldest can move tail past a stale head_cache */
+		if (avail == 0 || avail > r->size) {
+			r->head_cache = atomic_load_explicit(&r->head,
+							     memory_order_acquire);
+			avail = r->head_cache - tail;
+		}
+		uint32_t room = (uint32_t)(max - off);
+		n = avail < room ? avail : room;
+		if (!n && !off)
+			break;
+		uint32_t idx = tail & r->mask;
+		uint32_t first = r->size - idx;
+		if (first > n)
+			first = n;
+		memcpy(out + off, &r->ev[idx], first * sizeof(*out));
+		memcpy(out + off + first, &r->ev[0], (n - first) * sizeof(*out));
+		if (r->policy != NI_OVERFLOW_DROP_OLDEST) {
+			ring_waited(r, tail, n);
+			atomic_store_explicit(&r->tail, tail + n,
+					      memory_order_release);
+			break;
+		}
+		/* on failure the producer overwrote what we copied; tail
+		 * now holds its new value, copy again from there */
+		if (atomic_compare_exchange_strong_explicit(&r->tail, &tail,
+				tail + n, memory_order_acq_rel,
+				memory_order_acquire)) {
+			/* a stamp may already be the producer's next one,
+			 * which only shortens that sample */
+			ring_waited(r, tail, n);
+			r->consumed = tail + n;
+			if (off) {
+				struct ni_event syn = {0};
+				syn.device_id = -1;
+				syn.type = NI_EV_SYN;
+				syn.code = NI_SYN_DROPPED;
+				syn.value = lost > INT_MAX ? INT_MAX : (int)lost;
+				syn.timestamp_ns = n ? out[1].timestamp_ns : event_now_ns();
+				out[0] = syn;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&r->consumer_lock);
+	return (int)(n + (uint32_t)off);
+}
+
+static bool
+ring_empty(struct ringbuf *r)
 {
-	if (g.cb) g.cb(ev, g.cb_user); else ring_push(&g.queue, ev);
+	return atomic_load_explicit(&r->head, memory_order_acquire) ==
+	       atomic_load_explicit(&r->tail, memory_order_acquire);
 }
 
-static void keyring_init(struct keyringbuf *r)
+/* Producer side. Caller holds pending_lock. */
+static bool
+ring_flush_pending(struct ringbuf *r)
 {
-	memset(r, 0, sizeof(*r));
-	pthread_mutex_init(&r->lock, NULL);
+	bool queued = false;
+	int n = atomic_load_explicit(&r->npending, memory_order_relaxed);
+	for (int i = 0; i < n; i++)
+		queued |= ring_push(r, &r->pending[i]);
+	atomic_store_explicit(&r->npending, 0, memory_order_relaxed);
+	return queued;
 }
 
-static void keyring_push(struct keyringbuf *r, const struct ni_key_event *ev)
+static bool
+coalescible(const struct ni_event *ev)
 {
-	pthread_mutex_lock(&r->lock);
-	int next = (r->head + 1) % RING_SIZE;
-	if (next != r->tail) {
-		r->ev[r->head] = *ev;
-		r->head = next;
+	return ev->type == NI_EV_REL ||
+	       (ev->type == NI_EV_MOUSE && ev->code == NI_MOUSE_MOVE) ||
+	       (ev->type == NI_EV_SYN && ev->code == NI_SYN_REPORT);
+}
+
+/*
+ * Producer side with NI_COALESCE_REL. Motion for the device that owns
+ * pending[] is added to the matching entry (a trailing SYN_REPORT is kept
+ * last); anything else first pushes pending[] to the ring. Returns whether
+ * the consumer has something new.
+ */
+static bool
+ring_push_coalesced(struct ringbuf *r, const struct ni_event *ev)
+{
+	bool queued = false;
+	pthread_mutex_lock(&r->pending_lock);
+	int n = atomic_load_explicit(&r->npending, memory_order_relaxed);
+	if (n && (!coalescible(ev) || r->pending[0].device_id != ev->device_id)) {
+		queued = ring_flush_pending(r);
+		n = 0;
+	}
+	if (!coalescible(ev) || (n == 0 && ev->type == NI_EV_SYN)) {
+		/* SYN_REPORT of a frame that was not pure motion */
+		queued |= ring_push(r, ev);
+		pthread_mutex_unlock(&r->pending_lock);
+		return queued;
 	}
-	pthread_mutex_unlock(&r->lock);
+	bool has_syn = n && r->pending[n - 1].type == NI_EV_SYN;
+	int i;
+	for (i = 0; i < n; i++) {
+		if (r->pending[i].type == ev->type && r->pending[i].code == ev->code)
+			break;
+	}
+	if (i < n) {
+		struct ni_event *p = &r->pending[i];
+		p->value += ev->value;
+		p->x += ev->x;
+		p->y += ev->y;
+		p->timestamp_ns = ev->timestamp_ns;
+	} else {
+		if (n == PENDING_MAX) {
+			queued |= ring_flush_pending(r);
+			n = 0;
+			has_syn = false;
+		}
+		if (has_syn) {
+			r->pending[n] = r->pending[n - 1];
+			r->pending[n - 1] = *ev;
+		} else {
+			r->pending[n] = *ev;
+		}
+		atomic_store_explicit(&r->npending, n + 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&r->pending_lock);
+	return true;
 }
 
-static int keyring_pop_many(struct keyringbuf *r, struct ni_key_event *out, int max)
+/* Producer side: push to the poll queue, honoring NI_COALESCE_REL. */
+static bool
+queue_push(struct ringbuf *r, const struct ni_event *ev)
 {
-	int n = 0;
-	pthread_mutex_lock(&r->lock);
-	while (n < max && r->tail != r->head) {
-		out[n++] = r->ev[r->tail];
-		r->tail = (r->tail + 1) % RING_SIZE;
+	if ((g.coalesce & NI_COALESCE_REL) ||
+	    (r->policy == NI_OVERFLOW_COALESCE_REL && ring_full(r)))
+		return ring_push_coalesced(r, ev);
+	if (atomic_load_explicit(&r->npending, memory_order_relaxed)) {
+		/* coalescing was just turned off, keep the order */
+		pthread_mutex_lock(&r->pending_lock);
+		ring_flush_pending(r);
+		pthread_mutex_unlock(&r->pending_lock);
 	}
-	pthread_mutex_unlock(&r->lock);
-	return n;
+	return ring_push(r, ev);
 }
 
+/* Consumer side: hand out the pending motion frame once the ring is empty. */
+static int
+ring_take_pending(struct ringbuf *r, struct ni_event *out, int max)
+{
+	if (!atomic_load_explicit(&r->npending, memory_order_acquire))
+		return 0;
+	pthread_mutex_lock(&r->pending_lock);
+	int n = atomic_load_explicit(&r->npending, memory_order_relaxed);
+	int take = 0;
+	if (ring_empty(r)) {
+		take = n < max ? n : max;
+		memcpy(out, r->pending, (size_t)take * sizeof(*out));
+		memmove(r->pending, r->pending + take,
+			(size_t)(n - take) * sizeof(*out));
+		atomic_store_explicit(&r->npending, n - take,
+				      memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&r->pending_lock);
+	return take;
+}
 
-static void *mice_worker(void *arg)
+/*
+ * Consumer side of ni_poll_acquire(): ring slots in place, or the pending
+ * frame copied to acquired[] once the ring is empty. The span is recorded
+ * in acquired_n, so no lock is held while the caller reads it; tail only
+ * moves in ring_release(). Returns -1 while an earlier batch is out.
+ */
+static int
+ring_acquire(struct ringbuf *r, struct ni_event_batch *batch, int max)
 {
-	(void)arg;
-	if (g.mice_fd < 0) {
-		g.mice_fd = open("/dev/input/mice", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-		if (g.mice_fd < 0) return NULL;
+	pthread_mutex_lock(&r->consumer_lock);
+	if (r->acquired_n) {
+		pthread_mutex_unlock(&r->consumer_lock);
+		return -1;
 	}
-	unsigned char buf[8];
-	unsigned char pkt[4];
-	int have = 0;
-while (!g.stop && g.mice_enabled) {
-		ssize_t r = read(g.mice_fd, buf, sizeof(buf));
-		if (r <= 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) { usleep(1000); continue; }
-			break;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (r->head_cache - tail < (uint32_t)max)
+		r->head_cache = atomic_load_explicit(&r->head,
+						     memory_order_acquire);
+	uint32_t avail = r->head_cache - tail;
+	uint32_t n = avail < (uint32_t)max ? avail : (uint32_t)max;
+	if (n) {
+		uint32_t idx = tail & r->mask;
+		uint32_t first = r->size - idx;
+		if (first > n)
+			first = n;
+		batch->events[0] = &r->ev[idx];
+		batch->count[0] = (int)first;
+		if (n > first) {
+			batch->events[1] = r->ev;
+			batch->count[1] = (int)(n - first);
 		}
-		for (ssize_t i = 0; i < r; i++) {
-			pkt[have++] = buf[i];
-			if (have >= 3) {
-				int btn = pkt[0];
-				signed char dx = (signed char)pkt[1];
-				signed char dy = (signed char)pkt[2];
-				struct ni_event ev = {0};
-				ev.device_id = -2; /* pseudo mice id */
-				ev.timestamp_ns = now_ns();
-				/* buttons */
-				ev.type = NI_EV_KEY; ev.code = NI_BTN_LEFT; ev.value = (btn & 0x1) ? 1 : 0; emit_or_queue(&ev);
-				ev.code = NI_BTN_RIGHT; ev.value = (btn & 0x2) ? 1 : 0; emit_or_queue(&ev);
-				ev.code = NI_BTN_MIDDLE; ev.value = (btn & 0x4) ? 1 : 0; emit_or_queue(&ev);
-				/* Also emit a unified NI_EV_MOUSE button event for compatibility */
-				if (btn & 0x1) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = 1; mev.value = 1; emit_or_queue(&mev); }
-				if (!(btn & 0x1)) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = 1; mev.value = 0; emit_or_queue(&mev); }
-				if (btn & 0x2) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = 2; mev.value = 1; emit_or_queue(&mev); }
-				if (!(btn & 0x2)) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = 2; mev.value = 0; emit_or_queue(&mev); }
-				if (btn & 0x4) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = 3; mev.value = 1; emit_or_queue(&mev); }
-				if (!(btn & 0x4)) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = 3; mev.value = 0; emit_or_queue(&mev); }
-				/* rel moves: dy inverted to match evdev coords */
-				ev.type = NI_EV_REL; ev.code = NI_REL_X; ev.value = (int)dx; emit_or_queue(&ev);
-				ev.type = NI_EV_REL; ev.code = NI_REL_Y; ev.value = -(int)dy; emit_or_queue(&ev);
-				/* And a unified NI_EV_MOUSE move event */
-				if (dx || dy) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_MOVE; mev.x = (int)dx; mev.y = -(int)dy; emit_or_queue(&mev); }
-				if (have >= 4) {
-					signed char dz = (signed char)pkt[3];
-					ev.type = NI_EV_REL; ev.code = NI_REL_WHEEL; ev.value = (int)dz; emit_or_queue(&ev);
-				}
-				have = 0;
-			}
+	} else {
+		int take = ring_take_pending(r, r->acquired, max);
+		if (!take) {
+			pthread_mutex_unlock(&r->consumer_lock);
+			return 0;
 		}
+		batch->events[0] = r->acquired;
+		batch->count[0] = take;
+		n = (uint32_t)take;
 	}
-	if (g.mice_fd >= 0) { close(g.mice_fd); g.mice_fd = -1; }
-	return NULL;
+	r->acquired_n = n;
+	r->acquired_pending = batch->events[0] == r->acquired;
+	pthread_mutex_unlock(&r->consumer_lock);
+	batch->total = (int)n;
+	batch->reserved = r;
+	return (int)n;
 }
 
-
+/* Returns -1 if batch is not the span ring_acquire() handed out. */
 static int
-fill_device_info(int fd, const char *path, struct ni_device_info *out)
+ring_release(struct ringbuf *r, const struct ni_event_batch *batch)
 {
-	if (!out) return -1;
-	memset(out, 0, sizeof(*out));
-	strncpy(out->path, path ? path : "", sizeof(out->path)-1);
-	struct input_id id = {0};
-	if (ioctl(fd, EVIOCGID, &id) == 0) {
-		out->bustype = id.bustype;
-		out->vendor = id.vendor;
-		out->product = id.product;
-		out->version = id.version;
+	pthread_mutex_lock(&r->consumer_lock);
+	if (!r->acquired_n || (uint32_t)batch->total != r->acquired_n) {
+		pthread_mutex_unlock(&r->consumer_lock);
+		return -1;
 	}
-	char name[256] = {0};
-	if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0) {
-		strncpy(out->name, name, sizeof(out->name)-1);
+	/* the pending frame already left the ring's bookkeeping */
+	if (!r->acquired_pending) {
+		uint32_t tail = atomic_load_explicit(&r->tail,
+						     memory_order_relaxed);
+		ring_waited(r, tail, r->acquired_n);
+		atomic_store_explicit(&r->tail, tail + r->acquired_n,
+				      memory_order_release);
 	}
+	r->acquired_n = 0;
+	r->acquired_pending = false;
+	pthread_mutex_unlock(&r->consumer_lock);
 	return 0;
 }
 
+/* ring_take_pending() for ni_poll_compact(), same batch rules as
+ * ring_pop_compact(). */
 static int
-open_device_filtered(const char *path, int *out_devid)
+ring_take_pending_compact(struct ringbuf *r, struct ni_event_compact *out,
+			  int max, long long *batch_base)
 {
-	int devid = -1;
-	/* deduce device id from path /dev/input/eventN */
-	const char *p = strrchr(path, 't');
-	if (p) {
-		int n = atoi(p+1);
-		if (n >= 0) devid = n;
+	if (!atomic_load_explicit(&r->npending, memory_order_acquire))
+		return 0;
+	pthread_mutex_lock(&r->pending_lock);
+	int n = atomic_load_explicit(&r->npending, memory_order_relaxed);
+	int take = 0;
+	if (ring_empty(r)) {
+		while (take < n && take < max) {
+			long long ts = r->pending[take].timestamp_ns;
+			if (!*batch_base)
+				*batch_base = ts;
+			if (ts < *batch_base ||
+			    ts - *batch_base > (long long)UINT32_MAX)
+				break;
+			compact_encode(&r->pending[take], *batch_base, &out[take]);
+			take++;
+		}
+		memmove(r->pending, r->pending + take,
+			(size_t)(n - take) * sizeof(r->pending[0]));
+		atomic_store_explicit(&r->npending, n - take,
+				      memory_order_relaxed);
 	}
-	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0)
+	pthread_mutex_unlock(&r->pending_lock);
+	return take;
+}
+
+static bool
+queue_empty(struct ringbuf *r)
+{
+	return ring_empty(r) &&
+	       !atomic_load_explicit(&r->npending, memory_order_acquire);
+}
+
+/* Reader thread running on this thread: its shard, 0 for client mode and
+ * replays. Indexes per-reader state such as the pool and trace rings. */
+static _Thread_local int reader_index;
+
+static struct ringbuf *
+shard_queue(int s)
+{
+	return s ? &g.shards[s].queue : &g.queue;
+}
+
+static int
+shard_epoll(int s)
+{
+	return s ? g.shards[s].epoll_fd : g.epoll_fd;
+}
+
+static bool
+queues_empty(void)
+{
+	for (int s = 1; s < g.nshards; s++) {
+		if (!queue_empty(&g.shards[s].queue))
+			return false;
+	}
+	return queue_empty(&g.queue) && queue_empty(&g.mice_queue) &&
+	       !atomic_load(&g.merge_staged);
+}
+
+/* The queues ni_poll() drains, in order: shard 0..nshards-1, then mice. */
+static struct ringbuf *
+poll_queue(int s)
+{
+	return s < g.nshards ? shard_queue(s) : &g.mice_queue;
+}
+
+#ifdef ASYNCINPUT_HAVE_IO_URING
+/* set on the io_uring worker, the only thread that touches the SQ */
+static _Thread_local bool uring_thread;
+static const uint64_t uring_one = 1;
+
+#define URING_DATA_EPOLL 1u /* multishot poll of g.epoll_fd */
+#define URING_DATA_SIGNAL 2u /* queue_signal() write to g.event_fd */
+#define URING_DATA_CANCEL 3u
+
+static bool
+uring_active(void)
+{
+	return g.uring.fd >= 0;
+}
+
+/* Reads carry their fixed file slot and the device's uring_gen. */
+static uint64_t
+uring_data(uint32_t gen, int slot)
+{
+	return (uint64_t)gen << 32 | (uint32_t)slot;
+}
+
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe *sqe = ni_uring_get_sqe(&g.uring);
+	if (!sqe) {
+		/* SQ full: submit without waiting to make room */
+		(void)ni_uring_enter(&g.uring, false);
+		sqe = ni_uring_get_sqe(&g.uring);
+	}
+	return sqe;
+}
+
+/* Queue the eventfd write; the worker's next io_uring_enter() issues it
+ * together with its wait, so signalling costs no extra syscall. */
+static bool
+uring_signal(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = g.event_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&uring_one;
+	sqe->len = sizeof(uring_one);
+	sqe->user_data = URING_DATA_SIGNAL;
+	return true;
+}
+
+/* A device was opened or closed: the worker re-arms its reads. */
+static void
+uring_kick(void)
+{
+	if (!uring_active())
+		return;
+	atomic_store(&g.uring_dirty, true);
+	uint64_t one = 1;
+	ssize_t r = write(g.wake_fd, &one, sizeof(one));
+	(void)r;
+}
+#else
+static bool
+uring_active(void)
+{
+	return false;
+}
+
+static void
+uring_kick(void)
+{
+}
+#endif
+
+/*
+ * Producer side, after pushing to queue or mice_queue. event_pending makes
+ * this one eventfd write per empty -> non-empty transition instead of one
+ * per event; the fence orders the ring head store before the flag.
+ */
+static void
+queue_signal(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_exchange(&g.event_pending, 1)) {
+#ifdef ASYNCINPUT_HAVE_IO_URING
+		if (uring_thread && uring_signal())
+			return;
+#endif
+		uint64_t one = 1;
+		ssize_t r = write(g.event_fd, &one, sizeof(one));
+		(void)r;
+	}
+}
+
+/*
+ * Consumer side, once the queues look drained. Clears the eventfd before
+ * the flag and then re-checks the rings, so an event pushed concurrently
+ * either sees the cleared flag and writes, or is seen here.
+ */
+static void
+queue_rearm(void)
+{
+	if (!atomic_load_explicit(&g.event_pending, memory_order_relaxed))
+		return;
+	uint64_t v;
+	ssize_t r = read(g.event_fd, &v, sizeof(v));
+	(void)r;
+	atomic_store(&g.event_pending, 0);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!queues_empty())
+		queue_signal();
+}
+
+static void dispatch_events(struct device *dev, struct ringbuf *q,
+			    struct ni_event *ev, int count,
+			    bool translate_keys);
+
+/* mice_packet() collects one PS/2 packet into g.mice_frame, then flushes it
+ * as a single SYN_REPORT-terminated frame. */
+static inline void emit_or_queue(struct ni_event *ev)
+{
+	if (g.mice_frame_len < (int)(sizeof(g.mice_frame) / sizeof(g.mice_frame[0])) - 1)
+		g.mice_frame[g.mice_frame_len++] = *ev;
+}
+
+static void mice_flush_frame(int device_id, long long timestamp_ns)
+{
+	struct ni_event syn = {0};
+	syn.device_id = device_id;
+	syn.timestamp_ns = timestamp_ns;
+	syn.type = NI_EV_SYN;
+	syn.code = NI_SYN_REPORT;
+	g.mice_frame[g.mice_frame_len++] = syn;
+
+	/* no xkb here: the epoll worker owns the xkb state and key queue */
+	dispatch_events(&g.mice_dev, &g.mice_queue,
+			g.mice_frame, g.mice_frame_len, false);
+	g.mice_frame_len = 0;
+}
+
+static int keyring_init(struct keyringbuf *r, size_t capacity)
+{
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->consumer_lock, NULL);
+	r->size = ring_capacity(capacity);
+	r->mask = r->size - 1;
+	r->ev = ring_storage_alloc(r->size * sizeof(*r->ev), &r->mapped);
+	return r->ev ? 0 : -1;
+}
+
+static void keyring_free(struct keyringbuf *r)
+{
+	if (r->ev)
+		munmap(r->ev, r->mapped);
+	r->ev = NULL;
+}
+
+static bool keyring_push(struct keyringbuf *r, const struct ni_key_event *ev)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (head - r->tail_cache == r->size) {
+		r->tail_cache = atomic_load_explicit(&r->tail,
+						     memory_order_acquire);
+		if (head - r->tail_cache == r->size) {
+			atomic_fetch_add_explicit(&r->dropped, 1,
+						  memory_order_relaxed);
+			return false;
+		}
+	}
+	r->ev[head & r->mask] = *ev;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+static int keyring_pop_many(struct keyringbuf *r, struct ni_key_event *out, int max)
+{
+	pthread_mutex_lock(&r->consumer_lock);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (r->head_cache == tail)
+		r->head_cache = atomic_load_explicit(&r->head,
+						     memory_order_acquire);
+	uint32_t avail = r->head_cache - tail;
+	uint32_t n = avail < (uint32_t)max ? avail : (uint32_t)max;
+	if (n) {
+		uint32_t idx = tail & r->mask;
+		uint32_t first = r->size - idx;
+		if (first > n)
+			first = n;
+		memcpy(out, &r->ev[idx], first * sizeof(*out));
+		memcpy(out + first, &r->ev[0], (n - first) * sizeof(*out));
+		atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+	}
+	pthread_mutex_unlock(&r->consumer_lock);
+	return (int)n;
+}
+
+
+/* Per-thread nice only exists via the kernel tid; best effort since lowering
+ * it needs CAP_SYS_NICE. SCHED_FIFO threads ignore nice. */
+static void
+thread_apply_nice(void)
+{
+	if (g.worker_cfg.rt_priority > 0 || g.worker_cfg.nice_level == 0)
+		return;
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	(void)setpriority(PRIO_PROCESS, (id_t)tid, g.worker_cfg.nice_level);
+}
+
+/* Start fn(shard) as a reader thread; shard s is pinned s CPUs after
+ * cpu_affinity, wrapping around. */
+static int
+thread_create_configured(pthread_t *thread, void *(*fn)(void *), int shard)
+{
+	const struct ni_worker_config *cfg = &g.worker_cfg;
+	pthread_attr_t attr;
+	if (pthread_attr_init(&attr) != 0)
+		return -1;
+	if (cfg->stack_size) {
+		size_t sz = cfg->stack_size;
+		if (sz < (size_t)PTHREAD_STACK_MIN)
+			sz = PTHREAD_STACK_MIN;
+		pthread_attr_setstacksize(&attr, sz);
+	}
+	if (cfg->cpu_affinity >= 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+		int cpu = cfg->cpu_affinity;
+		if (shard && ncpu > 0)
+			cpu = (int)((cpu + shard) % ncpu);
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	if (cfg->rt_priority > 0) {
+		struct sched_param sp = { .sched_priority = cfg->rt_priority };
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+	/* fails with EPERM if SCHED_FIFO is requested without CAP_SYS_NICE */
+	int rc = pthread_create(thread, &attr, fn, (void *)(intptr_t)shard);
+	pthread_attr_destroy(&attr);
+	return rc == 0 ? 0 : -1;
+}
+
+static struct device *
+device_at(int slot)
+{
+	return &g.chunks[slot / DEVICE_CHUNK][slot % DEVICE_CHUNK];
+}
+
+/*
+ * Device with this id, or NULL. Ids in the index need no lock, as long as
+ * the caller copes with the slot being reused meanwhile (seqlock readers
+ * check the id they copied). Other ids, which only client mode stores,
+ * take a scan of g.live under dev_lock.
+ */
+static struct device *
+device_find(int device_id)
+{
+	if (device_id >= 0 && device_id < MAX_DEVICES) {
+		int s = atomic_load_explicit(&g.index[device_id],
+					     memory_order_acquire);
+		return s ? device_at(s - 1) : NULL;
+	}
+	for (int i = 0; i < g.ndevi; i++) {
+		if (g.live[i]->id == device_id)
+			return g.live[i];
+	}
+	return NULL;
+}
+
+/* Take a free slot, adding a chunk when there is none. Under dev_lock;
+ * the device stays invisible until device_link(). */
+static struct device *
+device_alloc(void)
+{
+	if (g.free_slot < 0) {
+		int c = g.nslots / DEVICE_CHUNK;
+		if (c == MAX_DEVICES / DEVICE_CHUNK)
+			return NULL;
+		struct device *chunk = calloc(DEVICE_CHUNK, sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		g.chunks[c] = chunk;
+		for (int i = DEVICE_CHUNK - 1; i >= 0; i--) {
+			chunk[i].slot = g.nslots + i;
+			chunk[i].live = -1;
+			chunk[i].next_free = g.free_slot;
+			/* never 0, which tags the EPOLL_DATA_* sentinels */
+			atomic_init(&chunk[i].gen, 1);
+			g.free_slot = chunk[i].slot;
+		}
+		g.nslots += DEVICE_CHUNK;
+	}
+	struct device *dev = device_at(g.free_slot);
+	g.free_slot = dev->next_free;
+	dev->trace_epoch = 0; /* a new device for the trace */
+	return dev;
+}
+
+/* Publish a set up device. Under dev_lock. */
+static void
+device_link(struct device *dev)
+{
+	dev->live = g.ndevi;
+	g.live[g.ndevi++] = dev;
+	if (dev->id >= 0 && dev->id < MAX_DEVICES)
+		atomic_store_explicit(&g.index[dev->id], dev->slot + 1,
+				      memory_order_release);
+}
+
+/* Take a device out of the table, under dev_lock. Readers that already
+ * hold the pointer may still use it, see device_release(). */
+static void
+device_unlink(struct device *dev)
+{
+	if (dev->id >= 0 && dev->id < MAX_DEVICES &&
+	    atomic_load_explicit(&g.index[dev->id], memory_order_relaxed) ==
+	    dev->slot + 1)
+		atomic_store_explicit(&g.index[dev->id], 0, memory_order_release);
+	struct device *last = g.live[--g.ndevi];
+	g.live[dev->live] = last;
+	last->live = dev->live;
+	dev->live = -1;
+	/* seq_cst, pairs with the epoch of device_release() */
+	atomic_fetch_add(&dev->gen, 1);
+}
+
+/* Return an unlinked slot to the free list. Under dev_lock. */
+static void
+device_free(struct device *dev)
+{
+	dev->next_free = g.free_slot;
+	g.free_slot = dev->slot;
+}
+
+/* epoll_event.data of a device: its slot and generation. */
+static uint64_t
+device_epoll_data(struct device *dev)
+{
+	return (uint64_t)atomic_load_explicit(&dev->gen, memory_order_relaxed)
+	       << 32 | (uint32_t)dev->slot;
+}
+
+/* Device behind epoll data, or NULL if it left the table since it was
+ * added. Reader threads only, inside their epoch. */
+static struct device *
+device_from_epoll(uint64_t data)
+{
+	uint32_t slot = (uint32_t)data;
+	if (slot >= MAX_DEVICES)
+		return NULL;
+	struct device *dev = device_at((int)slot);
+	return atomic_load(&dev->gen) == (uint32_t)(data >> 32) ? dev : NULL;
+}
+
+/* Drop the table at shutdown; nothing reads it any more. */
+static void
+devices_free(void)
+{
+	for (int c = 0; c < MAX_DEVICES / DEVICE_CHUNK; c++)
+		free(g.chunks[c]);
+	for (int i = 0; i < MAX_DEVICES; i++)
+		free(g.rejected[i]);
+	memset(g.chunks, 0, sizeof(g.chunks));
+	memset(g.rejected, 0, sizeof(g.rejected));
+	memset(g.index, 0, sizeof(g.index));
+	g.nslots = 0;
+	g.free_slot = -1;
+	g.ndevi = 0;
+}
+
+static void
+state_set_key(struct ni_device_state *s, int code, bool down)
+{
+	if (code < 0 || code >= NI_KEY_CNT)
+		return;
+	if (down)
+		s->keys[code / 8] |= (uint8_t)(1u << (code % 8));
+	else
+		s->keys[code / 8] &= (uint8_t)~(1u << (code % 8));
+	if (code >= NI_BTN_MOUSE && code <= NI_BTN_TASK) {
+		uint32_t bit = 1u << (code - NI_BTN_MOUSE);
+		s->buttons = down ? s->buttons | bit : s->buttons & ~bit;
+	}
+}
+
+/* Copy the kernel's key bitmap and the values of the absolute axes set in
+ * abs_bits (struct ni_device_info layout) of fd into s. */
+static void
+state_query(int fd, const unsigned char *abs_bits, struct ni_device_state *s)
+{
+	unsigned long bits[NI_KEY_CNT / (8 * sizeof(long)) + 1];
+	const int lbits = 8 * (int)sizeof(long);
+	memset(bits, 0, sizeof(bits));
+	if (ioctl(fd, EVIOCGKEY(sizeof(bits)), bits) >= 0) {
+		for (int c = 0; c < NI_KEY_CNT; c++)
+			state_set_key(s, c, (bits[c / lbits] >> (c % lbits)) & 1);
+	}
+	for (int c = 0; c < NI_ABS_CNT; c++) {
+		struct input_absinfo ai;
+		if (ni_bit_test(abs_bits, c) && ioctl(fd, EVIOCGABS(c), &ai) == 0)
+			s->abs[c] = ai.value;
+	}
+}
+
+/* Start a fresh state for a device that was just added. The device is not
+ * read yet, so this thread is the only writer. fd < 0 seeds nothing. */
+static void
+device_state_open(struct device *dev, int fd, const struct ni_device_info *info)
+{
+	struct device_state *st = &dev->state;
+	struct ni_device_state s;
+	memset(&s, 0, sizeof(s));
+	s.device_id = dev->id;
+	if (fd >= 0)
+		state_query(fd, info->abs_bits, &s);
+	atomic_fetch_add_explicit(&st->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	st->s = s;
+	atomic_store_explicit(&st->open, true, memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->seq, 1, memory_order_release);
+}
+
+static void
+device_state_close(struct device *dev)
+{
+	atomic_store_explicit(&dev->state.open, false, memory_order_release);
+}
+
+/* Reader thread side, once per read() chunk of dev. */
+static void
+device_state_apply(struct device *dev, const struct ni_event *ev,
+		   int count)
+{
+	struct device_state *st = &dev->state;
+	if (!atomic_load_explicit(&st->open, memory_order_relaxed))
+		return;
+	bool resync = false;
+	atomic_fetch_add_explicit(&st->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (int i = 0; i < count; i++) {
+		int code = ev[i].code;
+		switch (ev[i].type) {
+		case NI_EV_KEY:
+			state_set_key(&st->s, code, ev[i].value != 0);
+			break;
+		case NI_EV_REL:
+			if (code >= 0 && code < NI_REL_CNT)
+				st->s.rel[code] += ev[i].value;
+			break;
+		case NI_EV_ABS:
+			if (code >= 0 && code < NI_ABS_CNT)
+				st->s.abs[code] = ev[i].value;
+			break;
+		case NI_EV_SYN:
+			/* the kernel's buffer overflowed, key ups may be lost */
+			resync |= code == NI_SYN_DROPPED && ev[i].device_id >= 0;
+			continue;
+		default:
+			continue;
+		}
+		st->s.events++;
+		st->s.timestamp_ns = ev[i].timestamp_ns;
+	}
+	if (resync && dev->fd >= 0) {
+		memset(st->s.keys, 0, sizeof(st->s.keys));
+		st->s.buttons = 0;
+		state_query(dev->fd, dev->info.abs_bits, &st->s);
+		st->s.events++;
+	}
+	atomic_fetch_add_explicit(&st->seq, 1, memory_order_release);
+}
+
+/* Field of c for an ABS_MT_* code, NULL for the codes the decoder drops. */
+static int32_t *
+touch_field(struct ni_touch_contact *c, int code)
+{
+	switch (code) {
+	case ABS_MT_TRACKING_ID: return &c->tracking_id;
+	case ABS_MT_POSITION_X: return &c->x;
+	case ABS_MT_POSITION_Y: return &c->y;
+	case ABS_MT_PRESSURE: return &c->pressure;
+	case ABS_MT_TOUCH_MAJOR: return &c->touch_major;
+	case ABS_MT_TOUCH_MINOR: return &c->touch_minor;
+	case ABS_MT_ORIENTATION: return &c->orientation;
+	case ABS_MT_TOOL_TYPE: return &c->tool_type;
+	default: return NULL;
+	}
+}
+
+/* Read the kernel's slot table of fd into t->pending, one EVIOCGMTSLOTS
+ * per axis the device has. */
+static void
+touch_query(int fd, const unsigned char *abs_bits, struct touch_state *t)
+{
+	struct {
+		uint32_t code;
+		int32_t values[NI_TOUCH_MAX_SLOTS];
+	} req;
+	for (int code = ABS_MT_SLOT + 1; code <= ABS_MT_TOOL_Y; code++) {
+		if (!ni_bit_test(abs_bits, code) || !touch_field(&t->pending[0], code))
+			continue;
+		memset(&req, 0, sizeof(req));
+		req.code = (uint32_t)code;
+		if (ioctl(fd, EVIOCGMTSLOTS(sizeof(req)), &req) < 0)
+			continue;
+		for (int s = 0; s < t->s.nslots; s++)
+			*touch_field(&t->pending[s], code) = req.values[s];
+	}
+	struct input_absinfo ai;
+	if (ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &ai) == 0)
+		t->slot = ai.value;
+}
+
+/* Copy pending to the snapshot, reader thread only. */
+static void
+touch_publish(struct touch_state *t, long long timestamp_ns)
+{
+	int active = 0;
+	for (int s = 0; s < t->s.nslots; s++)
+		active += t->pending[s].tracking_id >= 0;
+	atomic_fetch_add_explicit(&t->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(t->s.slots, t->pending, sizeof(t->s.slots));
+	t->s.active = active;
+	t->s.timestamp_ns = timestamp_ns;
+	t->s.frames++;
+	atomic_fetch_add_explicit(&t->seq, 1, memory_order_release);
+}
+
+/* Set up the decoder of a device being added if it speaks protocol B.
+ * Like device_state_open(), the device is not being read yet. */
+static bool
+touch_open(struct device *dev, int fd, const struct ni_device_info *info)
+{
+	struct touch_state *t = &dev->mt;
+	struct input_absinfo ai;
+	if (!g.touch_decode || fd < 0 ||
+	    !ni_bit_test(info->abs_bits, ABS_MT_SLOT) ||
+	    ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &ai) != 0)
+		return false;
+	int nslots = ai.maximum + 1;
+	if (nslots < 1)
+		nslots = 1;
+	if (nslots > NI_TOUCH_MAX_SLOTS)
+		nslots = NI_TOUCH_MAX_SLOTS;
+	atomic_fetch_add_explicit(&t->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memset(&t->s, 0, sizeof(t->s));
+	t->s.device_id = dev->id;
+	t->s.nslots = nslots;
+	memset(t->pending, 0, sizeof(t->pending));
+	for (int s = 0; s < NI_TOUCH_MAX_SLOTS; s++)
+		t->pending[s].tracking_id = -1;
+	t->dirty = 0;
+	t->dropped = false;
+	touch_query(fd, info->abs_bits, t);
+	memcpy(t->s.slots, t->pending, sizeof(t->s.slots));
+	for (int s = 0; s < nslots; s++)
+		t->s.active += t->pending[s].tracking_id >= 0;
+	atomic_store_explicit(&t->open, true, memory_order_relaxed);
+	atomic_fetch_add_explicit(&t->seq, 1, memory_order_release);
+	return true;
+}
+
+static void
+touch_close(struct device *dev)
+{
+	atomic_store_explicit(&dev->mt.open, false, memory_order_release);
+}
+
+/*
+ * Replace the ABS_MT_* events of a chunk by one NI_EV_TOUCH per changed
+ * slot ahead of each SYN_REPORT. A slot only turns dirty through an MT
+ * event that is dropped here, except for a frame carried over from the
+ * previous chunk and a resync, so out needs room for count plus two full
+ * slot tables.
+ */
+static int
+touch_decode(struct device *dev, const struct ni_event *in, int count,
+	     struct ni_event *out)
+{
+	struct touch_state *t = &dev->mt;
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		const struct ni_event *ev = &in[i];
+		if (ev->type == NI_EV_ABS && ev->code >= ABS_MT_SLOT &&
+		    ev->code <= ABS_MT_TOOL_Y) {
+			if (t->dropped)
+				continue;
+			if (ev->code == ABS_MT_SLOT) {
+				t->slot = ev->value;
+				continue;
+			}
+			if (t->slot < 0 || t->slot >= t->s.nslots)
+				continue;
+			int32_t *f = touch_field(&t->pending[t->slot], ev->code);
+			if (f && *f != ev->value) {
+				*f = ev->value;
+				t->dirty |= 1u << t->slot;
+			}
+			continue;
+		}
+		if (ev->type == NI_EV_SYN && ev->code == NI_SYN_DROPPED &&
+		    ev->device_id >= 0) {
+			t->dropped = true;
+		} else if (ev->type == NI_EV_SYN && ev->code == NI_SYN_REPORT) {
+			if (t->dropped) {
+				/* like evdev clients: re-read the slots */
+				touch_query(dev->fd, dev->info.abs_bits, t);
+				for (int s = 0; s < t->s.nslots; s++) {
+					if (memcmp(&t->pending[s], &t->s.slots[s],
+						   sizeof(t->pending[s])) != 0)
+						t->dirty |= 1u << s;
+				}
+				t->dropped = false;
+			}
+			for (int s = 0; t->dirty && s < t->s.nslots; s++) {
+				if (!(t->dirty & (1u << s)))
+					continue;
+				const struct ni_touch_contact *c = &t->pending[s];
+				struct ni_event *te = &out[n++];
+				memset(te, 0, sizeof(*te));
+				te->device_id = dev->id;
+				te->type = NI_EV_TOUCH;
+				te->code = s;
+				te->value = c->tracking_id;
+				te->timestamp_ns = ev->timestamp_ns;
+				te->x = c->x;
+				te->y = c->y;
+				te->extra = c->pressure;
+			}
+			if (t->dirty)
+				touch_publish(t, ev->timestamp_ns);
+			t->dirty = 0;
+		}
+		out[n++] = *ev;
+	}
+	return n;
+}
+
+/* One PS/2 packet of /dev/input/mice as a frame of g.mice_dev. */
+static void
+mice_packet(const unsigned char *pkt)
+{
+	int btn = pkt[0];
+	signed char dx = (signed char)pkt[1];
+	signed char dy = (signed char)pkt[2];
+	struct ni_event ev = {0};
+	ev.device_id = -2; /* pseudo mice id */
+	ev.timestamp_ns = event_now_ns();
+	/* buttons; with NI_COALESCE_BUTTONS only the ones
+	 * that changed since the previous packet */
+	int changed = g.mice_buttons < 0 ||
+		      !(g.coalesce & NI_COALESCE_BUTTONS) ?
+		      0x7 : (btn ^ g.mice_buttons) & 0x7;
+	static const int btn_codes[3] = { NI_BTN_LEFT, NI_BTN_RIGHT, NI_BTN_MIDDLE };
+	for (int b = 0; b < 3; b++) {
+		if (!(changed & (1 << b))) continue;
+		ev.type = NI_EV_KEY; ev.code = btn_codes[b]; ev.value = (btn >> b) & 1; emit_or_queue(&ev);
+	}
+	/* Also emit a unified NI_EV_MOUSE button event for compatibility */
+	for (int b = 0; b < 3; b++) {
+		if (!(changed & (1 << b))) continue;
+		struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_BUTTON; mev.extra = b + 1; mev.value = (btn >> b) & 1; emit_or_queue(&mev);
+	}
+	g.mice_buttons = btn;
+	/* rel moves: dy inverted to match evdev coords */
+	bool all = !(g.coalesce & NI_COALESCE_BUTTONS);
+	if (all || dx) { ev.type = NI_EV_REL; ev.code = NI_REL_X; ev.value = (int)dx; emit_or_queue(&ev); }
+	if (all || dy) { ev.type = NI_EV_REL; ev.code = NI_REL_Y; ev.value = -(int)dy; emit_or_queue(&ev); }
+	/* And a unified NI_EV_MOUSE move event */
+	if (dx || dy) { struct ni_event mev = {0}; mev.device_id = ev.device_id; mev.timestamp_ns = ev.timestamp_ns; mev.type = NI_EV_MOUSE; mev.code = NI_MOUSE_MOVE; mev.x = (int)dx; mev.y = -(int)dy; emit_or_queue(&mev); }
+	if (g.mice_packet_len == 4) {
+		/* mousedev sends minus REL_WHEEL, like dy */
+		signed char dz = (signed char)pkt[3];
+		if (all || dz) { ev.type = NI_EV_REL; ev.code = NI_REL_WHEEL; ev.value = -(int)dz; emit_or_queue(&ev); }
+	}
+	/* an unchanged packet produces no frame at all */
+	if (g.mice_frame_len)
+		mice_flush_frame(ev.device_id, ev.timestamp_ns);
+}
+
+/* EPOLL_DATA_MICE on worker 0: mousedev returns at most one packet per
+ * read(), so read until it has nothing left. */
+static void
+mice_input(void)
+{
+	if (atomic_exchange(&g.mice_resync, false)) {
+		/* reading (re)started, see mice_start() */
+		g.mice_have = 0;
+		g.mice_buttons = -1;
+		g.mice_frame_len = 0;
+	}
+	unsigned char buf[8];
+	ssize_t r;
+	while ((r = read(g.mice_fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < r; i++) {
+			/* bit 3 is always set in the first byte of a packet;
+			 * anything else before it is the tail of a lost one */
+			if (g.mice_have == 0 && !(buf[i] & 0x08))
+				continue;
+			g.mice_pkt[g.mice_have++] = buf[i];
+			if (g.mice_have == g.mice_packet_len) {
+				mice_packet(g.mice_pkt);
+				g.mice_have = 0;
+			}
+		}
+	}
+}
+
+/*
+ * Switch mousedev to ImPS/2 with the IntelliMouse sample rate knock and
+ * ask for the id. mousedev answers only the last command byte of a write,
+ * with ACK and the id, 3 once the wheel byte is on. Returns the packet
+ * size to expect.
+ */
+static int
+mice_negotiate(int fd)
+{
+	static const unsigned char imps[] = {
+		0xF3, 200, 0xF3, 100, 0xF3, 80, 0xF2,
+	};
+	if (write(fd, imps, sizeof(imps)) != (ssize_t)sizeof(imps))
+		return 3;
+	unsigned char id[2];
+	size_t have = 0;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (have < sizeof(id) && poll(&pfd, 1, 100) > 0) {
+		ssize_t r = read(fd, id + have, sizeof(id) - have);
+		if (r <= 0)
+			break;
+		have += (size_t)r;
+	}
+	return have == sizeof(id) && id[0] == 0xFA && id[1] == 3 ? 4 : 3;
+}
+
+/* Start reading /dev/input/mice on worker 0, under dev_lock. The fd is
+ * opened once and kept until ni_shutdown(), see mice_stop(). */
+static int
+mice_start(void)
+{
+	if (g.mice_fd < 0) {
+		/* writing is needed to negotiate the wheel only */
+		int fd = open("/dev/input/mice", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		bool rw = fd >= 0;
+		if (!rw)
+			fd = open("/dev/input/mice", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		g.mice_packet_len = rw ? mice_negotiate(fd) : 3;
+		g.mice_fd = fd;
+	} else {
+		/* packets buffered while stopped are stale */
+		unsigned char buf[8];
+		while (read(g.mice_fd, buf, sizeof(buf)) > 0)
+			;
+	}
+	atomic_store(&g.mice_resync, true);
+	device_state_open(&g.mice_dev, -1, NULL);
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.ptr = (void*)EPOLL_DATA_MICE;
+	if (epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, g.mice_fd, &ev) != 0) {
+		device_state_close(&g.mice_dev);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop reading, under dev_lock. The fd stays open: worker 0 may be in
+ * mice_input() right now, and a closed fd could be handed to another
+ * file before its read(). */
+static void
+mice_stop(void)
+{
+	epoll_ctl(g.epoll_fd, EPOLL_CTL_DEL, g.mice_fd, NULL);
+	device_state_close(&g.mice_dev);
+}
+
+/* EVIOCGBIT(type) or, for type -1, EVIOCGPROP into a byte bitmap. The
+ * kernel fills arrays of longs, which differ from bytes on big endian. */
+static void
+query_bits(int fd, int type, unsigned char *out, int nbits)
+{
+	unsigned long bits[NI_KEY_CNT / (8 * sizeof(long)) + 1];
+	const int lbits = 8 * (int)sizeof(long);
+	memset(bits, 0, sizeof(bits));
+	unsigned long req = type < 0 ? EVIOCGPROP(sizeof(bits)) :
+				       EVIOCGBIT(type, sizeof(bits));
+	if (ioctl(fd, req, bits) < 0)
+		return;
+	for (int c = 0; c < nbits; c++) {
+		if ((bits[c / lbits] >> (c % lbits)) & 1)
+			out[c / 8] |= (unsigned char)(1u << (c % 8));
+	}
+}
+
+/* The only place that ioctls a device for its identity; the result is
+ * kept in struct device (or g.rejected) and reused from there. */
+static int
+fill_device_info(int fd, const char *path, struct ni_device_info *out)
+{
+	if (!out) return -1;
+	memset(out, 0, sizeof(*out));
+	strncpy(out->path, path ? path : "", sizeof(out->path)-1);
+	struct input_id id = {0};
+	if (ioctl(fd, EVIOCGID, &id) == 0) {
+		out->bustype = id.bustype;
+		out->vendor = id.vendor;
+		out->product = id.product;
+		out->version = id.version;
+	}
+	char name[256] = {0};
+	if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0) {
+		strncpy(out->name, name, sizeof(out->name)-1);
+	}
+	query_bits(fd, 0, out->ev_bits, NI_EV_CNT);
+	if (ni_bit_test(out->ev_bits, EV_KEY))
+		query_bits(fd, EV_KEY, out->key_bits, NI_KEY_CNT);
+	if (ni_bit_test(out->ev_bits, EV_REL))
+		query_bits(fd, EV_REL, out->rel_bits, NI_REL_CNT);
+	if (ni_bit_test(out->ev_bits, EV_ABS))
+		query_bits(fd, EV_ABS, out->abs_bits, NI_ABS_CNT);
+	query_bits(fd, -1, out->prop_bits, NI_INPUT_PROP_CNT);
+	return 0;
+}
+
+/* Read a small sysfs attribute, without the trailing newline. */
+static int
+sysfs_read(const char *path, char *buf, size_t size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ssize_t n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	while (n > 0 && buf[n - 1] == '\n')
+		n--;
+	buf[n] = 0;
+	return 0;
+}
+
+/* A capability bitmap as sysfs prints it: hex longs, most significant
+ * first, leading zero words left out. The kernel's long is ours unless
+ * this is a 32-bit build on a 64-bit kernel, which no filter bit below 32
+ * notices. */
+static void
+sysfs_bits(const char *dir, const char *file, unsigned char *out, int nbits)
+{
+	char path[128], buf[1024];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (sysfs_read(path, buf, sizeof(buf)) != 0)
+		return;
+	unsigned long words[NI_KEY_CNT / (8 * sizeof(long)) + 1];
+	const int maxwords = (int)(sizeof(words) / sizeof(words[0]));
+	const int lbits = 8 * (int)sizeof(long);
+	int nwords = 0;
+	char *s = buf, *end;
+	for (;;) {
+		unsigned long w = strtoul(s, &end, 16);
+		if (end == s)
+			break;
+		/* a newer kernel's codes past ours: keep the low words */
+		if (nwords == maxwords) {
+			memmove(words, words + 1, sizeof(words) - sizeof(words[0]));
+			nwords--;
+		}
+		words[nwords++] = w;
+		s = end;
+	}
+	for (int c = 0; c < nbits && c / lbits < nwords; c++) {
+		if ((words[nwords - 1 - c / lbits] >> (c % lbits)) & 1)
+			out[c / 8] |= (unsigned char)(1u << (c % 8));
+	}
+}
+
+static unsigned short
+sysfs_hex(const char *dir, const char *file)
+{
+	char path[128], buf[32];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	return sysfs_read(path, buf, sizeof(buf)) == 0 ?
+	       (unsigned short)strtoul(buf, NULL, 16) : 0;
+}
+
+/*
+ * What fill_device_info() would report for event node `node`, taken from
+ * /sys/class/input/eventN/device so that the filter can see a device
+ * without it being opened. Returns -1 if sysfs does not describe the node.
+ */
+static int
+sysfs_device_info(int node, struct ni_device_info *out)
+{
+	char dir[64], path[128];
+	snprintf(dir, sizeof(dir), "/sys/class/input/event%d/device", node);
+	memset(out, 0, sizeof(*out));
+	snprintf(path, sizeof(path), "%s/name", dir);
+	if (sysfs_read(path, out->name, sizeof(out->name)) != 0)
+		return -1;
+	out->id = node;
+	snprintf(out->path, sizeof(out->path), "/dev/input/event%d", node);
+	out->bustype = sysfs_hex(dir, "id/bustype");
+	out->vendor = sysfs_hex(dir, "id/vendor");
+	out->product = sysfs_hex(dir, "id/product");
+	out->version = sysfs_hex(dir, "id/version");
+	sysfs_bits(dir, "capabilities/ev", out->ev_bits, NI_EV_CNT);
+	sysfs_bits(dir, "capabilities/key", out->key_bits, NI_KEY_CNT);
+	sysfs_bits(dir, "capabilities/rel", out->rel_bits, NI_REL_CNT);
+	sysfs_bits(dir, "capabilities/abs", out->abs_bits, NI_ABS_CNT);
+	sysfs_bits(dir, "properties", out->prop_bits, NI_INPUT_PROP_CNT);
+	return 0;
+}
+
+/* N of an "eventN" directory entry, or -1. */
+static int
+event_node(const char *name)
+{
+	if (strncmp(name, "event", 5) != 0 || !name[5])
+		return -1;
+	char *end;
+	long n = strtol(name + 5, &end, 10);
+	return *end || n < 0 || n >= MAX_DEVICES ? -1 : (int)n;
+}
+
+/* Remember a node the filter turned down, see g.rejected. */
+static void
+reject_remember(const struct ni_device_info *info)
+{
+	if (info->id < 0 || info->id >= MAX_DEVICES)
+		return;
+	pthread_mutex_lock(&g.dev_lock);
+	if (!g.rejected[info->id])
+		g.rejected[info->id] = malloc(sizeof(*info));
+	if (g.rejected[info->id])
+		*g.rejected[info->id] = *info;
+	pthread_mutex_unlock(&g.dev_lock);
+}
+
+static void
+reject_forget(int node)
+{
+	if (node < 0 || node >= MAX_DEVICES)
+		return;
+	pthread_mutex_lock(&g.dev_lock);
+	free(g.rejected[node]);
+	g.rejected[node] = NULL;
+	pthread_mutex_unlock(&g.dev_lock);
+}
+
+/* EVIOCGRAB fails with EBUSY while another client holds the grab. */
+static int
+device_grab_fd(int fd, bool enable)
+{
+	return ioctl(fd, EVIOCGRAB, enable ? 1 : 0) == 0 ? 0 : -1;
+}
+
+/* Open an event node and fill *info, unless the filter rejects it, which
+ * the sysfs copy of the info usually shows before anything is opened. A
+ * filter result with NI_FILTER_GRAB also grabs the device; *grabbed tells
+ * whether that worked. */
+static int
+open_device_filtered(const char *path, int *out_devid,
+		     struct ni_device_info *info, bool *grabbed)
+{
+	int devid = -1;
+	/* deduce device id from path /dev/input/eventN */
+	const char *p = strrchr(path, 't');
+	if (p) {
+		int n = atoi(p+1);
+		if (n >= 0) devid = n;
+	}
+	if (g.filter && devid >= 0 && sysfs_device_info(devid, info) == 0 &&
+	    !g.filter(info, g.filter_user)) {
+		reject_remember(info);
+		return -2;
+	}
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	(void)fill_device_info(fd, path, info);
+	info->id = devid;
+	int keep = g.filter ? g.filter(info, g.filter_user) : 1;
+	if (!keep) {
+		close(fd);
+		reject_remember(info);
+		return -2; /* rejected, not worth retrying */
+	}
+	*grabbed = (keep & NI_FILTER_GRAB) && device_grab_fd(fd, true) == 0;
+	if (out_devid) *out_devid = devid;
+	return fd;
+}
+
+static void
+cb_table_retire(struct device_cb_table *t)
+{
+	if (!t)
+		return;
+	t->retired_next = g.cb_retired;
+	g.cb_retired = t;
+}
+
+static bool
+device_callback_matches(const struct device_callback *c, int devid)
+{
+	return c->device_id == -1 || c->device_id == devid;
+}
+
+/*
+ * Build the dispatch table for one device from the registry. An
+ * NI_CB_FLAG_EXCLUSIVE callback registered for this exact device wins over
+ * a wildcard exclusive one; either replaces every other callback. Otherwise
+ * NI_CB_FLAG_HIGH_PRIORITY callbacks come first, each group in registration
+ * order. Caller holds dev_lock.
+ */
+static struct device_cb_table *
+cb_table_build(int devid)
+{
+	const struct device_callback *excl = NULL;
+	int count = 0;
+	for (const struct device_callback *c = g.dev_callbacks; c; c = c->next) {
+		if (!device_callback_matches(c, devid))
+			continue;
+		count++;
+		if ((c->flags & NI_CB_FLAG_EXCLUSIVE) &&
+		    (!excl || excl->device_id == -1))
+			excl = c;
+	}
+	if (count == 0)
+		return NULL;
+	if (excl)
+		count = 1;
+
+	struct device_cb_table *t = calloc(1, sizeof(*t) +
+					   (size_t)count * sizeof(t->entries[0]));
+	if (!t)
+		return NULL;
+	if (excl) {
+		t->exclusive = true;
+		t->entries[0].callback = excl->callback;
+		t->entries[0].user_data = excl->user_data;
+		t->count = t->npre = 1;
+		return t;
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		bool want_high = pass == 0;
+		for (const struct device_callback *c = g.dev_callbacks; c; c = c->next) {
+			bool high = (c->flags & NI_CB_FLAG_HIGH_PRIORITY) != 0;
+			if (!device_callback_matches(c, devid) || high != want_high)
+				continue;
+			t->entries[t->count].callback = c->callback;
+			t->entries[t->count].user_data = c->user_data;
+			t->count++;
+		}
+		if (want_high)
+			t->npre = t->count;
+	}
+	return t;
+}
+
+/* Caller holds dev_lock. */
+static void
+cb_table_publish(struct device *dev)
+{
+	struct device_cb_table *t = cb_table_build(dev->id);
+	cb_table_retire(atomic_exchange_explicit(&dev->callbacks, t,
+						 memory_order_acq_rel));
+}
+
+/* Republish tables of every device a registry change can affect. */
+static void
+cb_tables_refresh(int device_id)
+{
+	for (int i = 0; i < g.ndevi; i++) {
+		if (device_id == -1 || g.live[i]->id == device_id)
+			cb_table_publish(g.live[i]);
+	}
+	if (device_id == -1 || device_id == g.mice_dev.id)
+		cb_table_publish(&g.mice_dev);
+}
+
+/*
+ * Tables behind ni_set_event_mask(). Row 0 masks event types and row t the
+ * codes of type t, as with EVIOCSMASK. A table is immutable once published
+ * and lives until ni_shutdown(), so devices share them and reader threads
+ * load them without a lock.
+ */
+struct event_mask {
+	struct event_mask *next;
+	bool set[EV_CNT];
+	unsigned char bits[EV_CNT][(KEY_CNT + 7) / 8];
+};
+
+/* Codes per type the kernel can mask, 0 for types it cannot. */
+static const int mask_code_cnt[EV_CNT] = {
+	[EV_SYN] = EV_CNT, [EV_KEY] = KEY_CNT, [EV_REL] = REL_CNT,
+	[EV_ABS] = ABS_CNT, [EV_MSC] = MSC_CNT, [EV_SW] = SW_CNT,
+	[EV_LED] = LED_CNT, [EV_SND] = SND_CNT, [EV_FF] = FF_CNT,
+};
+
+/* Load row type of m into the kernel; false if it cannot filter for us. */
+static bool
+mask_apply_kernel(int fd, const struct event_mask *m, int type)
+{
+#ifdef EVIOCSMASK
+	unsigned long bits[KEY_CNT / (8 * sizeof(long)) + 1];
+	const int lbits = 8 * (int)sizeof(long);
+	int cnt = mask_code_cnt[type];
+	memset(bits, 0, sizeof(bits));
+	for (int c = 0; c < cnt; c++) {
+		if (!m->set[type] || ni_bit_test(m->bits[type], c))
+			bits[c / lbits] |= 1UL << (c % lbits);
+	}
+	struct input_mask im = {
+		.type = (uint32_t)type,
+		.codes_size = (uint32_t)((cnt + lbits - 1) / lbits * sizeof(long)),
+		.codes_ptr = (uint64_t)(uintptr_t)bits,
+	};
+	return ioctl(fd, EVIOCSMASK, &im) == 0;
+#else
+	(void)fd; (void)m; (void)type;
+	return false;
+#endif
+}
+
+/* Give dev the table m. Caller holds dev_lock. */
+static void
+mask_attach(struct device *dev, struct event_mask *m)
+{
+	bool user = dev->fd < 0; /* mice and client mode */
+	for (int t = 0; t < EV_CNT && !user; t++) {
+		if (mask_code_cnt[t] && !mask_apply_kernel(dev->fd, m, t))
+			user = true;
+	}
+	atomic_store_explicit(&dev->mask, m, memory_order_release);
+	if (user)
+		atomic_store_explicit(&dev->mask_user, true,
+				      memory_order_release);
+}
+
+static bool
+mask_passes(const struct event_mask *m, const struct ni_event *ev)
+{
+	int type = ev->type, code = ev->code;
+	if (type == NI_EV_MOUSE) {
+		/* legacy copy of the REL/KEY events of the same packet */
+		type = code == NI_MOUSE_MOVE ? EV_REL : EV_KEY;
+		code = -1;
+	} else if (type == NI_EV_TOUCH) {
+		type = EV_ABS; /* decoded from ABS_MT_* */
+		code = -1;
+	}
+	if (type <= EV_SYN || type >= EV_CNT)
+		return true;
+	if (m->set[EV_SYN] && !ni_bit_test(m->bits[EV_SYN], type))
+		return false;
+	if (code < 0 || code >= mask_code_cnt[type] || !m->set[type])
+		return true;
+	return ni_bit_test(m->bits[type], code);
+}
+
+/* The kernel's mask in userspace: drops masked events and, like evdev,
+ * SYN_REPORTs of frames that have nothing left. Reader thread only. */
+static int
+mask_filter(struct device *dev, const struct event_mask *m,
+	    struct ni_event *ev, int count)
+{
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		if (ev[i].type == NI_EV_SYN && ev[i].code == NI_SYN_REPORT) {
+			if (!dev->frame_passed)
+				continue;
+			dev->frame_passed = false;
+		} else if (!mask_passes(m, &ev[i])) {
+			continue;
+		} else if (ev[i].type != NI_EV_SYN) {
+			dev->frame_passed = true;
+		}
+		ev[n++] = ev[i];
+	}
+	return n;
+}
+
+static int has_device_id(int id) {
+	return device_find(id) != NULL;
+}
+
+static bool
+info_is_pointer(const struct ni_device_info *info)
+{
+	return ni_bit_test(info->ev_bits, EV_REL) ||
+	       ni_bit_test(info->ev_bits, EV_ABS);
+}
+
+/*
+ * Worker for a device being opened, under dev_lock. Pointer devices are
+ * the ones that flood; everything else stays on worker 0 next to inotify
+ * and xkb. Load is a device's average event rate since it was opened.
+ * Devices never move afterwards: frame state and the coalescing slot of a
+ * queue assume a single producer.
+ */
+static int
+shard_pick(const struct ni_device_info *info)
+{
+	if (g.nshards == 1 || !info_is_pointer(info))
+		return 0;
+	double rate[MAX_SHARDS] = {0};
+	int count[MAX_SHARDS] = {0};
+	long long now = now_ns();
+	for (int i = 0; i < g.ndevi; i++) {
+		const struct device *d = g.live[i];
+		long long age = now - d->open_ns;
+		if (age < 1000000000LL)
+			age = 1000000000LL;
+		rate[d->shard] += (double)atomic_load_explicit(&d->event_count,
+				memory_order_relaxed) * 1e9 / (double)age;
+		count[d->shard]++;
+	}
+	/* dedicated: skip worker 0 and take an idle worker if there is one */
+	int first = g.worker_cfg.shard_policy == NI_SHARD_DEDICATED;
+	int best = first;
+	for (int s = first + 1; s < g.nshards; s++) {
+		if (first && (count[s] == 0) != (count[best] == 0)) {
+			if (count[s] == 0)
+				best = s;
+			continue;
+		}
+		if (rate[s] < rate[best] ||
+		    (rate[s] == rate[best] && count[s] < count[best]))
+			best = s;
+	}
+	return best;
+}
+
+static void add_device_fd(int fd, int devid, const char *path,
+			  const struct ni_device_info *opened, bool grabbed)
+{
+	struct ni_device_info info = *opened;
+	info.id = devid;
+
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = device_alloc();
+	if (!dev) {
+		pthread_mutex_unlock(&g.dev_lock);
+		close(fd);
+		return;
+	}
+	dev->fd = fd;
+	dev->id = devid;
+	strncpy(dev->path, path ? path : "", sizeof(dev->path)-1);
+	dev->info = info;
+	dev->frame_len = 0;
+	dev->filtered_out = false;
+	/* a reused slot still points at the retired table of its last user */
+	atomic_store_explicit(&dev->callbacks, NULL, memory_order_relaxed);
+	cb_table_publish(dev);
+	atomic_store_explicit(&dev->mask, NULL, memory_order_relaxed);
+	atomic_store_explicit(&dev->mask_user, false, memory_order_relaxed);
+	dev->frame_passed = false;
+	dev->grabbed = grabbed;
+	dev->uring_gen = 0;
+	/* evdev stamps with CLOCK_REALTIME unless told otherwise */
+	int clk = (int)g.clock_id;
+	dev->restamp = ioctl(fd, EVIOCSCLOCKID, &clk) != 0 &&
+		       g.clock_id != CLOCK_REALTIME;
+	if (g.mask_default)
+		mask_attach(dev, g.mask_default);
+	dev->shard = shard_pick(&info);
+	dev->touch = touch_open(dev, fd, &info);
+	atomic_store_explicit(&dev->event_count, 0, memory_order_relaxed);
+	dev->open_ns = now_ns();
+	device_state_open(dev, fd, &info);
+	device_link(dev);
+	if (!uring_active()) {
+		/* the slot and its generation, checked by device_from_epoll() */
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN;
+		ev.data.u64 = device_epoll_data(dev);
+		epoll_ctl(shard_epoll(dev->shard), EPOLL_CTL_ADD, fd, &ev);
+	}
+	pthread_mutex_unlock(&g.dev_lock);
+	uring_kick(); /* the worker arms a multishot read */
+}
+
+/* Close and free the devices retired on a shard, see device_release(). */
+static void
+shard_reap(struct shard *sh)
+{
+	if (!atomic_load_explicit(&sh->retired, memory_order_relaxed))
+		return;
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = atomic_exchange_explicit(&sh->retired, NULL,
+						      memory_order_relaxed);
+	while (dev) {
+		struct device *next = dev->retired_next;
+		close(dev->fd);
+		device_free(dev);
+		dev = next;
+	}
+	pthread_mutex_unlock(&g.dev_lock);
+}
+
+/* Unlink a device from its reader and the table, under dev_lock. */
+static void
+device_remove(struct device *dev)
+{
+	epoll_ctl(shard_epoll(dev->shard), EPOLL_CTL_DEL, dev->fd, NULL);
+	cb_table_retire(atomic_load(&dev->callbacks));
+	device_state_close(dev);
+	touch_close(dev);
+	device_unlink(dev);
+}
+
+/*
+ * Second half of a removal, without dev_lock: close the device and free
+ * its slot once its reader cannot be using it. A reader handles an epoll
+ * batch with an odd epoch, so a device it may have picked up waits on the
+ * shard's retired list until the batch ends. The reader itself needs no
+ * wait, it checks the generation of every later entry.
+ */
+static void
+device_release(struct device *dev)
+{
+	struct shard *sh = &g.shards[dev->shard];
+	/* seq_cst, pairs with the generation bump of device_unlink() */
+	uint64_t e = atomic_load(&sh->epoch);
+	if ((e & 1) && !pthread_equal(pthread_self(),
+				     dev->shard ? sh->thread : g.thread)) {
+		pthread_mutex_lock(&g.dev_lock);
+		dev->retired_next = atomic_load_explicit(&sh->retired,
+							 memory_order_relaxed);
+		atomic_store_explicit(&sh->retired, dev, memory_order_relaxed);
+		pthread_mutex_unlock(&g.dev_lock);
+		/* the reader may have checked the list before we pushed */
+		if (atomic_load(&sh->epoch) != e)
+			shard_reap(sh);
+		return;
+	}
+	close(dev->fd);
+	pthread_mutex_lock(&g.dev_lock);
+	device_free(dev);
+	pthread_mutex_unlock(&g.dev_lock);
+}
+
+static void remove_device_by_id(int devid)
+{
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = device_find(devid);
+	if (dev)
+		device_remove(dev);
+	pthread_mutex_unlock(&g.dev_lock);
+	if (!dev)
+		return;
+	device_release(dev);
+	uring_kick();
+}
+
+/* Open the event nodes /dev/input has that are not open yet. */
+static void scan_devices(void)
+{
+	DIR *dir = opendir("/dev/input");
+	if (!dir)
+		return;
+	char path[64];
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		int i = event_node(de->d_name);
+		if (i < 0) continue;
+		snprintf(path, sizeof(path), "/dev/input/event%d", i);
+		if (has_device_id(i)) continue;
+		/* a node the filter still rejects is not worth reopening */
+		pthread_mutex_lock(&g.dev_lock);
+		bool skip = g.rejected[i] && g.filter &&
+			    !g.filter(g.rejected[i], g.filter_user);
+		pthread_mutex_unlock(&g.dev_lock);
+		if (skip) continue;
+		int devid = -1;
+		struct ni_device_info info;
+		bool grabbed;
+		int fd = open_device_filtered(path, &devid, &info, &grabbed);
+		if (fd < 0) continue;
+		add_device_fd(fd, devid >= 0 ? devid : i, path, &info, grabbed);
+	}
+	closedir(dir);
+}
+
+#include <sys/inotify.h>
+
+/* Arm timer_fd for the earliest scheduled retry, or disarm it. */
+static void
+retry_timer_arm(void)
+{
+	long long due = 0;
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (g.retry_due_ns[i] && (!due || g.retry_due_ns[i] < due))
+			due = g.retry_due_ns[i];
+	}
+	struct itimerspec its = {0};
+	if (due) {
+		its.it_value.tv_sec = due / 1000000000LL;
+		its.it_value.tv_nsec = due % 1000000000LL;
+	}
+	timerfd_settime(g.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * udev usually creates the node before it has fixed up permissions, so the
+ * first open() after IN_CREATE can fail. Retry only that node with a
+ * doubling backoff instead of rescanning every event node.
+ */
+static void
+retry_schedule(int node)
+{
+	if (node < 0 || node >= MAX_DEVICES || g.timer_fd < 0)
+		return;
+	int attempt = g.retry_attempts[node]++;
+	if (attempt >= RETRY_MAX_ATTEMPTS) {
+		g.retry_due_ns[node] = 0;
+		g.retry_attempts[node] = 0;
+	} else {
+		g.retry_due_ns[node] = now_ns() + (RETRY_FIRST_NS << attempt);
+	}
+	retry_timer_arm();
+}
+
+static void
+retry_cancel(int node)
+{
+	if (node < 0 || node >= MAX_DEVICES || !g.retry_due_ns[node])
+		return;
+	g.retry_due_ns[node] = 0;
+	g.retry_attempts[node] = 0;
+	retry_timer_arm();
+}
+
+/* Try to open one event node; schedule a retry if it is not ready yet. */
+static void
+hotplug_open(int node)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/dev/input/event%d", node);
+	if (has_device_id(node)) {
+		retry_cancel(node);
+		return;
+	}
+	int devid = -1;
+	struct ni_device_info info;
+	bool grabbed;
+	int fd = open_device_filtered(path, &devid, &info, &grabbed);
+	if (fd >= 0) {
+		retry_cancel(node);
+		add_device_fd(fd, devid, path, &info, grabbed);
+	} else if (fd == -1 && errno != ENOENT) {
+		retry_schedule(node);
+	} else {
+		retry_cancel(node);
+	}
+}
+
+static void
+handle_retry_timer(void)
+{
+	uint64_t expirations;
+	if (read(g.timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	long long t = now_ns();
+	for (int i = 0; i < MAX_DEVICES; i++) {
+		if (g.retry_due_ns[i] && g.retry_due_ns[i] <= t)
+			hotplug_open(i);
+	}
+	retry_timer_arm();
+}
+
+static void handle_inotify_event(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	for (;;) {
+		len = read(g.inotify_fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			break;
+		}
+		ssize_t off = 0;
+		while (off < len) {
+			struct inotify_event *ie = (struct inotify_event*)(buf + off);
+			if (((ie->mask & IN_CREATE) || (ie->mask & IN_MOVED_TO)) && ie->len > 0) {
+				if (strncmp(ie->name, "event", 5) == 0) {
+					int node = atoi(ie->name + 5);
+					if (node >= 0 && node < MAX_DEVICES) {
+						/* a fresh node starts a fresh backoff */
+						g.retry_attempts[node] = 0;
+						reject_forget(node);
+						hotplug_open(node);
+					}
+				}
+			}
+			if ((ie->mask & IN_DELETE) && ie->len > 0) {
+				if (strncmp(ie->name, "event", 5) == 0) {
+					int devid = atoi(ie->name + 5);
+					retry_cancel(devid);
+					reject_forget(devid);
+					remove_device_by_id(devid);
+				}
+			}
+			off += sizeof(struct inotify_event) + ie->len;
+		}
+	}
+}
+
+#ifdef ASYNCINPUT_HAVE_XKBCOMMON
+/* Look the four NI_KMOD_* modifiers up once per keymap, so a key event
+ * costs one xkb_state_serialize_mods() instead of four name lookups. */
+static void xkb_mods_resolve(struct xkb_keymap *km)
+{
+	static const char *const names[4] = {
+		XKB_MOD_NAME_SHIFT, XKB_MOD_NAME_CTRL,
+		XKB_MOD_NAME_ALT, XKB_MOD_NAME_LOGO,
+	};
+	for (int i = 0; i < 4; i++) {
+		xkb_mod_index_t idx = xkb_keymap_mod_get_index(km, names[i]);
+		g.xkb_mod_bits[i] = idx == XKB_MOD_INVALID ? 0 : (xkb_mod_mask_t)1 << idx;
+	}
+}
+
+static inline uint32_t mods_from_xkb(xkb_mod_mask_t eff)
+{
+	uint32_t m = 0;
+	for (int i = 0; i < 4; i++)
+		if (eff & g.xkb_mod_bits[i]) m |= 1u << i;
+	return m;
+}
+
+/* Cached keysym and text of xkb_code in the current state, filled from
+ * xkb on a miss. */
+static const struct xkb_cache_entry *xkb_cache_lookup(uint32_t xkb_code, xkb_mod_mask_t eff)
+{
+	xkb_layout_index_t layout = xkb_state_serialize_layout(g.xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
+	/* keycodes stay below 0x8000, the bit marks the entry used */
+	uint64_t tag = (uint64_t)eff << 32 | (uint64_t)(layout & 0xffff) << 16 | 0x8000u | xkb_code;
+	uint32_t h = (xkb_code * 0x9E3779B1u) ^ (eff * 0x85EBCA6Bu) ^ layout;
+	struct xkb_cache_entry *c = &g.xkb_cache[(h ^ h >> 16) & (XKB_CACHE_SIZE - 1)];
+	if (c->tag == tag) return c;
+	c->tag = tag;
+	c->keysym = (uint32_t)xkb_state_key_get_one_sym(g.xkb_state, xkb_code);
+	/* n <= 0 leaves it empty; do not keep half a truncated code point */
+	int n = xkb_state_key_get_utf8(g.xkb_state, xkb_code, c->text, sizeof(c->text));
+	if (n >= (int)sizeof(c->text)) {
+		int len = (int)sizeof(c->text) - 1, lead = len - 1;
+		while (lead > 0 && ((unsigned char)c->text[lead] & 0xC0) == 0x80) lead--;
+		unsigned char b = (unsigned char)c->text[lead];
+		int need = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : b >= 0xC0 ? 2 : 1;
+		if (len - lead < need) c->text[lead] = '\0';
+	}
+	return c;
+}
+#endif
+
+/* Run one EV_KEY through the xkb state. Autorepeat (value 2) leaves the
+ * state alone and yields down = 2 with the text of the held key. Returns
+ * false if there is nothing to report. */
+static bool xkb_translate(const struct ni_event *base, struct ni_key_event *kev)
+{
+#ifdef ASYNCINPUT_HAVE_XKBCOMMON
+	if (base->type != NI_EV_KEY || !g.xkb_state) return false;
+	/* Evdev to XKB keycode conversion */
+	uint32_t xkb_code = (uint32_t)base->code + 8u;
+	if (base->value != 2)
+		xkb_state_update_key(g.xkb_state, xkb_code, base->value ? XKB_KEY_DOWN : XKB_KEY_UP);
+	memset(kev, 0, sizeof(*kev));
+	kev->device_id = base->device_id;
+	kev->timestamp_ns = base->timestamp_ns;
+	kev->down = base->value == 2 ? 2 : base->value ? 1 : 0;
+	xkb_mod_mask_t eff = xkb_state_serialize_mods(g.xkb_state, XKB_STATE_MODS_EFFECTIVE);
+	kev->mods = mods_from_xkb(eff);
+	const struct xkb_cache_entry *c = xkb_cache_lookup(xkb_code, eff);
+	kev->keysym = c->keysym;
+	if (kev->down)
+		memcpy(kev->text, c->text, sizeof(kev->text));
+	return true;
+#else
+	(void)base;
+	(void)kev;
+	return false;
+#endif
+}
+
+/* Translate up to max events waiting in key_raw, oldest first; returns
+ * fewer only once key_raw is empty. Needs xkb_lock. */
+static int key_raw_translate(struct ni_key_event *out, int max)
+{
+	struct ni_event raw[64];
+	int n = 0;
+	while (n < max && !queue_empty(&g.key_raw)) {
+		int want = max - n;
+		int got = ring_pop_many(&g.key_raw, raw, want < 64 ? want : 64);
+		if (got <= 0) break;
+		for (int i = 0; i < got; i++)
+			if (xkb_translate(&raw[i], &out[n])) n++;
+	}
+	return n;
+}
+
+static inline void maybe_emit_key_event(const struct ni_event *base)
+{
+	if (!g.xkb_enabled || base->type != NI_EV_KEY) return;
+	/* lazy: the poller pays for translation, a callback needs it now */
+	if (g.xkb_lazy && !g.key_cb) {
+		ring_push(&g.key_raw, base);
+		return;
+	}
+	/* keys queued while lazy (before a key callback or NI_XKB_EAGER) go
+	 * first; callbacks run unlocked, so they may call back into the API */
+	struct ni_key_event kev[64];
+	bool done = false;
+	while (!done) {
+		pthread_mutex_lock(&xkb_lock);
+		int n = key_raw_translate(kev, 63);
+		done = n < 63;
+		if (done && xkb_translate(base, &kev[n])) n++;
+		pthread_mutex_unlock(&xkb_lock);
+		for (int i = 0; i < n; i++) {
+			if (g.key_cb) g.key_cb(&kev[i], g.key_cb_user); else keyring_push(&g.key_queue, &kev[i]);
+		}
+	}
+}
+
+/* Convert a chunk of kernel events into ni_events in one pass. */
+static void
+convert_input_events(const struct input_event *in,
+		     int count,
+		     int devid,
+		     struct ni_event *out)
+{
+	for (int i = 0; i < count; i++) {
+		struct ni_event *ev = &out[i];
+		ev->device_id = devid;
+		ev->type = in[i].type;
+		ev->code = in[i].code;
+		ev->value = in[i].value;
+		/* Use kernel event timestamp (input_event.time) for latency calculations */
+		ev->timestamp_ns = (long long)in[i].time.tv_sec * 1000000000LL +
+				   (long long)in[i].time.tv_usec * 1000LL;
+		ev->x = 0;
+		ev->y = 0;
+		ev->extra = 0;
+	}
+}
+
+static void
+frame_pending_flush(struct device *dev)
+{
+	if (dev->frame_len && g.batch_cb)
+		g.batch_cb(dev->frame, dev->frame_len, g.batch_cb_user);
+	dev->frame_len = 0;
+}
+
+static void
+frame_pending_append(struct device *dev, const struct ni_event *ev, int count)
+{
+	while (count > 0) {
+		if (dev->frame_len == FRAME_MAX)
+			frame_pending_flush(dev); /* oversized frame, deliver partial */
+		int room = FRAME_MAX - dev->frame_len;
+		int n = count < room ? count : room;
+		memcpy(&dev->frame[dev->frame_len], ev, (size_t)n * sizeof(*ev));
+		dev->frame_len += n;
+		ev += n;
+		count -= n;
+	}
+}
+
+/*
+ * Split a converted chunk at SYN_REPORT boundaries and hand each frame to
+ * the batch callback. Frames fully contained in the chunk are delivered in
+ * place; only a frame that straddles two read()s is buffered on the device.
+ */
+static void
+dispatch_frames(struct device *dev, const struct ni_event *ev, int count)
+{
+	int start = 0;
+	for (int k = 0; k < count; k++) {
+		if (ev[k].type != NI_EV_SYN || ev[k].code != NI_SYN_REPORT)
+			continue;
+		if (dev->frame_len) {
+			frame_pending_append(dev, &ev[start], k - start + 1);
+			frame_pending_flush(dev);
+		} else {
+			g.batch_cb(&ev[start], k - start + 1, g.batch_cb_user);
+		}
+		start = k + 1;
+	}
+	if (start < count)
+		frame_pending_append(dev, &ev[start], count - start);
+}
+
+/*
+ * Run the user code for converted events of one device: high-priority
+ * device callbacks, then the global callback (or the poll queue, unless q
+ * is NULL), then the remaining device callbacks. An exclusive device
+ * callback suppresses everything else. dev is NULL for events of no
+ * device, such as a pool queue's NI_SYN_DROPPED.
+ */
+static void
+run_callbacks(struct device *dev,
+	      const struct device_cb_table *t,
+	      struct ringbuf *q,
+	      struct ni_event *ev,
+	      int count,
+	      bool translate_keys)
+{
+	bool exclusive = t && t->exclusive;
+	bool queued = false;
+
+	for (int k = 0; k < count; k++) {
+		if (t) {
+			for (int i = 0; i < t->npre; i++)
+				t->entries[i].callback(&ev[k], &dev->info,
+						       t->entries[i].user_data);
+		}
+		if (!exclusive) {
+			if (g.cb)
+				g.cb(&ev[k], g.cb_user);
+			else if (q && !g.batch_cb)
+				queued |= queue_push(q, &ev[k]);
+		}
+		if (t) {
+			for (int i = t->npre; i < t->count; i++)
+				t->entries[i].callback(&ev[k], &dev->info,
+						       t->entries[i].user_data);
+		}
+		/* Generate high-level key events if xkb is enabled */
+		if (translate_keys)
+			maybe_emit_key_event(&ev[k]);
+	}
+	if (queued)
+		queue_signal();
+	if (g.batch_cb && !exclusive) {
+		if (dev)
+			dispatch_frames(dev, ev, count);
+		else
+			g.batch_cb(ev, count, g.batch_cb_user);
+	}
+}
+
+/* Pool thread of a device: keyboards and the like share thread 0 with xkb,
+ * pointer devices are spread over the others. */
+static int
+pool_index(const struct device *dev)
+{
+	if (g.ndispatch == 1 ||
+	    (dev != &g.mice_dev && !info_is_pointer(&dev->info)))
+		return 0;
+	return 1 + (int)((unsigned)dev->id % (unsigned)(g.ndispatch - 1));
+}
+
+/* Reader side: queue events for pool thread index, never blocks. */
+static void
+pool_submit(int index, const struct ni_event *ev, int count)
+{
+	struct dispatcher *d = &g.dispatch[index];
+	struct ringbuf *r = &d->rings[reader_index];
+	for (int k = 0; k < count; k++)
+		ring_push(r, &ev[k]);
+	/* pairs with the fence in dispatcher_main() */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_exchange(&d->pending, 1)) {
+		uint64_t one = 1;
+		ssize_t w = write(d->wake_fd, &one, sizeof(one));
+		(void)w;
+	}
+}
+
+/* Copy n bytes to ring position pos, wrapping at the end. */
+static void
+trace_copy(struct trace_ring *t, uint64_t pos, const void *src, size_t n)
+{
+	size_t off = pos & (TRACE_RING_SIZE - 1);
+	size_t first = TRACE_RING_SIZE - off < n ? TRACE_RING_SIZE - off : n;
+	memcpy(t->buf + off, src, first);
+	memcpy(t->buf, (const unsigned char *)src + first, n - first);
+}
+
+static void
+trace_put(struct trace_ring *t, uint64_t *pos, uint32_t type, int device_id,
+	  uint32_t count, const void *payload, size_t len)
+{
+	static const unsigned char pad[8];
+	struct ni_trace_record r;
+	r.type = type;
+	r.size = ni_trace_record_size(len);
+	r.device_id = device_id;
+	r.count = count;
+	trace_copy(t, *pos, &r, sizeof(r));
+	trace_copy(t, *pos + sizeof(r), payload, len);
+	trace_copy(t, *pos + sizeof(r) + len, pad, r.size - sizeof(r) - len);
+	*pos += r.size;
+}
+
+/* Stage a chunk for the trace, preceded by the device info the first time
+ * the current recording sees the device. Never waits for the writer. */
+static void
+record_events(struct device *dev, const struct ni_event *ev, int count)
+{
+	struct trace_ring *t = &g.trace[reader_index];
+	/* seq_cst, paired with ni_record_stop() */
+	atomic_store(&t->busy, true);
+	if (!atomic_load(&g.recording)) {
+		atomic_store_explicit(&t->busy, false, memory_order_release);
+		return;
+	}
+	bool describe = dev->trace_epoch != g.trace_epoch;
+	size_t len = (size_t)count * sizeof(*ev);
+	size_t need = ni_trace_record_size(len);
+	if (describe)
+		need += ni_trace_record_size(sizeof(dev->info));
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+	if (TRACE_RING_SIZE - (head - tail) < need) {
+		t->dropped += count;
+	} else {
+		if (describe) {
+			trace_put(t, &head, NI_TRACE_DEVICE, dev->id, 0,
+				  &dev->info, sizeof(dev->info));
+			dev->trace_epoch = g.trace_epoch;
+		}
+		trace_put(t, &head, NI_TRACE_EVENTS, dev->id, (uint32_t)count,
+			  ev, len);
+		atomic_store_explicit(&t->head, head, memory_order_release);
+	}
+	atomic_store_explicit(&t->busy, false, memory_order_release);
+}
+
+static bool
+write_all(int fd, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		p += w;
+		n -= (size_t)w;
+	}
+	return true;
+}
+
+/* Write out what one ring has staged. After a failed write the rest of the
+ * recording is discarded. Returns whether there was anything. */
+static bool
+trace_drain(struct trace_ring *t)
+{
+	uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+	if (head == tail)
+		return false;
+	size_t off = tail & (TRACE_RING_SIZE - 1);
+	size_t n = (size_t)(head - tail);
+	size_t first = TRACE_RING_SIZE - off < n ? TRACE_RING_SIZE - off : n;
+	if (!g.trace_failed)
+		g.trace_failed = !write_all(g.trace_fd, t->buf + off, first) ||
+				 !write_all(g.trace_fd, t->buf, n - first);
+	atomic_store_explicit(&t->tail, head, memory_order_release);
+	return true;
+}
+
+static void *
+trace_writer(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		/* read first: everything staged before the stop is written */
+		bool stop = atomic_load(&g.trace_stop);
+		bool any = false;
+		for (int s = 0; s < g.nshards; s++)
+			any |= trace_drain(&g.trace[s]);
+		if (stop)
+			break;
+		if (!any) {
+			struct timespec ts = { 0, TRACE_FLUSH_NS };
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+
+/* NI_INIT_FLAG_STATS on the reader thread: dispatch latency of a chunk,
+ * and the enqueue time its queue slots get. Returns q's losses so far. */
+static uint64_t
+stats_dispatch(struct ringbuf *q, const struct ni_event *ev, int count)
+{
+	struct shard *sh = &g.shards[reader_index];
+	long long now = event_now_ns();
+	for (int k = 0; k < count; k++)
+		hist_add(&sh->kernel_hist, now - ev[k].timestamp_ns);
+	stat_add(&sh->events, (uint64_t)count);
+	q->stamp_ns = now;
+	return atomic_load_explicit(&q->dropped, memory_order_relaxed);
+}
+
+/*
+ * Deliver converted events of one device, on the thread that read them.
+ * With a callback pool only the filtering and the poll queue happen here
+ * and run_callbacks() follows on the device's pool thread.
+ */
+static void
+dispatch_events(struct device *dev,
+		struct ringbuf *q,
+		struct ni_event *ev,
+		int count,
+		bool translate_keys)
+{
+	atomic_fetch_add_explicit(&dev->event_count, (uint64_t)count,
+				  memory_order_relaxed);
+	if (atomic_load_explicit(&g.recording, memory_order_relaxed))
+		record_events(dev, ev, count);
+	uint64_t dropped = g.stats ? stats_dispatch(q, ev, count) : 0;
+	if (atomic_load_explicit(&dev->mask_user, memory_order_acquire)) {
+		const struct event_mask *m =
+			atomic_load_explicit(&dev->mask, memory_order_acquire);
+		count = mask_filter(dev, m, ev, count);
+		if (!count)
+			return;
+	}
+	const struct device_cb_table *t =
+		atomic_load_explicit(&dev->callbacks, memory_order_acquire);
+
+	/* before any callback, so callbacks may read the state */
+	device_state_apply(dev, ev, count);
+	if (!g.ndispatch) {
+		run_callbacks(dev, t, q, ev, count, translate_keys);
+	} else {
+		if ((!t || !t->exclusive) && !g.cb && !g.batch_cb) {
+			bool queued = false;
+			for (int k = 0; k < count; k++)
+				queued |= queue_push(q, &ev[k]);
+			if (queued)
+				queue_signal();
+		}
+		if (t || g.cb || g.batch_cb || (translate_keys && g.xkb_enabled))
+			pool_submit(pool_index(dev), ev, count);
+	}
+	/* only this thread produces into q, so the difference is ours */
+	if (g.stats)
+		stat_add(&dev->drop_count, atomic_load_explicit(&q->dropped,
+					memory_order_relaxed) - dropped);
+}
+
+/* Device of a pool event, or NULL once it is gone. Slots and callback
+ * tables live until ni_shutdown(), so indexed ids need no lock; only the
+ * other ids of client mode scan g.live under dev_lock. */
+static struct device *
+pool_device(int id)
+{
+	if (id == g.mice_dev.id)
+		return &g.mice_dev;
+	if (id >= 0 && id < MAX_DEVICES)
+		return device_find(id);
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = device_find(id);
+	pthread_mutex_unlock(&g.dev_lock);
+	return dev;
+}
+
+/* Pool thread side: run the callbacks of a popped chunk, one device run at
+ * a time. Only pool thread 0 translates keys, xkb state is not shared. */
+static void
+pool_deliver(bool first, struct ni_event *ev, int n)
+{
+	int start = 0;
+	while (start < n) {
+		int end = start + 1;
+		while (end < n && ev[end].device_id == ev[start].device_id)
+			end++;
+		struct device *dev = ev[start].device_id == -1 ? NULL :
+				     pool_device(ev[start].device_id);
+		const struct device_cb_table *t = dev ?
+			atomic_load_explicit(&dev->callbacks,
+					     memory_order_acquire) : NULL;
+		bool translate = first && dev && dev != &g.mice_dev &&
+				 dev->shard == 0;
+		run_callbacks(dev, t, NULL, &ev[start], end - start, translate);
+		start = end;
+	}
+}
+
+static bool
+dispatcher_empty(struct dispatcher *d)
+{
+	for (int r = 0; r < d->nrings; r++) {
+		if (!queue_empty(&d->rings[r]))
+			return false;
+	}
+	return true;
+}
+
+static void *
+dispatcher_main(void *arg)
+{
+	struct dispatcher *d = arg;
+	bool first = d == &g.dispatch[0];
+	struct ni_event ev[READ_BATCH];
+	for (;;) {
+		/* one chunk per reader and pass, so no reader starves another */
+		bool any = false;
+		for (int r = 0; r < d->nrings; r++) {
+			int n = ring_pop_many(&d->rings[r], ev, READ_BATCH);
+			if (n > 0) {
+				pool_deliver(first, ev, n);
+				any = true;
+			}
+		}
+		if (any)
+			continue;
+		atomic_store(&d->pending, 0);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!dispatcher_empty(d))
+			continue;
+		if (g.stop)
+			break;
+		uint64_t v;
+		ssize_t r = read(d->wake_fd, &v, sizeof(v));
+		(void)r;
+	}
+	return NULL;
+}
+
+/* Convert and dispatch one read() worth of kernel events. */
+static void
+device_input(struct device *dev, const struct input_event *iev, int cnt,
+	     struct ni_event *nev)
+{
+	convert_input_events(iev, cnt, dev->id, nev);
+	if (dev->restamp) {
+		long long t = event_now_ns();
+		for (int k = 0; k < cnt; k++)
+			nev[k].timestamp_ns = t;
+	}
+	if (dev->touch) {
+		/* the bound of touch_decode() */
+		struct ni_event tev[READ_BATCH + 2 * NI_TOUCH_MAX_SLOTS];
+		cnt = touch_decode(dev, nev, cnt, tev);
+		if (cnt)
+			dispatch_events(dev, shard_queue(dev->shard), tev, cnt,
+					dev->shard == 0);
+		return;
+	}
+	/* xkb state belongs to worker 0 */
+	dispatch_events(dev, shard_queue(dev->shard), nev, cnt,
+			dev->shard == 0);
+}
+
+/* Handle what epoll_wait() returned: devices, inotify, the retry timer and
+ * the wake eventfd. */
+static void
+epoll_dispatch(const struct epoll_event *evs, int n,
+	       struct input_event *iev, struct ni_event *nev)
+{
+	for (int i = 0; i < n; i++) {
+		/* Check for inotify events using special pointer value */
+		if (evs[i].data.ptr == (void*)EPOLL_DATA_INOTIFY) {
+			handle_inotify_event();
+			continue;
+		}
+		if (evs[i].data.ptr == (void*)EPOLL_DATA_TIMER) {
+			handle_retry_timer();
+			continue;
+		}
+		if (evs[i].data.ptr == (void*)EPOLL_DATA_MICE) {
+			mice_input();
+			continue;
+		}
+		if (evs[i].data.ptr == (void*)EPOLL_DATA_WAKE) {
+			/* g.stop and uring_dirty are checked by the loop;
+			 * the stop wakeup stays pending for every worker */
+			uint64_t v;
+			ssize_t r = g.stop ? 0 : read(g.wake_fd, &v, sizeof(v));
+			(void)r;
+			continue;
+		}
+		/* NULL if removed after epoll_wait() returned it */
+		struct device *dev = device_from_epoll(evs[i].data.u64);
+		if (!dev)
+			continue;
+		int fd = dev->fd;
+		for (;;) {
+			ssize_t r = read(fd, iev, READ_BATCH * sizeof(*iev));
+			if (g.stats)
+				stat_add(&g.shards[reader_index].reads, 1);
+			if (r < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				/* unplugged: stop the level-triggered
+				 * EPOLLERR storm until IN_DELETE removes it */
+				if (errno == ENODEV)
+					epoll_ctl(shard_epoll(dev->shard),
+						  EPOLL_CTL_DEL, fd, NULL);
+				break;
+			}
+			/* evdev only ever returns whole input_events */
+			int cnt = (int)(r / (ssize_t)sizeof(iev[0]));
+			if (cnt == 0)
+				break;
+
+			device_input(dev, iev, cnt, nev);
+			/* A short read means the kernel buffer is drained;
+			 * skip the read() that would only return EAGAIN. */
+			if (cnt < READ_BATCH)
+				break;
+		}
+	}
+}
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#else
+	sched_yield();
+#endif
+}
+
+/*
+ * ni_worker_config.spin_us: after a wakeup with events the worker polls
+ * without blocking until the deadline passes, so the next event skips the
+ * scheduler wakeup. LLONG_MAX spins forever, 0 blocks right away.
+ */
+static long long
+spin_deadline(void)
+{
+	int us = g.worker_cfg.spin_us;
+	if (us < 0)
+		return LLONG_MAX;
+	return us ? now_ns() + us * 1000LL : 0;
+}
+
+static bool
+spinning(long long spin_until)
+{
+	return spin_until == LLONG_MAX || (spin_until && now_ns() < spin_until);
+}
+
+static void *
+worker(void *arg)
+{
+	reader_index = (int)(intptr_t)arg;
+	int epoll_fd = shard_epoll(reader_index);
+	thread_apply_nice();
+	struct epoll_event evs[MAX_EPOLL_EVENTS];
+	struct input_event iev[READ_BATCH];
+	struct ni_event nev[READ_BATCH];
+	long long spin_until = g.worker_cfg.spin_us < 0 ? LLONG_MAX : 0;
+
+	while (!g.stop) {
+		/* everything that needs the worker is an fd: devices, inotify,
+		 * the retry timer and the shutdown eventfd */
+		bool spin = spinning(spin_until);
+		int n = epoll_wait(epoll_fd, evs, MAX_EPOLL_EVENTS,
+				   spin ? 0 : -1);
+		if (n <= 0) {
+			if (spin)
+				cpu_relax();
+			continue;
+		}
+		struct shard *sh = &g.shards[reader_index];
+		if (g.stats)
+			stat_add(&sh->wakeups, 1);
+		atomic_fetch_add(&sh->epoch, 1);
+		epoll_dispatch(evs, n, iev, nev);
+		atomic_fetch_add(&sh->epoch, 1);
+		shard_reap(sh);
+		spin_until = spin_deadline();
+	}
+	return NULL;
+}
+
+#ifdef ASYNCINPUT_HAVE_IO_URING
+/*
+ * io_uring engine, NI_INIT_FLAG_IO_URING. Every device gets one multishot
+ * read on the registered file slot of its table slot that picks buffers from
+ * the provided buffer ring, so steady-state ingestion is a single
+ * io_uring_enter() per wakeup however many devices are busy; the CQEs
+ * themselves are reaped from shared memory. inotify, the retry timer and
+ * the wake eventfd stay on g.epoll_fd, watched by one multishot poll.
+ * Devices whose slot cannot be registered fall back to that epoll set.
+ */
+
+static void
+uring_arm_epoll(void)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = g.epoll_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_DATA_EPOLL;
+}
+
+static void
+uring_arm_read(int slot, uint32_t gen)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = NI_IORING_OP_READ_MULTISHOT;
+	sqe->fd = slot;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = g.uring.bgid;
+	sqe->user_data = uring_data(gen, slot);
+}
+
+static void
+uring_cancel_read(int slot, uint32_t gen)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = uring_data(gen, slot);
+	sqe->user_data = URING_DATA_CANCEL;
+}
+
+/*
+ * Bring the armed reads in line with the device table after devices came or went.
+ * A closed device's file stays referenced by its slot and its read until
+ * both are dropped here, so this also finishes closing it.
+ */
+static void
+uring_reconcile(void)
+{
+	if (!atomic_exchange(&g.uring_dirty, false))
+		return;
+	uint32_t live[MAX_DEVICES] = {0};
+	int live_fd[MAX_DEVICES];
+	pthread_mutex_lock(&g.dev_lock);
+	for (int i = 0; i < g.ndevi; i++) {
+		struct device *dev = g.live[i];
+		if (dev->fd < 0)
+			continue;
+		if (!dev->uring_gen) {
+			if (!++g.uring_gen_next)
+				g.uring_gen_next = 1;
+			dev->uring_gen = g.uring_gen_next;
+		}
+		live[dev->slot] = dev->uring_gen;
+		live_fd[dev->slot] = dev->fd;
+	}
+	for (int s = 0; s < g.nslots; s++) {
+		if (g.uring_slot_gen[s] == live[s])
+			continue;
+		if (g.uring_slot_gen[s])
+			uring_cancel_read(s, g.uring_slot_gen[s]);
+		g.uring_slot_gen[s] = 0;
+		if (s >= g.uring_files ||
+		    ni_uring_set_file(&g.uring, (unsigned)s,
+				      live[s] ? live_fd[s] : -1) != 0) {
+			if (!live[s])
+				continue;
+			struct device *dev = device_at(s);
+			struct epoll_event ev = {0};
+			ev.events = EPOLLIN;
+			ev.data.u64 = device_epoll_data(dev);
+			epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, dev->fd, &ev);
+			continue;
+		}
+		if (live[s]) {
+			uring_arm_read(s, live[s]);
+			g.uring_slot_gen[s] = live[s];
+		}
+	}
+	pthread_mutex_unlock(&g.dev_lock);
+}
+
+static struct device *
+uring_device(int slot, uint32_t gen)
+{
+	struct device *dev = device_at(slot);
+	return dev->live >= 0 && dev->uring_gen == gen ? dev : NULL;
+}
+
+/* Returns true if a provided buffer went back to the ring. */
+static bool
+uring_complete(const struct io_uring_cqe *cqe, struct epoll_event *evs,
+	       struct input_event *iev, struct ni_event *nev)
+{
+	if (cqe->user_data == URING_DATA_EPOLL) {
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_arm_epoll();
+		/* the poll fires on wakeups, so drain what is ready */
+		int n;
+		do {
+			n = epoll_wait(g.epoll_fd, evs, MAX_EPOLL_EVENTS, 0);
+			if (n > 0)
+				epoll_dispatch(evs, n, iev, nev);
+		} while (n == MAX_EPOLL_EVENTS);
+		return false;
+	}
+	if (cqe->user_data == URING_DATA_SIGNAL ||
+	    cqe->user_data == URING_DATA_CANCEL)
+		return false;
+	int slot = (int)(uint32_t)cqe->user_data;
+	uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+	struct device *dev = NULL;
+	if (slot >= 0 && slot < MAX_DEVICES && g.uring_slot_gen[slot] == gen)
+		dev = uring_device(slot, gen);
+	bool recycled = false;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid =
+			(unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		/* evdev only ever returns whole input_events */
+		int cnt = cqe->res > 0 ?
+			  (int)((size_t)cqe->res / sizeof(struct input_event)) : 0;
+		if (dev && cnt)
+			device_input(dev, (const struct input_event *)
+				     (g.uring.bufs + (size_t)bid * g.uring.buf_size),
+				     cnt, nev);
+		ni_uring_buf_add(&g.uring, bid);
+		recycled = true;
+		if (g.stats)
+			stat_add(&g.shards[0].reads, 1);
+	}
+	/* out of buffers or a CQ overflow ended the read; unplug (ENODEV)
+	 * and cancellation stay ended */
+	if (dev && !(cqe->flags & IORING_CQE_F_MORE) &&
+	    (cqe->res > 0 || cqe->res == -ENOBUFS))
+		uring_arm_read(slot, gen);
+	return recycled;
+}
+
+static void *
+uring_worker(void *arg)
+{
+	(void)arg;
+	thread_apply_nice();
+	uring_thread = true;
+	struct epoll_event evs[MAX_EPOLL_EVENTS];
+	struct input_event iev[READ_BATCH];
+	struct ni_event nev[READ_BATCH];
+
+	long long spin_until = g.worker_cfg.spin_us < 0 ? LLONG_MAX : 0;
+
+	uring_arm_epoll();
+	while (!g.stop) {
+		uring_reconcile();
+		bool recycled = false, any = false;
+		struct io_uring_cqe *cqe;
+		/* the epoch of struct shard, for the fd of a device */
+		atomic_fetch_add(&g.shards[0].epoch, 1);
+		while ((cqe = ni_uring_peek_cqe(&g.uring))) {
+			struct io_uring_cqe c = *cqe;
+			ni_uring_cqe_seen(&g.uring);
+			recycled |= uring_complete(&c, evs, iev, nev);
+			any = true;
+		}
+		atomic_fetch_add(&g.shards[0].epoch, 1);
+		shard_reap(&g.shards[0]);
+		if (recycled)
+			ni_uring_buf_publish(&g.uring);
+		if (g.stop)
+			break;
+		if (any && g.stats)
+			stat_add(&g.shards[0].wakeups, 1);
+		if (any)
+			spin_until = spin_deadline();
+		/* submits the rearms and queue_signal() writes, then waits
+		 * unless busy-polling */
+		bool spin = spinning(spin_until);
+		(void)ni_uring_enter(&g.uring, !spin);
+		if (spin && !ni_uring_peek_cqe(&g.uring))
+			cpu_relax();
+	}
+	return NULL;
+}
+
+/* Set up the engine; on any failure uring.fd stays -1 and epoll reads. */
+static void
+uring_setup(void)
+{
+	static const unsigned char ops[] = {
+		IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_WRITE,
+		NI_IORING_OP_READ_MULTISHOT,
+	};
+	if (ni_uring_init(&g.uring, URING_ENTRIES) != 0)
+		return;
+	/* a table that big counts against RLIMIT_NOFILE; slots past it are
+	 * read through epoll */
+	struct rlimit rl;
+	g.uring_files = MAX_DEVICES;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAX_DEVICES)
+		g.uring_files = (int)rl.rlim_cur;
+	if (!ni_uring_probe(&g.uring, ops, (int)sizeof(ops)) ||
+	    ni_uring_register_files(&g.uring, (unsigned)g.uring_files) != 0 ||
+	    ni_uring_setup_buffers(&g.uring, 0, URING_BUFFERS,
+				   READ_BATCH * sizeof(struct input_event)) != 0)
+		ni_uring_free(&g.uring);
+}
+#endif
+
+/*
+ * Client mode. g.thread runs client_worker instead of the epoll worker: it
+ * sleeps on the worker's futex, copies events out of the shared ring and
+ * feeds them through dispatch_events() exactly like locally read events,
+ * so callbacks, frames, xkb and ni_poll() behave the same.
+ */
+
+/* The mice stand-in, g.mice_dev, in client mode and replays. */
+static struct device *
+standin_mice(void)
+{
+	if (!atomic_load_explicit(&g.mice_dev.state.open, memory_order_relaxed))
+		device_state_open(&g.mice_dev, -1, NULL);
+	return &g.mice_dev;
+}
+
+/* Local stand-in for a device the library did not open: one owned by the
+ * worker process, or one of a trace. Only the client or replay thread adds
+ * entries, under dev_lock so registration can walk them. */
+static struct device *
+standin_add(const struct ni_device_info *info)
+{
+	bool keep = !g.filter || g.filter(info, g.filter_user);
+
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = device_alloc();
+	if (!dev) {
+		pthread_mutex_unlock(&g.dev_lock);
+		return NULL;
+	}
+	dev->fd = -1;
+	dev->id = info->id;
+	snprintf(dev->path, sizeof(dev->path), "%s", info->path);
+	dev->info = *info;
+	dev->frame_len = 0;
+	dev->filtered_out = !keep;
+	atomic_store_explicit(&dev->callbacks, NULL, memory_order_relaxed);
+	cb_table_publish(dev);
+	atomic_store_explicit(&dev->mask, NULL, memory_order_relaxed);
+	atomic_store_explicit(&dev->mask_user, false, memory_order_relaxed);
+	dev->frame_passed = false;
+	dev->grabbed = false;
+	dev->restamp = false;
+	dev->shard = 0;
+	dev->touch = false;
+	if (g.mask_default)
+		mask_attach(dev, g.mask_default);
+	device_state_open(dev, -1, NULL);
+	device_link(dev);
+	pthread_mutex_unlock(&g.dev_lock);
+	return dev;
+}
+
+/* Stand-in for a device of the worker process. */
+static struct device *
+client_device(int devid)
+{
+	if (devid == g.mice_dev.id)
+		return standin_mice();
+	struct device *dev = device_find(devid);
+	if (dev)
+		return dev;
+
+	struct ni_device_info info = {0};
+	if (ni_shm_get_device_info(g.shm, devid, &info) != 0)
+		info.id = devid;
+	return standin_add(&info);
+}
+
+/* The shared ring lapped us; tell consumers like evdev would. */
+static void
+client_report_dropped(uint64_t lost)
+{
+	struct ni_event ev = {0};
+	ev.device_id = -1;
+	ev.type = NI_EV_SYN;
+	ev.code = NI_SYN_DROPPED;
+	ev.value = lost > INT_MAX ? INT_MAX : (int)lost;
+	ev.timestamp_ns = event_now_ns();
+	if (g.ndispatch) {
+		if (!g.cb && !g.batch_cb && queue_push(&g.queue, &ev))
+			queue_signal();
+		if (g.cb || g.batch_cb)
+			pool_submit(0, &ev, 1);
+		return;
+	}
+	if (g.cb)
+		g.cb(&ev, g.cb_user);
+	else if (!g.batch_cb && queue_push(&g.queue, &ev))
+		queue_signal();
+	if (g.batch_cb)
+		g.batch_cb(&ev, 1, g.batch_cb_user);
+}
+
+static void *
+client_worker(void *arg)
+{
+	(void)arg;
+	thread_apply_nice();
+	struct ni_shm_header *h = g.shm;
+	struct ni_event evs[READ_BATCH];
+
+	while (!g.stop) {
+		uint32_t seq = atomic_load_explicit(&h->futex, memory_order_acquire);
+		uint64_t lost;
+		int n = ni_shm_read(h, &g.shm_cursor, evs, READ_BATCH, &lost);
+		if (lost)
+			client_report_dropped(lost);
+		if (n == 0) {
+			if (!atomic_load(&h->alive))
+				break;
+			/* paired with the seq_cst head store in ni_shm_publish */
+			atomic_fetch_add(&h->waiters, 1);
+			if (atomic_load(&h->head) == g.shm_cursor && !g.stop &&
+			    ni_shm_futex_wait(&h->futex, seq, NULL) == 0 &&
+			    g.stats)
+				stat_add(&g.shards[0].wakeups, 1);
+			atomic_fetch_sub(&h->waiters, 1);
+			continue;
+		}
+		if (g.stats)
+			stat_add(&g.shards[0].reads, 1);
+		/* dispatch runs of consecutive events from the same device */
+		int start = 0;
+		for (int k = 1; k <= n; k++) {
+			if (k < n && evs[k].device_id == evs[start].device_id)
+				continue;
+			struct device *dev = client_device(evs[start].device_id);
+			if (dev && !dev->filtered_out)
+				dispatch_events(dev, &g.queue, &evs[start],
+						k - start, true);
+			start = k;
+		}
+	}
+	return NULL;
+}
+
+static int
+client_attach(void)
+{
+	const char *name = getenv("ASYNCINPUT_SHM");
+	if (!name || !name[0])
+		name = NI_WORKER_SHM_DEFAULT;
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(struct ni_shm_header)) {
+		close(fd);
+		return -1;
+	}
+	/* read-write: readers register themselves in h->waiters */
+	void *p = mmap(NULL, sizeof(struct ni_shm_header),
+		       PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	struct ni_shm_header *h = p;
+	if (h->magic != NI_SHM_MAGIC ||
+	    h->version != NI_SHM_VERSION ||
+	    h->ring_size != NI_SHM_RING_SIZE ||
+	    h->event_size != sizeof(struct ni_event) ||
+	    h->clock < NI_CLOCK_MONOTONIC || h->clock > NI_CLOCK_REALTIME ||
+	    !atomic_load(&h->alive)) {
+		munmap(p, sizeof(struct ni_shm_header));
+		return -1;
+	}
+	g.shm = h;
+	/* the worker's timestamps decide the timebase */
+	g.clock_id = clock_from_ni(h->clock);
+	g.clock = h->clock;
+	/* start with live events, not whatever history is in the ring */
+	g.shm_cursor = atomic_load_explicit(&h->head, memory_order_acquire);
+	return 0;
+}
+
+/*
+ * Replay, NI_INIT_FLAG_REPLAY. Like client mode, g.thread runs
+ * replay_worker: it walks the mapped trace and feeds each chunk to
+ * dispatch_events() for a stand-in of its device.
+ */
+
+/* Stand-in for a device of the trace. A later NI_TRACE_DEVICE record for
+ * the same id replaces the info, like a device plugged in again. */
+static struct device *
+replay_device(const struct ni_device_info *info)
+{
+	if (info->id == g.mice_dev.id)
+		return standin_mice();
+	if (info->id < 0)
+		return NULL; /* not a device */
+	struct device *dev = device_find(info->id);
+	if (!dev)
+		return standin_add(info);
+	if (info->path[0]) {
+		pthread_mutex_lock(&g.dev_lock);
+		dev->info = *info;
+		snprintf(dev->path, sizeof(dev->path), "%s", info->path);
+		dev->filtered_out = g.filter && !g.filter(info, g.filter_user);
+		pthread_mutex_unlock(&g.dev_lock);
+	}
+	return dev;
+}
+
+/* NI_INIT_FLAG_REPLAY_REALTIME: sleep until t on the event clock, waking up
+ * now and then to notice ni_shutdown(). */
+static void
+replay_sleep_until(long long t)
+{
+	for (;;) {
+		long long left = t - event_now_ns();
+		if (left <= 0 || g.stop)
+			return;
+		if (left > REPLAY_SLEEP_MAX_NS)
+			left = REPLAY_SLEEP_MAX_NS;
+		struct timespec ts = { left / 1000000000LL, left % 1000000000LL };
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Fast replays are paced by the ni_poll() consumer: losing events to a full
+ * queue would make two runs of the same trace differ. */
+static void
+replay_wait_room(void)
+{
+	struct ringbuf *q = &g.queue;
+	while (!g.stop && !g.cb && !g.batch_cb) {
+		uint32_t used = atomic_load_explicit(&q->head, memory_order_acquire) -
+				atomic_load_explicit(&q->tail, memory_order_acquire);
+		/* half: a chunk is READ_BATCH events, compact markers double it */
+		if (used <= q->size / 2)
+			return;
+		struct timespec ts = { 0, 20000 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void *
+replay_worker(void *arg)
+{
+	(void)arg;
+	thread_apply_nice();
+	struct ni_event evs[READ_BATCH];
+	bool based = false;
+	long long shift = 0; /* from the trace's clock to now */
+
+	size_t off = sizeof(struct ni_trace_header);
+	while (!g.stop && off < g.replay_size) {
+		const struct ni_trace_record *r =
+			(const void *)(g.replay_map + off);
+		off += r->size;
+		if (r->type == NI_TRACE_DEVICE) {
+			struct ni_device_info info;
+			memcpy(&info, r + 1, sizeof(info));
+			info.id = r->device_id;
+			replay_device(&info);
+			continue;
+		}
+		if (r->type != NI_TRACE_EVENTS)
+			continue;
+		struct ni_device_info anon = {0};
+		anon.id = r->device_id;
+		struct device *dev = replay_device(&anon);
+		const struct ni_event *src = (const void *)(r + 1);
+		for (uint32_t done = 0; done < r->count && !g.stop;) {
+			uint32_t n = r->count - done;
+			if (n > READ_BATCH)
+				n = READ_BATCH;
+			memcpy(evs, src + done, n * sizeof(*evs));
+			if (!based) {
+				shift = event_now_ns() - evs[0].timestamp_ns;
+				based = true;
+			}
+			for (uint32_t k = 0; k < n; k++) {
+				evs[k].device_id = r->device_id;
+				evs[k].timestamp_ns += shift;
+			}
+			if (g.replay_realtime)
+				replay_sleep_until(evs[0].timestamp_ns);
+			else
+				replay_wait_room();
+			if (dev && !dev->filtered_out)
+				dispatch_events(dev, &g.queue, evs, (int)n, true);
+			done += n;
+			atomic_fetch_sub(&g.replay_left, (long long)n);
+		}
+	}
+	return NULL;
+}
+
+/* Map and check the trace named by ASYNCINPUT_REPLAY. A torn last record,
+ * from a recording that was cut short, ends the replay early. */
+static int
+replay_open(bool realtime)
+{
+	const char *path = getenv("ASYNCINPUT_REPLAY");
+	if (!path || !path[0])
+		return -1;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(struct ni_trace_header)) {
+		close(fd);
+		return -1;
+	}
+	size_t size = (size_t)st.st_size;
+	void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	const struct ni_trace_header *h = p;
+	if (h->magic != NI_TRACE_MAGIC ||
+	    h->version != NI_TRACE_VERSION ||
+	    h->event_size != sizeof(struct ni_event) ||
+	    h->info_size != sizeof(struct ni_device_info)) {
+		munmap(p, size);
+		return -1;
+	}
+	madvise(p, size, MADV_SEQUENTIAL);
+	long long events = 0;
+	size_t off = sizeof(*h);
+	while (size - off >= sizeof(struct ni_trace_record)) {
+		const struct ni_trace_record *r =
+			(const void *)((const unsigned char *)p + off);
+		if (r->size < sizeof(*r) || r->size % 8 || r->size > size - off)
+			break;
+		size_t payload = r->size - sizeof(*r);
+		if (r->type == NI_TRACE_DEVICE &&
+		    payload < sizeof(struct ni_device_info))
+			break;
+		if (r->type == NI_TRACE_EVENTS) {
+			if (r->count > payload / sizeof(struct ni_event))
+				break;
+			events += r->count;
+		}
+		off += r->size;
+	}
+	g.replay_map = p;
+	g.replay_mapped = size;
+	g.replay_size = off;
+	g.replay_realtime = realtime;
+	atomic_store(&g.replay_left, events);
+	return 0;
+}
+
+static int
+worker_config_valid(const struct ni_worker_config *cfg)
+{
+	if (cfg->cpu_affinity < -1 || cfg->cpu_affinity >= CPU_SETSIZE)
+		return 0;
+	if (cfg->rt_priority < 0 ||
+	    cfg->rt_priority > sched_get_priority_max(SCHED_FIFO))
+		return 0;
+	if (cfg->nice_level < -20 || cfg->nice_level > 19)
+		return 0;
+	if (cfg->queue_capacity > RING_MAX_CAPACITY)
+		return 0;
+	if (cfg->overflow_policy < NI_OVERFLOW_DROP_NEWEST ||
+	    cfg->overflow_policy > NI_OVERFLOW_COALESCE_REL)
+		return 0;
+	if (cfg->clock < NI_CLOCK_MONOTONIC || cfg->clock > NI_CLOCK_REALTIME)
+		return 0;
+	if (cfg->spin_us < -1)
+		return 0;
+	if (cfg->workers < 0 || cfg->workers > MAX_SHARDS)
+		return 0;
+	if (cfg->shard_policy < NI_SHARD_BALANCED ||
+	    cfg->shard_policy > NI_SHARD_DEDICATED)
+		return 0;
+	if (cfg->dispatch_threads < 0 || cfg->dispatch_threads > MAX_DISPATCH)
+		return 0;
+	return 1;
+}
+
+/* Epoll set and queue of extra worker s, made before devices are opened. */
+static int
+shard_init(int s, bool compact)
+{
+	const struct ni_worker_config *cfg = &g.worker_cfg;
+	struct shard *sh = &g.shards[s];
+	sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (sh->epoll_fd < 0)
+		return -1;
+	/* every worker sees the shutdown wakeup */
+	struct epoll_event wev = {0};
+	wev.events = EPOLLIN;
+	wev.data.ptr = (void*)EPOLL_DATA_WAKE;
+	if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, g.wake_fd, &wev) != 0 ||
+	    ring_init(&sh->queue, cfg->queue_capacity, cfg->overflow_policy,
+		      compact) != 0 ||
+	    (g.stats && ring_stamps_init(&sh->queue) != 0)) {
+		ring_free(&sh->queue);
+		close(sh->epoll_fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Start n callback pool threads fed by every reader g.nshards implies. */
+static int
+pool_init(int n)
+{
+	for (; g.ndispatch < n; g.ndispatch++) {
+		struct dispatcher *d = &g.dispatch[g.ndispatch];
+		d->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (d->wake_fd < 0)
+			return -1;
+		for (d->nrings = 0; d->nrings < g.nshards; d->nrings++) {
+			if (ring_init(&d->rings[d->nrings],
+				      g.worker_cfg.queue_capacity,
+				      NI_OVERFLOW_DROP_NEWEST, false) != 0)
+				break;
+		}
+		if (d->nrings < g.nshards ||
+		    pthread_create(&d->thread, NULL, dispatcher_main, d) != 0) {
+			for (int r = 0; r < d->nrings; r++)
+				ring_free(&d->rings[r]);
+			close(d->wake_fd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* After the readers are gone: deliver what is queued, then stop. */
+static void
+pool_free(void)
+{
+	g.stop = 1;
+	for (int i = 0; i < g.ndispatch; i++) {
+		struct dispatcher *d = &g.dispatch[i];
+		uint64_t one = 1;
+		ssize_t w = write(d->wake_fd, &one, sizeof(one));
+		(void)w;
+		pthread_join(d->thread, NULL);
+		close(d->wake_fd);
+		for (int r = 0; r < d->nrings; r++)
+			ring_free(&d->rings[r]);
+	}
+	g.ndispatch = 0;
+}
+
+static void
+shards_free(void)
+{
+	for (int s = 1; s < g.nshards; s++) {
+		close(g.shards[s].epoll_fd);
+		ring_free(&g.shards[s].queue);
+	}
+	g.nshards = 1;
+}
+
+/* Undo a partially completed ni_init */
+static void
+init_cleanup(void)
+{
+	for (int i = 0; i < g.ndevi; i++)
+		close(g.live[i]->fd);
+	devices_free();
+	if (g.mice_fd >= 0) close(g.mice_fd);
+	g.mice_fd = -1;
+	g.mice_reading = false;
+	if (g.inotify_fd >= 0) close(g.inotify_fd);
+	if (g.epoll_fd >= 0) close(g.epoll_fd);
+	if (g.timer_fd >= 0) close(g.timer_fd);
+	pool_free();
+	shards_free();
+	if (g.wake_fd >= 0) close(g.wake_fd);
+	if (g.event_fd >= 0) close(g.event_fd);
+	if (g.shm) munmap(g.shm, sizeof(*g.shm));
+	g.shm = NULL;
+	if (g.replay_map) munmap((void *)g.replay_map, g.replay_mapped);
+	g.replay_map = NULL;
+#ifdef ASYNCINPUT_HAVE_IO_URING
+	if (uring_active()) ni_uring_free(&g.uring);
+#endif
+	ring_free(&g.queue);
+	ring_free(&g.mice_queue);
+	keyring_free(&g.key_queue);
+	ring_free(&g.key_raw);
+}
+
+int
+ni_init_with_worker_config(int flags, const struct ni_worker_config *config)
+{
+	if (flags & ~(NI_INIT_FLAG_CLIENT | NI_INIT_FLAG_COMPACT |
+		      NI_INIT_FLAG_IO_URING | NI_INIT_FLAG_TOUCH |
+		      NI_INIT_FLAG_REPLAY | NI_INIT_FLAG_REPLAY_REALTIME |
+		      NI_INIT_FLAG_STATS))
+		return -1;
+	bool replay = (flags & NI_INIT_FLAG_REPLAY) != 0;
+	if ((replay && (flags & NI_INIT_FLAG_CLIENT)) ||
+	    (!replay && (flags & NI_INIT_FLAG_REPLAY_REALTIME)))
+		return -1;
+	if (g.initialized)
+		return 0;
+	struct ni_worker_config cfg;
+	if (config)
+		cfg = *config;
+	else
+		ni_worker_config_defaults(&cfg);
+	if (!worker_config_valid(&cfg))
+		return -1;
+	/* a dropped base marker would corrupt every later timestamp */
+	bool compact = (flags & NI_INIT_FLAG_COMPACT) != 0;
+	if (compact && cfg.overflow_policy == NI_OVERFLOW_DROP_OLDEST)
+		return -1;
+	/* the one setting that may be made before ni_init() */
+	int mice_enabled = g.mice_enabled;
+	memset(&g, 0, sizeof(g));
+	g.mice_enabled = mice_enabled;
+	g.worker_cfg = cfg;
+	g.clock_id = clock_from_ni(cfg.clock);
+	g.clock = cfg.clock;
+	/* in client mode asyncinput-worker -T decodes, traces hold the
+	 * decoded frames */
+	g.touch_decode = (flags & NI_INIT_FLAG_TOUCH) &&
+			 !(flags & (NI_INIT_FLAG_CLIENT | NI_INIT_FLAG_REPLAY));
+	pthread_mutex_init(&g.dev_lock, NULL);
+	pthread_mutex_init(&g.merge_lock, NULL);
+	pthread_mutex_init(&g.record_lock, NULL);
+	g.trace_fd = -1;
+	g.stats = (flags & NI_INIT_FLAG_STATS) != 0;
+	g.free_slot = -1;
+	g.nshards = 1;
+	g.epoll_fd = -1;
+	g.inotify_fd = -1;
+	g.timer_fd = -1;
+	g.wake_fd = -1;
+#ifdef ASYNCINPUT_HAVE_IO_URING
+	g.uring.fd = -1;
+#endif
+	g.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring_init(&g.queue, cfg.queue_capacity, cfg.overflow_policy,
+		      compact) != 0 ||
+	    ring_init(&g.mice_queue, cfg.queue_capacity, cfg.overflow_policy,
+		      compact) != 0 ||
+	    (g.stats && (ring_stamps_init(&g.queue) != 0 ||
+			 ring_stamps_init(&g.mice_queue) != 0)) ||
+	    keyring_init(&g.key_queue, cfg.queue_capacity) != 0 ||
+	    ring_init(&g.key_raw, cfg.queue_capacity, NI_OVERFLOW_DROP_NEWEST,
+		      false) != 0 ||
+	    g.event_fd < 0) {
+		init_cleanup();
+		return -1;
+	}
+	g.mice_fd = -1;
+	g.mice_buttons = -1;
+	g.mice_dev.fd = -1;
+	g.mice_dev.id = -2;
+	snprintf(g.mice_dev.path, sizeof(g.mice_dev.path), "/dev/input/mice");
+	g.mice_dev.info.id = -2;
+	snprintf(g.mice_dev.info.path, sizeof(g.mice_dev.info.path), "/dev/input/mice");
+	snprintf(g.mice_dev.info.name, sizeof(g.mice_dev.info.name), "PS/2 mice");
+#ifdef ASYNCINPUT_HAVE_XKBCOMMON
+	/* Default xkb names if not set */
+	if (!g.xkb_rules[0]) snprintf(g.xkb_rules, sizeof(g.xkb_rules), "evdev");
+	if (!g.xkb_model[0]) snprintf(g.xkb_model, sizeof(g.xkb_model), "pc105");
+	if (!g.xkb_layout[0]) snprintf(g.xkb_layout, sizeof(g.xkb_layout), "us");
+	/* xkb will be created on ni_enable_xkb(1) */
+#endif
+
+	if (flags & (NI_INIT_FLAG_CLIENT | NI_INIT_FLAG_REPLAY)) {
+		g.client_mode = 1;
+		int rc = replay ?
+			replay_open((flags & NI_INIT_FLAG_REPLAY_REALTIME) != 0) :
+			client_attach();
+		if (rc != 0 || pool_init(cfg.dispatch_threads) != 0) {
+			init_cleanup();
+			return -1;
+		}
+		if (thread_create_configured(&g.thread, replay ? replay_worker :
+					     client_worker, 0) != 0) {
+			init_cleanup();
+			return -1;
+		}
+		g.initialized = 1;
+		return 0;
+	}
+
+	g.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (g.epoll_fd < 0) {
+		init_cleanup();
+		return -1;
+	}
+	/* inotify for hotplug */
+	g.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g.inotify_fd >= 0) {
+		/* Also watch for IN_MOVED_TO because udev may create then rename nodes */
+		inotify_add_watch(g.inotify_fd, "/dev/input", IN_CREATE | IN_MOVED_TO | IN_DELETE);
+		struct epoll_event iev = {0};
+		iev.events = EPOLLIN;
+		iev.data.ptr = (void*)EPOLL_DATA_INOTIFY;  /* Use pointer for consistency */
+		epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, g.inotify_fd, &iev);
+	}
+	g.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (g.timer_fd >= 0) {
+		struct epoll_event tev = {0};
+		tev.events = EPOLLIN;
+		tev.data.ptr = (void*)EPOLL_DATA_TIMER;
+		epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, g.timer_fd, &tev);
+	}
+	/* the worker blocks in epoll_wait() without a timeout */
+	g.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event wev = {0};
+	wev.events = EPOLLIN;
+	wev.data.ptr = (void*)EPOLL_DATA_WAKE;
+	if (g.wake_fd < 0 ||
+	    epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, g.wake_fd, &wev) != 0) {
+		init_cleanup();
+		return -1;
+	}
+	void *(*loop)(void *) = worker;
+#ifdef ASYNCINPUT_HAVE_IO_URING
+	if (flags & NI_INIT_FLAG_IO_URING)
+		uring_setup();
+	if (uring_active())
+		loop = uring_worker;
+#endif
+	/* the io_uring engine keeps every device on its one ring */
+	int nshards = uring_active() || cfg.workers < 1 ? 1 : cfg.workers;
+	for (; g.nshards < nshards; g.nshards++) {
+		if (shard_init(g.nshards, compact) != 0) {
+			init_cleanup();
+			return -1;
+		}
+	}
+	if (pool_init(cfg.dispatch_threads) != 0) {
+		init_cleanup();
+		return -1;
+	}
+	scan_devices();
+	if (g.mice_enabled) {
+		pthread_mutex_lock(&g.dev_lock);
+		g.mice_reading = mice_start() == 0;
+		pthread_mutex_unlock(&g.dev_lock);
+		if (!g.mice_reading)
+			g.mice_enabled = 0; /* non-fatal */
+	}
+	g.stop = 0;
+
+	if (thread_create_configured(&g.thread, loop, 0) != 0) {
+		init_cleanup();
+		return -1;
+	}
+	for (int s = 1; s < g.nshards; s++) {
+		if (thread_create_configured(&g.shards[s].thread, worker, s) == 0)
+			continue;
+		g.stop = 1;
+		uint64_t one = 1;
+		ssize_t r = write(g.wake_fd, &one, sizeof(one));
+		(void)r;
+		pthread_join(g.thread, NULL);
+		while (--s > 0)
+			pthread_join(g.shards[s].thread, NULL);
+		init_cleanup();
+		return -1;
+	}
+
+	g.initialized = 1;
+	return 0;
+}
+
+long long
+ni_now_ns(void)
+{
+	return event_now_ns();
+}
+
+int
+ni_init(int flags)
+{
+	return ni_init_with_worker_config(flags, NULL);
+}
+
+int
+ni_set_device_filter(ni_device_filter filter, void *user_data)
+{
+	g.filter = filter;
+	g.filter_user = user_data;
+	if (!g.initialized) return 0;
+	if (g.client_mode) {
+		/* devices belong to the worker; only mask them locally */
+		pthread_mutex_lock(&g.dev_lock);
+		for (int i = 0; i < g.ndevi; i++) {
+			struct device *dev = g.live[i];
+			dev->filtered_out = g.filter &&
+					    !g.filter(&dev->info, g.filter_user);
+		}
+		pthread_mutex_unlock(&g.dev_lock);
+		return 0;
+	}
+	/* Rescan: close devices that no longer match; try to open new matching ones */
+	/* Close non-matching */
+	struct device *gone[MAX_DEVICES];
+	int ngone = 0;
+	pthread_mutex_lock(&g.dev_lock);
+	/* downwards: device_unlink() moves the last entry into i */
+	for (int i = g.ndevi - 1; i >= 0; i--) {
+		struct device *dev = g.live[i];
+		const struct ni_device_info *info = &dev->info;
+		int keep = (g.filter ? g.filter(info, g.filter_user) : 1);
+		if (!keep) {
+			int id = dev->id;
+			if (id >= 0 && id < MAX_DEVICES) {
+				if (!g.rejected[id])
+					g.rejected[id] = malloc(sizeof(*info));
+				if (g.rejected[id])
+					*g.rejected[id] = *info;
+			}
+			device_remove(dev);
+			gone[ngone++] = dev;
+		} else if ((keep & NI_FILTER_GRAB) && !dev->grabbed) {
+			/* the flag only ever grabs, ni_grab_device() releases */
+			dev->grabbed = device_grab_fd(dev->fd, true) == 0;
+		}
+	}
+	pthread_mutex_unlock(&g.dev_lock);
+	for (int i = 0; i < ngone; i++)
+		device_release(gone[i]);
+	uring_kick();
+	/* Try open any new devices that match */
+	scan_devices();
+	return 0;
+}
+
+int
+ni_device_count(void)
+{
+	int n;
+	if (g.client_mode && g.shm)
+		return atomic_load(&g.shm->device_count);
+	pthread_mutex_lock(&g.dev_lock);
+	n = g.ndevi;
+	pthread_mutex_unlock(&g.dev_lock);
+	return n;
+}
+
+int
+ni_grab_device(int device_id, int enable)
+{
+	if (!g.initialized || g.client_mode)
+		return -1;
+	bool found = false, ok = true;
+	pthread_mutex_lock(&g.dev_lock);
+	for (int i = 0; i < g.ndevi; i++) {
+		struct device *dev = g.live[i];
+		if (device_id != -1 && dev->id != device_id)
+			continue;
+		found = true;
+		/* EVIOCGRAB 0 on a device we do not hold fails with EINVAL */
+		if (dev->grabbed == (enable != 0))
+			continue;
+		if (device_grab_fd(dev->fd, enable != 0) == 0)
+			dev->grabbed = enable != 0;
+		else
+			ok = false;
+	}
+	pthread_mutex_unlock(&g.dev_lock);
+	return (found || device_id == -1) && ok ? 0 : -1;
+}
+
+int
+ni_set_event_mask(int device_id, int type, const unsigned char *codes,
+		  int nbits)
+{
+	if (!g.initialized || type < 0 || type >= EV_CNT ||
+	    !mask_code_cnt[type] || nbits < 0)
+		return -1;
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = NULL;
+	const struct event_mask *base = g.mask_default;
+	if (device_id == g.mice_dev.id) {
+		dev = &g.mice_dev;
+	} else if (device_id != -1) {
+		dev = device_find(device_id);
+		if (!dev) {
+			pthread_mutex_unlock(&g.dev_lock);
+			return -1;
+		}
+	}
+	if (dev)
+		base = atomic_load_explicit(&dev->mask, memory_order_relaxed);
+	struct event_mask *m = malloc(sizeof(*m));
+	if (!m) {
+		pthread_mutex_unlock(&g.dev_lock);
+		return -1;
+	}
+	if (base)
+		*m = *base;
+	else
+		memset(m, 0, sizeof(*m));
+	m->next = g.masks;
+	g.masks = m;
+	m->set[type] = codes != NULL;
+	memset(m->bits[type], 0, sizeof(m->bits[type]));
+	int cnt = nbits < mask_code_cnt[type] ? nbits : mask_code_cnt[type];
+	for (int c = 0; codes && c < cnt; c++) {
+		if (ni_bit_test(codes, c))
+			m->bits[type][c / 8] |= (unsigned char)(1u << (c % 8));
+	}
+	if (dev) {
+		mask_attach(dev, m);
+	} else {
+		g.mask_default = m;
+		for (int i = 0; i < g.ndevi; i++)
+			mask_attach(g.live[i], m);
+		mask_attach(&g.mice_dev, m);
+	}
+	pthread_mutex_unlock(&g.dev_lock);
+	return 0;
+}
+
+int
+ni_get_device_info(int device_id, struct ni_device_info *out)
+{
+	if (!g.initialized || !out)
+		return -1;
+	if (g.shm)
+		return ni_shm_get_device_info(g.shm, device_id, out);
+	if (device_id == g.mice_dev.id) {
+		if (!g.mice_reading)
+			return -1;
+		*out = g.mice_dev.info;
+		return 0;
+	}
+	pthread_mutex_lock(&g.dev_lock);
+	struct device *dev = device_find(device_id);
+	if (dev)
+		*out = dev->info;
+	pthread_mutex_unlock(&g.dev_lock);
+	return dev ? 0 : -1;
+}
+
+int
+ni_get_device_state(int device_id, struct ni_device_state *out)
+{
+	if (!g.initialized || !out)
+		return -1;
+	/* lock-free, so only indexed ids; others would scan g.live */
+	struct device *dev = device_id == g.mice_dev.id ? &g.mice_dev :
+			     device_id >= 0 && device_id < MAX_DEVICES ?
+			     device_find(device_id) : NULL;
+	if (!dev)
+		return -1;
+	struct device_state *st = &dev->state;
+	for (;;) {
+		uint32_t s1 = atomic_load_explicit(&st->seq, memory_order_acquire);
+		if (s1 & 1)
+			continue;
+		bool open = atomic_load_explicit(&st->open, memory_order_relaxed);
+		*out = st->s;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&st->seq, memory_order_relaxed) == s1)
+			return open && out->device_id == device_id ? 0 : -1;
+	}
+}
+
+int
+ni_get_touch_state(int device_id, struct ni_touch_state *out)
+{
+	if (!g.initialized || !out)
 		return -1;
-	if (g.filter) {
-		struct ni_device_info info = {0};
-		info.id = devid;
-		(void)fill_device_info(fd, path, &info);
-		if (!g.filter(&info, g.filter_user)) {
-			close(fd);
-			return -1;
-		}
+	struct device *dev = device_id >= 0 && device_id < MAX_DEVICES ?
+			     device_find(device_id) : NULL;
+	if (!dev)
+		return -1;
+	struct touch_state *t = &dev->mt;
+	for (;;) {
+		uint32_t s1 = atomic_load_explicit(&t->seq, memory_order_acquire);
+		if (s1 & 1)
+			continue;
+		bool open = atomic_load_explicit(&t->open, memory_order_relaxed);
+		*out = t->s;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&t->seq, memory_order_relaxed) == s1)
+			return open && out->device_id == device_id ? 0 : -1;
 	}
-	if (out_devid) *out_devid = devid;
-	return fd;
 }
 
-static int has_device_id(int id) {
-	for (int i = 0; i < g.ndevi; i++) if (g.devices[i].id == id) return 1;
+int
+ni_register_callback(ni_callback cb, void *user_data, int flags)
+{
+	if (!g.initialized || flags != 0)
+		return -1;
+	g.cb = cb;
+	g.cb_user = user_data;
 	return 0;
 }
 
-static void add_device_fd(int fd, int devid, const char *path)
+int
+ni_register_device_callback(int device_id,
+			    ni_device_callback cb,
+			    void *user_data,
+			    int flags)
 {
+	if (!g.initialized || !cb)
+		return -1;
+	/* frame batches are delivered through ni_register_batch_callback() */
+	if (flags & ~(NI_CB_FLAG_EXCLUSIVE | NI_CB_FLAG_HIGH_PRIORITY))
+		return -1;
+
 	pthread_mutex_lock(&g.dev_lock);
-	struct device *dev = &g.devices[g.ndevi];
-	dev->fd = fd;
-	dev->id = devid;
-	strncpy(dev->path, path ? path : "", sizeof(dev->path)-1);
-	g.ndevi++;
+	struct device_callback **tail = &g.dev_callbacks;
+	for (; *tail; tail = &(*tail)->next) {
+		if ((flags & NI_CB_FLAG_EXCLUSIVE) &&
+		    ((*tail)->flags & NI_CB_FLAG_EXCLUSIVE) &&
+		    (*tail)->device_id == device_id) {
+			pthread_mutex_unlock(&g.dev_lock);
+			return -1;
+		}
+	}
+	struct device_callback *c = calloc(1, sizeof(*c));
+	if (!c) {
+		pthread_mutex_unlock(&g.dev_lock);
+		return -1;
+	}
+	c->id = ++g.next_cb_id;
+	c->device_id = device_id;
+	c->callback = cb;
+	c->user_data = user_data;
+	c->flags = flags;
+	*tail = c;
+	cb_tables_refresh(device_id);
+	int id = c->id;
 	pthread_mutex_unlock(&g.dev_lock);
-	
-	/* Use device pointer directly in epoll to eliminate lookup */
-	struct epoll_event ev = {0};
-	ev.events = EPOLLIN;
-	ev.data.ptr = dev;  /* Direct pointer instead of device_id */
-	epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	return id;
 }
 
-static void remove_device_by_id(int devid)
+int
+ni_unregister_device_callback(int callback_id)
 {
+	if (!g.initialized)
+		return -1;
 	pthread_mutex_lock(&g.dev_lock);
-	for (int i = 0; i < g.ndevi; i++) {
-		if (g.devices[i].id == devid) {
-			epoll_ctl(g.epoll_fd, EPOLL_CTL_DEL, g.devices[i].fd, NULL);
-			close(g.devices[i].fd);
-			/* compact array */
-			g.devices[i] = g.devices[g.ndevi-1];
-			g.ndevi--;
-			break;
-		}
+	for (struct device_callback **pc = &g.dev_callbacks; *pc; pc = &(*pc)->next) {
+		struct device_callback *c = *pc;
+		if (c->id != callback_id)
+			continue;
+		*pc = c->next;
+		cb_tables_refresh(c->device_id);
+		free(c);
+		pthread_mutex_unlock(&g.dev_lock);
+		return 0;
 	}
 	pthread_mutex_unlock(&g.dev_lock);
+	return -1;
 }
 
-static void scan_devices(void)
+int
+ni_register_batch_callback(ni_batch_callback cb, void *user_data, int flags)
 {
-	char path[64];
-	for (int i = 0; i < MAX_DEVICES; i++) {
-		snprintf(path, sizeof(path), "/dev/input/event%d", i);
-		if (has_device_id(i)) continue;
-		int devid = -1;
-		int fd = open_device_filtered(path, &devid);
-		if (fd < 0) continue;
-		add_device_fd(fd, devid >= 0 ? devid : i, path);
-	}
+	if (!g.initialized || flags != 0)
+		return -1;
+	g.batch_cb = cb;
+	g.batch_cb_user = user_data;
+	return 0;
 }
 
-static int
-fd_to_device_id(int fd)
+int
+ni_set_coalescing(int flags)
 {
-	for (int i = 0; i < g.ndevi; i++) {
-		if (g.devices[i].fd == fd)
-			return g.devices[i].id;
-	}
-	return -1;
+	if (!g.initialized || (flags & ~(NI_COALESCE_BUTTONS | NI_COALESCE_REL)))
+		return -1;
+	g.coalesce = flags;
+	return 0;
 }
 
-#include <sys/inotify.h>
-
-#define EPOLL_DATA_INOTIFY 0xFFFFFFFFu
+/* Stage the next events of poll_queue(s) for the merge, under merge_lock. */
+static void
+merge_refill(int s)
+{
+	struct merge_source *m = &g.merge[s];
+	struct ringbuf *q = poll_queue(s);
+	m->pos = 0;
+	m->len = ring_pop_many(q, m->ev, MERGE_LOOKAHEAD);
+	if (m->len < MERGE_LOOKAHEAD)
+		m->len += ring_take_pending(q, m->ev + m->len,
+					    MERGE_LOOKAHEAD - m->len);
+}
 
-static void handle_inotify_event(void)
+/*
+ * ni_poll() over several workers: a k-way merge on timestamp_ns of the
+ * heads of every queue. Each queue is in read order already, so staging a
+ * few events per queue is enough; a source is refilled as soon as it runs
+ * dry so the next pick still sees its head. Staged events survive until
+ * the next call.
+ */
+static int
+poll_merged(struct ni_event *evts, int max_events)
 {
-	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
-	ssize_t len;
-	for (;;) {
-		len = read(g.inotify_fd, buf, sizeof(buf));
-		if (len <= 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-			break;
-		}
-		ssize_t off = 0;
-		while (off < len) {
-			struct inotify_event *ie = (struct inotify_event*)(buf + off);
-			if (((ie->mask & IN_CREATE) || (ie->mask & IN_MOVED_TO)) && ie->len > 0) {
-				if (strncmp(ie->name, "event", 5) == 0) {
-					char path[128];
-					snprintf(path, sizeof(path), "/dev/input/%s", ie->name);
-					int devid = -1; int fd = open_device_filtered(path, &devid);
-					if (fd >= 0) {
-						add_device_fd(fd, devid, path);
-					} else {
-						/* schedule rescans for a short time to tolerate udev races */
-						long long t = now_ns();
-						g.rescan_until_ns = t + 3000000000LL; /* 3s */
-					}
-				}
-			}
-			if ((ie->mask & IN_DELETE) && ie->len > 0) {
-				if (strncmp(ie->name, "event", 5) == 0) {
-					int devid = atoi(ie->name + 5);
-					remove_device_by_id(devid);
-				}
+	pthread_mutex_lock(&g.merge_lock);
+	int nsrc = g.nshards + 1;
+	for (int s = 0; s < nsrc; s++) {
+		if (g.merge[s].pos == g.merge[s].len)
+			merge_refill(s);
+	}
+	int n = 0;
+	while (n < max_events) {
+		int best = -1;
+		long long best_ts = 0;
+		for (int s = 0; s < nsrc; s++) {
+			const struct merge_source *m = &g.merge[s];
+			if (m->pos == m->len)
+				continue;
+			long long ts = m->ev[m->pos].timestamp_ns;
+			if (best < 0 || ts < best_ts) {
+				best = s;
+				best_ts = ts;
 			}
-			off += sizeof(struct inotify_event) + ie->len;
 		}
+		if (best < 0)
+			break;
+		struct merge_source *m = &g.merge[best];
+		evts[n++] = m->ev[m->pos++];
+		if (m->pos == m->len)
+			merge_refill(best);
 	}
+	int staged = 0;
+	for (int s = 0; s < nsrc; s++)
+		staged += g.merge[s].len - g.merge[s].pos;
+	atomic_store(&g.merge_staged, staged);
+	pthread_mutex_unlock(&g.merge_lock);
+	if (n < max_events)
+		queue_rearm();
+	return n;
 }
 
-static inline uint32_t mods_mask_from_state(void)
+int
+ni_poll(struct ni_event *evts, int max_events)
 {
-	uint32_t m = 0;
-#ifdef ASYNCINPUT_HAVE_XKBCOMMON
-	if (g.xkb_state) {
-		if (xkb_state_mod_name_is_active(g.xkb_state, XKB_MOD_NAME_SHIFT, XKB_STATE_MODS_EFFECTIVE)) m |= 1u << 0;
-		if (xkb_state_mod_name_is_active(g.xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_EFFECTIVE)) m |= 1u << 1;
-		if (xkb_state_mod_name_is_active(g.xkb_state, XKB_MOD_NAME_ALT, XKB_STATE_MODS_EFFECTIVE)) m |= 1u << 2;
-		if (xkb_state_mod_name_is_active(g.xkb_state, XKB_MOD_NAME_LOGO, XKB_STATE_MODS_EFFECTIVE)) m |= 1u << 3;
-	}
-#endif
-	return m;
+	if (!g.initialized || !evts || max_events <= 0)
+		return -1;
+	if (g.nshards > 1)
+		return poll_merged(evts, max_events);
+	int n = ring_pop_many(&g.queue, evts, max_events);
+	if (n < max_events)
+		n += ring_take_pending(&g.queue, evts + n, max_events - n);
+	if (n < max_events)
+		n += ring_pop_many(&g.mice_queue, evts + n, max_events - n);
+	if (n < max_events)
+		n += ring_take_pending(&g.mice_queue, evts + n, max_events - n);
+	if (n < max_events)
+		queue_rearm();
+	return n;
 }
 
-static inline void maybe_emit_key_event(const struct ni_event *base)
+int
+ni_poll_compact(struct ni_event_compact *evts, int max_events, int64_t *base_ns)
 {
-	if (!g.xkb_enabled) return;
-#ifdef ASYNCINPUT_HAVE_XKBCOMMON
-	if (base->type != NI_EV_KEY) return;
-	/* Evdev to XKB keycode conversion */
-	uint32_t xkb_code = (uint32_t)base->code + 8u;
-	if (g.xkb_state) {
-		xkb_state_update_key(g.xkb_state, xkb_code, base->value ? XKB_KEY_DOWN : XKB_KEY_UP);
-		struct ni_key_event kev = {0};
-		kev.device_id = base->device_id;
-		kev.timestamp_ns = base->timestamp_ns;
-		kev.down = base->value ? 1 : 0;
-		kev.mods = mods_mask_from_state();
-		/* Keysym for this key */
-		xkb_keysym_t sym = xkb_state_key_get_one_sym(g.xkb_state, xkb_code);
-		kev.keysym = (uint32_t)sym;
-		kev.text[0] = '\0';
-		if (kev.down) {
-			/* Get UTF-8 text (if any) */
-			int n = xkb_state_key_get_utf8(g.xkb_state, xkb_code, kev.text, (int)sizeof(kev.text));
-			(void)n; /* n  0 on error; zero means no text */
-		}
-if (g.key_cb) g.key_cb(&kev, g.key_cb_user); else keyring_push(&g.key_queue, &kev);
+	if (!g.initialized || !g.queue.cev || !evts || max_events <= 0 || !base_ns)
+		return -1;
+	long long base = 0;
+	int n = 0;
+	for (int s = 0; s <= g.nshards && n < max_events; s++) {
+		struct ringbuf *q = poll_queue(s);
+		n += ring_pop_compact(q, NULL, evts + n, max_events - n, &base);
+		if (n < max_events)
+			n += ring_take_pending_compact(q, evts + n,
+						       max_events - n, &base);
 	}
-#else
-	(void)base;
-#endif
+	if (n < max_events)
+		queue_rearm(); /* re-signals if a batch window cut us short */
+	*base_ns = base;
+	return n;
 }
 
-static void *
-worker(void *arg)
+int
+ni_poll_acquire(struct ni_event_batch *batch, int max_events)
 {
-	(void)arg;
-	struct epoll_event evs[MAX_EPOLL_EVENTS];
-	struct input_event iev;
-
-	while (!g.stop) {
-		/* Opportunistically rescan while within rescan window (e.g., after IN_CREATE/MOVED_TO) */
-		long long tnow = now_ns();
-		if (g.rescan_until_ns && tnow < g.rescan_until_ns) {
-			scan_devices();
-		}
-		int n = epoll_wait(g.epoll_fd, evs, MAX_EPOLL_EVENTS, 50);
-		if (n <= 0)
-			continue;
-		for (int i = 0; i < n; i++) {
-			/* Check for inotify events using special pointer value */
-			if (evs[i].data.ptr == (void*)EPOLL_DATA_INOTIFY) {
-				handle_inotify_event();
-				continue;
-			}
-			/* Direct device pointer from epoll - no lookup needed! */
-			struct device *dev = (struct device*)evs[i].data.ptr;
-			if (!dev)
-				continue;
-			int fd = dev->fd;
-			int devid = dev->id;
-			for (;;) {
-				ssize_t r = read(fd, &iev, sizeof(iev));
-				if (r < 0) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK)
-						break;
-					/* device error, ignore for now */
-					break;
-				}
-				if (r != (ssize_t)sizeof(iev))
-					break;
-
-				struct ni_event ev = {0};
-				ev.device_id = devid;
-				ev.type = iev.type;
-				ev.code = iev.code;
-				ev.value = iev.value;
-				/* Use kernel event timestamp (input_event.time) for latency calculations */
-				ev.timestamp_ns = (long long)iev.time.tv_sec * 1000000000LL + (long long)iev.time.tv_usec * 1000LL;
-
-				if (g.cb)
-					g.cb(&ev, g.cb_user);
-				else
-					ring_push(&g.queue, &ev);
-				/* Generate high-level key events if xkb is enabled */
-				maybe_emit_key_event(&ev);
-			}
-		}
-	}
-	return NULL;
+	if (!g.initialized || !batch || max_events <= 0 || g.queue.cev ||
+	    g.worker_cfg.overflow_policy == NI_OVERFLOW_DROP_OLDEST)
+		return -1;
+	memset(batch, 0, sizeof(*batch));
+	int n = 0;
+	for (int s = 0; s <= g.nshards && n == 0; s++)
+		n = ring_acquire(poll_queue(s), batch, max_events);
+	if (n < 0)
+		memset(batch, 0, sizeof(*batch));
+	if (!n)
+		queue_rearm();
+	return n;
 }
 
 int
-ni_init(int flags)
+ni_poll_release(struct ni_event_batch *batch)
 {
-	if (flags != 0)
+	if (!batch)
 		return -1;
-	if (g.initialized)
+	if (!batch->total)
 		return 0;
-	memset(&g, 0, sizeof(g));
-	ring_init(&g.queue);
-	keyring_init(&g.key_queue);
-	pthread_mutex_init(&g.dev_lock, NULL);
-	g.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-	g.mice_fd = -1;
-	if (g.epoll_fd < 0)
+	struct ringbuf *r = batch->reserved;
+	int s = 0;
+	while (s <= g.nshards && poll_queue(s) != r)
+		s++;
+	if (s > g.nshards || ring_release(r, batch) != 0)
 		return -1;
-	/* inotify for hotplug */
-	g.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
-	if (g.inotify_fd >= 0) {
-		/* Also watch for IN_MOVED_TO because udev may create then rename nodes */
-		inotify_add_watch(g.inotify_fd, "/dev/input", IN_CREATE | IN_MOVED_TO | IN_DELETE);
-		struct epoll_event iev = {0};
-		iev.events = EPOLLIN;
-		iev.data.ptr = (void*)EPOLL_DATA_INOTIFY;  /* Use pointer for consistency */
-		epoll_ctl(g.epoll_fd, EPOLL_CTL_ADD, g.inotify_fd, &iev);
+	memset(batch, 0, sizeof(*batch));
+	queue_rearm(); /* re-signals if more is queued */
+	return 0;
+}
+
+uint64_t
+ni_dropped_events(void)
+{
+	if (!g.initialized)
+		return 0;
+	uint64_t n = atomic_load(&g.queue.dropped) +
+		     atomic_load(&g.mice_queue.dropped) +
+		     atomic_load(&g.key_queue.dropped) +
+		     atomic_load(&g.key_raw.dropped);
+	for (int s = 1; s < g.nshards; s++)
+		n += atomic_load(&g.shards[s].queue.dropped);
+	for (int i = 0; i < g.ndispatch; i++) {
+		for (int r = 0; r < g.dispatch[i].nrings; r++)
+			n += atomic_load(&g.dispatch[i].rings[r].dropped);
 	}
-	scan_devices();
-	g.stop = 0;
-#ifdef ASYNCINPUT_HAVE_XKBCOMMON
-	/* Default xkb names if not set */
-	if (!g.xkb_rules[0]) snprintf(g.xkb_rules, sizeof(g.xkb_rules), "evdev");
-	if (!g.xkb_model[0]) snprintf(g.xkb_model, sizeof(g.xkb_model), "pc105");
-	if (!g.xkb_layout[0]) snprintf(g.xkb_layout, sizeof(g.xkb_layout), "us");
-	/* xkb will be created on ni_enable_xkb(1) */
+	return n;
+}
 
-	if (pthread_create(&g.thread, NULL, worker, NULL) != 0)
+int
+ni_wait_events(int64_t timeout_ns)
+{
+	if (!g.initialized)
 		return -1;
-
-	if (g.mice_enabled) {
-		if (pthread_create(&g.mice_thread, NULL, mice_worker, NULL) != 0) {
-			g.mice_enabled = 0; /* non-fatal */
+	long long deadline = timeout_ns > 0 ? now_ns() + timeout_ns : 0;
+	for (;;) {
+		if (!queues_empty())
+			return 1;
+		queue_rearm();
+		if (!queues_empty())
+			return 1;
+		if (timeout_ns == 0 || g.stop)
+			return 0;
+		struct timespec ts, *tsp = NULL;
+		if (timeout_ns > 0) {
+			long long left = deadline - now_ns();
+			if (left <= 0)
+				return 0;
+			ts.tv_sec = left / 1000000000LL;
+			ts.tv_nsec = left % 1000000000LL;
+			tsp = &ts;
 		}
+		struct pollfd pfd = { .fd = g.event_fd, .events = POLLIN };
+		if (ppoll(&pfd, 1, tsp, NULL) < 0 && errno != EINTR)
+			return -1;
 	}
+}
 
-	g.initialized = 1;
-	return 0;
-#else
-	(void)flags; return -1; /* Non-Linux: this TU is inactive */
-#endif
+int
+ni_get_event_fd(void)
+{
+	return g.initialized ? g.event_fd : -1;
+}
+
+void *
+ni_get_event_handle(void)
+{
+	return NULL;
 }
 
 int
-ni_set_device_filter(ni_device_filter filter, void *user_data)
+ni_get_stats(struct ni_stats *out)
 {
-	g.filter = filter;
-	g.filter_user = user_data;
-	if (!g.initialized) return 0;
-	/* Rescan: close devices that no longer match; try to open new matching ones */
-	/* Close non-matching */
-	pthread_mutex_lock(&g.dev_lock);
-	for (int i = g.ndevi - 1; i >= 0; i--) {
-		int fd = g.devices[i].fd;
-		struct ni_device_info info = {0};
-		fill_device_info(fd, g.devices[i].path, &info);
-		info.id = g.devices[i].id;
-		int keep = (g.filter ? g.filter(&info, g.filter_user) : 1);
-		if (!keep) {
-			epoll_ctl(g.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-			close(fd);
-			g.devices[i] = g.devices[g.ndevi-1];
-			g.ndevi--;
-		}
+	if (!g.initialized || !g.stats || !out)
+		return -1;
+	memset(out, 0, sizeof(*out));
+	for (int s = 0; s < g.nshards; s++) {
+		struct shard *sh = &g.shards[s];
+		out->wakeups += atomic_load_explicit(&sh->wakeups,
+						     memory_order_relaxed);
+		out->reads += atomic_load_explicit(&sh->reads,
+						   memory_order_relaxed);
+		out->events_read += atomic_load_explicit(&sh->events,
+							 memory_order_relaxed);
+		hist_sum(&out->kernel_to_enqueue, &sh->kernel_hist);
 	}
-	pthread_mutex_unlock(&g.dev_lock);
-	/* Try open any new devices that match */
-	scan_devices();
+	for (int s = 0; s <= g.nshards; s++) {
+		struct ringbuf *r = poll_queue(s);
+		uint32_t high = atomic_load_explicit(&r->high_water,
+						     memory_order_relaxed);
+		if (high > out->queue_high_water)
+			out->queue_high_water = high;
+		hist_sum(&out->enqueue_to_dequeue, &r->wait);
+	}
+	out->events_dropped = ni_dropped_events();
+	out->queue_capacity = g.queue.size;
 	return 0;
 }
 
 int
-ni_device_count(void)
+ni_get_device_stats(int device_id, struct ni_device_stats *out)
 {
-	int n;
+	if (!g.initialized || !g.stats || !out)
+		return -1;
 	pthread_mutex_lock(&g.dev_lock);
-	n = g.ndevi;
+	struct device *dev = device_id == g.mice_dev.id ? &g.mice_dev :
+			     device_find(device_id);
+	if (dev) {
+		out->events_read = atomic_load_explicit(&dev->event_count,
+							memory_order_relaxed);
+		out->events_dropped = atomic_load_explicit(&dev->drop_count,
+							   memory_order_relaxed);
+	}
 	pthread_mutex_unlock(&g.dev_lock);
-	return n;
+	return dev ? 0 : -1;
 }
 
 int
-ni_register_callback(ni_callback cb, void *user_data, int flags)
+ni_record_start(const char *path)
 {
-	if (!g.initialized || flags != 0)
+	if (!g.initialized || !path)
 		return -1;
-	g.cb = cb;
-	g.cb_user = user_data;
+	pthread_mutex_lock(&g.record_lock);
+	if (g.trace_fd >= 0) {
+		pthread_mutex_unlock(&g.record_lock);
+		return -1;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	struct ni_trace_header h = {0};
+	h.magic = NI_TRACE_MAGIC;
+	h.version = NI_TRACE_VERSION;
+	h.event_size = sizeof(struct ni_event);
+	h.info_size = sizeof(struct ni_device_info);
+	h.clock = g.clock;
+	h.start_ns = event_now_ns();
+	bool ok = fd >= 0 && write_all(fd, &h, sizeof(h));
+	for (int s = 0; ok && s < g.nshards; s++) {
+		struct trace_ring *t = &g.trace[s];
+		t->buf = malloc(TRACE_RING_SIZE);
+		atomic_store(&t->head, 0);
+		atomic_store(&t->tail, 0);
+		t->dropped = 0;
+		ok = t->buf != NULL;
+	}
+	g.trace_fd = fd;
+	g.trace_failed = false;
+	atomic_store(&g.trace_stop, false);
+	ok = ok && pthread_create(&g.trace_thread, NULL, trace_writer, NULL) == 0;
+	if (!ok) {
+		for (int s = 0; s < g.nshards; s++) {
+			free(g.trace[s].buf);
+			g.trace[s].buf = NULL;
+		}
+		if (fd >= 0)
+			close(fd);
+		g.trace_fd = -1;
+		pthread_mutex_unlock(&g.record_lock);
+		return -1;
+	}
+	/* devices seen in an earlier recording are described again */
+	g.trace_epoch++;
+	atomic_store(&g.recording, true);
+	pthread_mutex_unlock(&g.record_lock);
 	return 0;
 }
 
-int
-ni_poll(struct ni_event *evts, int max_events)
+long long
+ni_record_stop(void)
 {
-	if (!g.initialized || !evts || max_events <= 0)
+	if (!g.initialized)
+		return -1;
+	pthread_mutex_lock(&g.record_lock);
+	if (g.trace_fd < 0) {
+		pthread_mutex_unlock(&g.record_lock);
+		return -1;
+	}
+	atomic_store(&g.recording, false);
+	/* appends that still saw recording set finish before the writer's
+	 * last pass; readers never block while busy */
+	long long dropped = 0;
+	for (int s = 0; s < g.nshards; s++) {
+		while (atomic_load(&g.trace[s].busy))
+			sched_yield();
+		dropped += g.trace[s].dropped;
+	}
+	atomic_store(&g.trace_stop, true);
+	pthread_join(g.trace_thread, NULL);
+	bool failed = g.trace_failed;
+	if (close(g.trace_fd) != 0)
+		failed = true;
+	g.trace_fd = -1;
+	for (int s = 0; s < g.nshards; s++) {
+		free(g.trace[s].buf);
+		g.trace[s].buf = NULL;
+	}
+	pthread_mutex_unlock(&g.record_lock);
+	return failed ? -1 : dropped;
+}
+
+long long
+ni_replay_pending(void)
+{
+	if (!g.initialized || !g.replay_map)
 		return -1;
-	return ring_pop_many(&g.queue, evts, max_events);
+	return atomic_load(&g.replay_left);
 }
 
 int
@@ -574,14 +4823,69 @@ ni_shutdown(void)
 {
 	if (!g.initialized)
 		return 0;
+	ni_record_stop();
 	g.stop = 1;
 	g.mice_enabled = 0;
-	if (g.mice_thread) pthread_join(g.mice_thread, NULL);
+	queue_signal(); /* release ni_wait_events() callers */
+	if (g.shm) {
+		ni_shm_notify(g.shm, 1); /* kick client_worker out of its wait */
+	} else if (g.wake_fd >= 0) {
+		uint64_t one = 1;
+		ssize_t r = write(g.wake_fd, &one, sizeof(one));
+		(void)r;
+	}
 	pthread_join(g.thread, NULL);
-	for (int i = 0; i < g.ndevi; i++)
-		close(g.devices[i].fd);
+	for (int s = 1; s < g.nshards; s++)
+		pthread_join(g.shards[s].thread, NULL);
+	pool_free();
+	if (g.mice_fd >= 0) close(g.mice_fd);
+	g.mice_fd = -1;
+	g.mice_reading = false;
+	for (int s = 0; s < g.nshards; s++)
+		shard_reap(&g.shards[s]);
+	for (int i = 0; i < g.ndevi; i++) {
+		if (g.live[i]->fd >= 0)
+			close(g.live[i]->fd);
+		cb_table_retire(atomic_load(&g.live[i]->callbacks));
+	}
+	devices_free();
+	cb_table_retire(atomic_load(&g.mice_dev.callbacks));
+	while (g.cb_retired) {
+		struct device_cb_table *t = g.cb_retired;
+		g.cb_retired = t->retired_next;
+		free(t);
+	}
+	while (g.masks) {
+		struct event_mask *m = g.masks;
+		g.masks = m->next;
+		free(m);
+	}
+	while (g.dev_callbacks) {
+		struct device_callback *c = g.dev_callbacks;
+		g.dev_callbacks = c->next;
+		free(c);
+	}
 	if (g.inotify_fd >= 0) close(g.inotify_fd);
-	close(g.epoll_fd);
+	if (g.epoll_fd >= 0) close(g.epoll_fd);
+	if (g.timer_fd >= 0) close(g.timer_fd);
+	shards_free();
+	if (g.wake_fd >= 0) close(g.wake_fd);
+#ifdef ASYNCINPUT_HAVE_IO_URING
+	if (uring_active()) ni_uring_free(&g.uring);
+#endif
+	close(g.event_fd);
+	if (g.shm) {
+		munmap(g.shm, sizeof(*g.shm));
+		g.shm = NULL;
+	}
+	if (g.replay_map) {
+		munmap((void *)g.replay_map, g.replay_mapped);
+		g.replay_map = NULL;
+	}
+	ring_free(&g.queue);
+	ring_free(&g.mice_queue);
+	keyring_free(&g.key_queue);
+	ring_free(&g.key_raw);
 	g.initialized = 0;
 	return 0;
 }
@@ -598,7 +4902,14 @@ int ni_register_key_callback(ni_key_callback cb, void *user_data, int flags)
 int ni_poll_key_events(struct ni_key_event *evts, int max_events)
 {
 	if (!g.initialized || !evts || max_events <= 0) return -1;
-	return keyring_pop_many(&g.key_queue, evts, max_events);
+	/* eager events first, queued before a switch to NI_XKB_LAZY */
+	int n = keyring_pop_many(&g.key_queue, evts, max_events);
+	if (n < max_events && !queue_empty(&g.key_raw)) {
+		pthread_mutex_lock(&xkb_lock);
+		n += key_raw_translate(evts + n, max_events - n);
+		pthread_mutex_unlock(&xkb_lock);
+	}
+	return n;
 }
 
 static int rebuild_xkb_keymap(void)
@@ -617,10 +4928,17 @@ static int rebuild_xkb_keymap(void)
 	if (!km) return -1;
 	struct xkb_state *st = xkb_state_new(km);
 	if (!st) { xkb_keymap_unref(km); return -1; }
-	if (g.xkb_state) xkb_state_unref(g.xkb_state);
-	if (g.xkb_keymap) xkb_keymap_unref(g.xkb_keymap);
+	/* compiled unlocked, swapped under the translators' lock */
+	pthread_mutex_lock(&xkb_lock);
+	xkb_mods_resolve(km);
+	memset(g.xkb_cache, 0, sizeof(g.xkb_cache));
+	struct xkb_state *old_state = g.xkb_state;
+	struct xkb_keymap *old_keymap = g.xkb_keymap;
 	g.xkb_keymap = km;
 	g.xkb_state = st;
+	pthread_mutex_unlock(&xkb_lock);
+	if (old_state) xkb_state_unref(old_state);
+	if (old_keymap) xkb_keymap_unref(old_keymap);
 	return 0;
 #else
 	return -1;
@@ -629,12 +4947,16 @@ static int rebuild_xkb_keymap(void)
 
 int ni_enable_xkb(int enabled)
 {
+	if (enabled != 0 && enabled != NI_XKB_EAGER && enabled != NI_XKB_LAZY) return -1;
 	g.xkb_enabled = enabled ? 1 : 0;
+	g.xkb_lazy = enabled == NI_XKB_LAZY;
 #ifdef ASYNCINPUT_HAVE_XKBCOMMON
 	if (g.xkb_enabled) return rebuild_xkb_keymap();
 	/* disabling: free state */
+	pthread_mutex_lock(&xkb_lock);
 	if (g.xkb_state) { xkb_state_unref(g.xkb_state); g.xkb_state = NULL; }
 	if (g.xkb_keymap) { xkb_keymap_unref(g.xkb_keymap); g.xkb_keymap = NULL; }
+	pthread_mutex_unlock(&xkb_lock);
 	if (g.xkb_ctx) { xkb_context_unref(g.xkb_ctx); g.xkb_ctx = NULL; }
 	return 0;
 #else
@@ -662,13 +4984,18 @@ int ni_enable_mice(int enabled)
 {
 	g.mice_enabled = enabled ? 1 : 0;
 	if (!g.initialized) return 0;
-	if (enabled) {
-		if (!g.mice_thread) {
-			if (pthread_create(&g.mice_thread, NULL, mice_worker, NULL) != 0) {
-				g.mice_enabled = 0;
-				return -1;
-			}
-		}
+	if (g.client_mode) return 0; /* asyncinput-worker -M decides */
+	int rc = 0;
+	pthread_mutex_lock(&g.dev_lock);
+	if (enabled && !g.mice_reading) {
+		rc = mice_start();
+		g.mice_reading = rc == 0;
+	} else if (!enabled && g.mice_reading) {
+		mice_stop();
+		g.mice_reading = false;
 	}
-	return 0;
+	pthread_mutex_unlock(&g.dev_lock);
+	if (rc != 0)
+		g.mice_enabled = 0;
+	return rc;
 }
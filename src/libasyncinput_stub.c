@@ -16,12 +16,19 @@ static struct {
     SDL_Thread *thread;
     SDL_AtomicInt stop;
     SDL_Mutex *q_lock;
+    SDL_Condition *q_cond; /* signaled on push, for ni_wait_events() */
     int head, tail;
     struct ni_event q[1024];
+    uint64_t dropped; /* fixed-size queue, config capacity is ignored */
     ni_callback cb;
     void *cb_user;
+    /* ni_set_event_mask(), under q_lock: row 0 masks types, row t codes */
+    bool mask_set[NI_EV_CNT];
+    unsigned char mask_bits[NI_EV_CNT][(NI_KEY_CNT + 7) / 8];
 } g;
 
+static const int mask_code_cnt[NI_EV_CNT] = { [NI_EV_SYN] = NI_EV_CNT, [NI_EV_KEY] = NI_KEY_CNT, [NI_EV_REL] = NI_REL_CNT, [NI_EV_ABS] = NI_ABS_CNT };
+
 static inline long long now_ns(void)
 {
     return (long long)(SDL_GetTicksNS());
@@ -31,8 +38,26 @@ static void queue_push(const struct ni_event *ev)
 {
     SDL_LockMutex(g.q_lock);
     int next = (g.head + 1) % 1024;
-    if (next != g.tail) { g.q[g.head] = *ev; g.head = next; }
+    if (next != g.tail) { g.q[g.head] = *ev; g.head = next; SDL_BroadcastCondition(g.q_cond); }
+    else g.dropped++;
+    SDL_UnlockMutex(g.q_lock);
+}
+
+static bool mask_passes(const struct ni_event *ev)
+{
+    int type = ev->type, code = ev->code;
+    if (type <= NI_EV_SYN || type >= NI_EV_CNT) return true;
+    SDL_LockMutex(g.q_lock);
+    bool pass = !g.mask_set[NI_EV_SYN] || ni_bit_test(g.mask_bits[NI_EV_SYN], type);
+    if (pass && g.mask_set[type] && code >= 0 && code < mask_code_cnt[type]) pass = ni_bit_test(g.mask_bits[type], code);
     SDL_UnlockMutex(g.q_lock);
+    return pass;
+}
+
+static void emit(const struct ni_event *ev)
+{
+    if (!mask_passes(ev)) return;
+    if (g.cb) g.cb(ev, g.cb_user); else queue_push(ev);
 }
 
 static int sdl_worker(void *data)
@@ -55,23 +80,23 @@ static int sdl_worker(void *data)
             ev.timestamp_ns = now_ns();
             switch (e.type) {
                 case SDL_EVENT_MOUSE_MOTION:
-                    ev.type = NI_EV_REL; ev.code = NI_REL_X; ev.value = e.motion.xrel; if (ev.value) { if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);} 
-                    ev.type = NI_EV_REL; ev.code = NI_REL_Y; ev.value = -e.motion.yrel; if (ev.value) { if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);} 
+                    ev.type = NI_EV_REL; ev.code = NI_REL_X; ev.value = e.motion.xrel; if (ev.value) { emit(&ev);} 
+                    ev.type = NI_EV_REL; ev.code = NI_REL_Y; ev.value = -e.motion.yrel; if (ev.value) { emit(&ev);} 
                     break;
                 case SDL_EVENT_MOUSE_WHEEL:
-                    ev.type = NI_EV_REL; ev.code = NI_REL_WHEEL; ev.value = (int)e.wheel.y; if (ev.value) { if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);} 
+                    ev.type = NI_EV_REL; ev.code = NI_REL_WHEEL; ev.value = (int)e.wheel.y; if (ev.value) { emit(&ev);} 
                     break;
                 case SDL_EVENT_MOUSE_BUTTON_DOWN:
                 case SDL_EVENT_MOUSE_BUTTON_UP: {
                     int down = (e.type == SDL_EVENT_MOUSE_BUTTON_DOWN) ? 1 : 0;
                     ev.type = NI_EV_KEY; ev.value = down;
-                    if (e.button.button == SDL_BUTTON_LEFT) { ev.code = NI_BTN_LEFT; if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);} 
-                    else if (e.button.button == SDL_BUTTON_RIGHT) { ev.code = NI_BTN_RIGHT; if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);} 
-                    else if (e.button.button == SDL_BUTTON_MIDDLE) { ev.code = NI_BTN_MIDDLE; if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);} 
+                    if (e.button.button == SDL_BUTTON_LEFT) { ev.code = NI_BTN_LEFT; emit(&ev);} 
+                    else if (e.button.button == SDL_BUTTON_RIGHT) { ev.code = NI_BTN_RIGHT; emit(&ev);} 
+                    else if (e.button.button == SDL_BUTTON_MIDDLE) { ev.code = NI_BTN_MIDDLE; emit(&ev);} 
                     break; }
                 case SDL_EVENT_KEY_DOWN:
                 case SDL_EVENT_KEY_UP:
-                    ev.type = NI_EV_KEY; ev.value = (e.type == SDL_EVENT_KEY_DOWN) ? 1 : 0; ev.code = (int)e.key.scancode; if (g.cb) g.cb(&ev, g.cb_user); else queue_push(&ev);
+                    ev.type = NI_EV_KEY; ev.value = (e.type == SDL_EVENT_KEY_DOWN) ? 1 : 0; ev.code = (int)e.key.scancode; emit(&ev);
                     break;
                 default: break;
             }
@@ -88,17 +113,52 @@ int ni_init(int flags)
     if (g.initialized) return 0;
     if (SDL_Init(SDL_INIT_VIDEO) != 0) return -1;
     SDL_SetAtomicInt(&g.stop, 0);
+    memset(g.mask_set, 0, sizeof(g.mask_set));
     g.q_lock = SDL_CreateMutex();
+    g.q_cond = SDL_CreateCondition();
     g.head = g.tail = 0;
+    g.dropped = 0;
     g.thread = SDL_CreateThread(sdl_worker, "ai_worker", NULL);
     if (!g.thread) { SDL_Quit(); return -1; }
     g.initialized = 1;
     return 0;
 }
 
+/* SDL owns thread creation here; the reader config is accepted but ignored,
+ * except that timestamps can only come from SDL_GetTicksNS(). */
+int ni_init_with_worker_config(int flags, const struct ni_worker_config *config) { if (config && config->clock != NI_CLOCK_MONOTONIC) return -1; return ni_init(flags); }
+long long ni_now_ns(void) { return now_ns(); }
 int ni_set_device_filter(ni_device_filter filter, void *user_data) { (void)filter; (void)user_data; return 0; }
+int ni_grab_device(int device_id, int enable) { (void)device_id; (void)enable; return -1; }
+int ni_set_event_mask(int device_id, int type, const unsigned char *codes, int nbits)
+{
+    if (!g.initialized || device_id != -1 || type < 0 || type >= NI_EV_CNT || !mask_code_cnt[type] || nbits < 0) return -1;
+    int cnt = nbits < mask_code_cnt[type] ? nbits : mask_code_cnt[type];
+    SDL_LockMutex(g.q_lock);
+    g.mask_set[type] = codes != NULL;
+    memset(g.mask_bits[type], 0, sizeof(g.mask_bits[type]));
+    for (int c = 0; codes && c < cnt; c++) if (ni_bit_test(codes, c)) g.mask_bits[type][c / 8] |= (unsigned char)(1u << (c % 8));
+    SDL_UnlockMutex(g.q_lock);
+    return 0;
+}
+int ni_get_device_info(int device_id, struct ni_device_info *out) { (void)device_id; (void)out; return -1; }
+int ni_get_device_state(int device_id, struct ni_device_state *out) { (void)device_id; (void)out; return -1; }
+int ni_get_touch_state(int device_id, struct ni_touch_state *out) { (void)device_id; (void)out; return -1; }
 int ni_device_count(void) { return 1; }
 int ni_register_callback(ni_callback cb, void *user_data, int flags) { if (!g.initialized || flags != 0) return -1; g.cb = cb; g.cb_user = user_data; return 0; }
+int ni_register_device_callback(int device_id, ni_device_callback cb, void *user_data, int flags) { (void)device_id; (void)cb; (void)user_data; (void)flags; return -1; }
+int ni_unregister_device_callback(int callback_id) { (void)callback_id; return -1; }
+int ni_register_batch_callback(ni_batch_callback cb, void *user_data, int flags) { (void)cb; (void)user_data; (void)flags; return -1; }
+int ni_set_coalescing(int flags) { return flags == 0 ? 0 : -1; }
+uint64_t ni_dropped_events(void) { return g.dropped; }
+int ni_poll_compact(struct ni_event_compact *evts, int max_events, int64_t *base_ns) { (void)evts; (void)max_events; (void)base_ns; return -1; }
+int ni_poll_acquire(struct ni_event_batch *batch, int max_events) { (void)batch; (void)max_events; return -1; }
+int ni_record_start(const char *path) { (void)path; return -1; }
+long long ni_record_stop(void) { return -1; }
+long long ni_replay_pending(void) { return -1; }
+int ni_get_stats(struct ni_stats *out) { (void)out; return -1; }
+int ni_get_device_stats(int device_id, struct ni_device_stats *out) { (void)device_id; (void)out; return -1; }
+int ni_poll_release(struct ni_event_batch *batch) { (void)batch; return -1; }
 
 int ni_poll(struct ni_event *evts, int max_events)
 {
@@ -110,11 +170,32 @@ int ni_poll(struct ni_event *evts, int max_events)
     return n;
 }
 
+int ni_wait_events(int64_t timeout_ns)
+{
+    if (!g.initialized) return -1;
+    long long deadline = now_ns() + (timeout_ns > 0 ? timeout_ns : 0);
+    SDL_LockMutex(g.q_lock);
+    while (g.tail == g.head && timeout_ns != 0 && !SDL_GetAtomicInt(&g.stop)) {
+        Sint32 ms = -1;
+        if (timeout_ns > 0) { long long left = deadline - now_ns(); if (left <= 0) break; long long lms = (left + 999999) / 1000000; ms = lms > 0x7fffffff ? 0x7fffffff : (Sint32)lms; }
+        SDL_WaitConditionTimeout(g.q_cond, g.q_lock, ms);
+    }
+    int ready = g.tail != g.head;
+    SDL_UnlockMutex(g.q_lock);
+    return ready;
+}
+
+/* No pollable object behind the SDL queue. */
+int ni_get_event_fd(void) { return -1; }
+void *ni_get_event_handle(void) { return NULL; }
+
 int ni_shutdown(void)
 {
     if (!g.initialized) return 0;
     SDL_SetAtomicInt(&g.stop, 1);
+    SDL_LockMutex(g.q_lock); SDL_BroadcastCondition(g.q_cond); SDL_UnlockMutex(g.q_lock);
     SDL_WaitThread(g.thread, NULL);
+    SDL_DestroyCondition(g.q_cond);
     SDL_DestroyMutex(g.q_lock);
     SDL_Quit();
     g.initialized = 0;
@@ -7,31 +7,107 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define RING_SIZE 1024
+#define RING_DEFAULT_CAPACITY 1024
+#define RING_MAX_CAPACITY (1u << 22)
+#define CACHELINE_SIZE 64
 
+/*
+ * Single-producer/single-consumer rings, see the posix backend. The worker
+ * thread is the only producer; consumer_lock only serializes concurrent
+ * ni_poll() callers and is never taken by the worker. Overflow handling and
+ * NI_SYN_DROPPED reporting follow the posix backend too; NI_OVERFLOW_
+ * COALESCE_REL falls back to dropping the newest event.
+ */
 struct ringbuf {
-	struct ni_event ev[RING_SIZE];
-	int head;
-	int tail;
-	CRITICAL_SECTION lock;
+	_Alignas(CACHELINE_SIZE) volatile LONG head;
+	LONG tail_cache;
+	ULONG unreported;
+	volatile LONG64 dropped;
+	_Alignas(CACHELINE_SIZE) volatile LONG tail;
+	LONG head_cache;
+	ULONG consumed;
+	CRITICAL_SECTION consumer_lock;
+	_Alignas(CACHELINE_SIZE) ULONG size;
+	ULONG mask;
+	int policy;
+	struct ni_event *ev;
 };
 
 struct keyringbuf {
-	struct ni_key_event ev[RING_SIZE];
-	int head;
-	int tail;
-	CRITICAL_SECTION lock;
+	_Alignas(CACHELINE_SIZE) volatile LONG head;
+	LONG tail_cache;
+	volatile LONG64 dropped;
+	_Alignas(CACHELINE_SIZE) volatile LONG tail;
+	LONG head_cache;
+	CRITICAL_SECTION consumer_lock;
+	_Alignas(CACHELINE_SIZE) ULONG size;
+	ULONG mask;
+	struct ni_key_event *ev;
 };
 
+/* Registry entry for ni_register_device_callback() */
+struct device_callback {
+	int id;
+	int device_id; /* -1 for wildcard */
+	ni_device_callback callback;
+	void *user_data;
+	int flags;
+	struct device_callback *next;
+};
+
+/*
+ * Immutable snapshot of the registry, high-priority entries first. Raw Input
+ * has no per-device open, so the worker matches device_id per frame. The
+ * snapshot is swapped atomically and old ones are kept until ni_shutdown().
+ */
+struct cb_table {
+	struct cb_table *retired_next;
+	int count;
+	struct cb_table_entry {
+		int device_id;
+		int flags;
+		ni_device_callback callback;
+		void *user_data;
+	} entries[];
+};
+
+/* ni_set_event_mask() table, immutable and kept like cb_table. Row 0 masks
+ * event types, row t the codes of type t; emit_or_queue() applies it. */
+struct event_mask {
+	struct event_mask *retired_next;
+	BOOL set[NI_EV_CNT];
+	unsigned char bits[NI_EV_CNT][(NI_KEY_CNT + 7) / 8];
+};
+
+static const int mask_code_cnt[NI_EV_CNT] = { [NI_EV_SYN] = NI_EV_CNT, [NI_EV_KEY] = NI_KEY_CNT, [NI_EV_REL] = NI_REL_CNT, [NI_EV_ABS] = NI_ABS_CNT };
+
 static struct {
 	int initialized;
 	volatile int stop;
 	HANDLE thread;
 	DWORD thread_id;
 	HWND hwnd;
+	BOOL grabbed; /* RIDEV_NOLEGACY registration, written by the worker */
 	struct ringbuf queue;
+	/* manual-reset, signaled while queue holds events, see queue_signal() */
+	HANDLE event;
+	volatile LONG event_pending;
 	ni_callback cb;
 	void *cb_user;
+	ni_batch_callback batch_cb;
+	void *batch_cb_user;
+	/* events of the RAWINPUT packet being decoded, flushed as one frame */
+	int frame_len;
+	struct ni_event frame[16];
+	/* device callbacks; registry guarded by cb_lock */
+	CRITICAL_SECTION cb_lock;
+	struct device_callback *dev_callbacks;
+	struct cb_table *volatile cb_table;
+	struct cb_table *cb_retired;
+	int next_cb_id;
+	/* event mask, swapped under cb_lock; every table ever set is on mask_retired */
+	struct event_mask *volatile mask;
+	struct event_mask *mask_retired;
 	/* placeholder filter API on Windows: we don't have per-device open; we can filter by name/vendor in future */
 	ni_device_filter filter;
 	void *filter_user;
@@ -51,67 +127,244 @@ static LONGLONG now_ns(void)
 	return (LONGLONG)(s * 1000000000.0);
 }
 
-static void ring_init(struct ringbuf *r)
+static LONG load_acquire(volatile LONG *p)
+{
+	LONG v = *p;
+	MemoryBarrier();
+	return v;
+}
+
+static void store_release(volatile LONG *p, LONG v)
+{
+	MemoryBarrier();
+	*p = v;
+}
+
+static ULONG ring_capacity(size_t requested)
+{
+	ULONG size = 16;
+	if (!requested) requested = RING_DEFAULT_CAPACITY;
+	while (size < requested && size < RING_MAX_CAPACITY) size <<= 1;
+	return size;
+}
+
+static int ring_init(struct ringbuf *r, size_t capacity, int policy)
 {
 	memset(r, 0, sizeof(*r));
-	InitializeCriticalSection(&r->lock);
+	InitializeCriticalSection(&r->consumer_lock);
+	r->size = ring_capacity(capacity); r->mask = r->size - 1; r->policy = policy;
+	r->ev = (struct ni_event *)VirtualAlloc(NULL, r->size * sizeof(*r->ev), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return r->ev ? 0 : -1;
 }
 
-static void ring_push(struct ringbuf *r, const struct ni_event *ev)
+static void ring_free(struct ringbuf *r)
 {
-	EnterCriticalSection(&r->lock);
-	int next = (r->head + 1) % RING_SIZE;
-	if (next != r->tail) {
-		r->ev[r->head] = *ev;
-		r->head = next;
+	if (r->ev) VirtualFree(r->ev, 0, MEM_RELEASE);
+	r->ev = NULL;
+	DeleteCriticalSection(&r->consumer_lock);
+}
+
+static struct ni_event dropped_event(ULONG lost, LONGLONG ts)
+{
+	struct ni_event syn = {0};
+	syn.device_id = -1; syn.type = NI_EV_SYN; syn.code = NI_SYN_DROPPED;
+	syn.value = lost > 0x7fffffff ? 0x7fffffff : (int)lost; syn.timestamp_ns = ts;
+	return syn;
+}
+
+/* Producer side. Applies the overflow policy if the ring is full. */
+static BOOL ring_push(struct ringbuf *r, const struct ni_event *ev)
+{
+	ULONG head = (ULONG)r->head;
+	ULONG need = r->unreported ? 2 : 1;
+	if (head - (ULONG)r->tail_cache > r->size - need) {
+		r->tail_cache = load_acquire(&r->tail);
+		while (head - (ULONG)r->tail_cache > r->size - need) {
+			if (r->policy != NI_OVERFLOW_DROP_OLDEST) { r->unreported++; InterlockedIncrement64(&r->dropped); return FALSE; }
+			/* the consumer reports these, see ring_pop_many() */
+			LONG t = r->tail_cache;
+			LONG seen = InterlockedCompareExchange(&r->tail, t + 1, t);
+			if (seen == t) { t++; InterlockedIncrement64(&r->dropped); } else t = seen;
+			r->tail_cache = t;
+		}
 	}
-	LeaveCriticalSection(&r->lock);
+	if (r->unreported) { r->ev[head++ & r->mask] = dropped_event(r->unreported, ev->timestamp_ns); r->unreported = 0; }
+	r->ev[head & r->mask] = *ev;
+	store_release(&r->head, (LONG)(head + 1));
+	return TRUE;
 }
 
+/* Consumer side. Under drop-oldest the producer may move tail too: publish
+ * with a CAS, copy again on failure and report the gap in front. */
 static int ring_pop_many(struct ringbuf *r, struct ni_event *out, int max)
 {
-	int n = 0;
-	EnterCriticalSection(&r->lock);
-	while (n < max && r->tail != r->head) {
-		out[n++] = r->ev[r->tail];
-		r->tail = (r->tail + 1) % RING_SIZE;
+	EnterCriticalSection(&r->consumer_lock);
+	ULONG tail = (ULONG)load_acquire(&r->tail);
+	ULONG n;
+	int off;
+	for (;;) {
+		ULONG lost = r->policy == NI_OVERFLOW_DROP_OLDEST ? tail - r->consumed : 0;
+		off = lost ? 1 : 0;
+		ULONG avail = (ULONG)r->head_cache - tail;
+		if (avail == 0 || avail > r->size) { r->head_cache = load_acquire(&r->head); avail = (ULONG)r->head_cache - tail; }
+		ULONG room = (ULONG)(max - off);
+		n = avail < room ? avail : room;
+		if (!n && !off) break;
+		ULONG idx = tail & r->mask;
+		ULONG first = r->size - idx;
+		if (first > n) first = n;
+		memcpy(out + off, &r->ev[idx], first * sizeof(*out));
+		memcpy(out + off + first, &r->ev[0], (n - first) * sizeof(*out));
+		if (r->policy != NI_OVERFLOW_DROP_OLDEST) { store_release(&r->tail, (LONG)(tail + n)); break; }
+		LONG seen = InterlockedCompareExchange(&r->tail, (LONG)(tail + n), (LONG)tail);
+		if ((ULONG)seen == tail) {
+			r->consumed = tail + n;
+			if (off) out[0] = dropped_event(lost, n ? out[1].timestamp_ns : now_ns());
+			break;
+		}
+		tail = (ULONG)seen;
 	}
-	LeaveCriticalSection(&r->lock);
-	return n;
+	LeaveCriticalSection(&r->consumer_lock);
+	return (int)(n + (ULONG)off);
+}
+
+/* Producer side: one SetEvent per empty -> non-empty transition. The
+ * interlocked exchange is a full barrier after the head store. */
+static void queue_signal(void)
+{
+	if (!InterlockedExchange(&g.event_pending, 1)) SetEvent(g.event);
+}
+
+/* Consumer side once the queue looks drained: reset before clearing the
+ * flag, then re-check so a concurrent push is never lost. */
+static void queue_rearm(void)
+{
+	if (!g.event_pending) return;
+	ResetEvent(g.event);
+	InterlockedExchange(&g.event_pending, 0);
+	if (load_acquire(&g.queue.head) != load_acquire(&g.queue.tail)) queue_signal();
 }
 
-static void keyring_init(struct keyringbuf *r)
+static int keyring_init(struct keyringbuf *r, size_t capacity)
 {
 	memset(r, 0, sizeof(*r));
-	InitializeCriticalSection(&r->lock);
+	InitializeCriticalSection(&r->consumer_lock);
+	r->size = ring_capacity(capacity); r->mask = r->size - 1;
+	r->ev = (struct ni_key_event *)VirtualAlloc(NULL, r->size * sizeof(*r->ev), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return r->ev ? 0 : -1;
 }
 
-static void keyring_push(struct keyringbuf *r, const struct ni_key_event *ev)
+static void keyring_free(struct keyringbuf *r)
 {
-	EnterCriticalSection(&r->lock);
-	int next = (r->head + 1) % RING_SIZE;
-	if (next != r->tail) {
-		r->ev[r->head] = *ev;
-		r->head = next;
+	if (r->ev) VirtualFree(r->ev, 0, MEM_RELEASE);
+	r->ev = NULL;
+	DeleteCriticalSection(&r->consumer_lock);
+}
+
+static BOOL keyring_push(struct keyringbuf *r, const struct ni_key_event *ev)
+{
+	ULONG head = (ULONG)r->head;
+	if (head - (ULONG)r->tail_cache == r->size) {
+		r->tail_cache = load_acquire(&r->tail);
+		if (head - (ULONG)r->tail_cache == r->size) { InterlockedIncrement64(&r->dropped); return FALSE; }
 	}
-	LeaveCriticalSection(&r->lock);
+	r->ev[head & r->mask] = *ev;
+	store_release(&r->head, (LONG)(head + 1));
+	return TRUE;
 }
 
 static int keyring_pop_many(struct keyringbuf *r, struct ni_key_event *out, int max)
 {
-	int n = 0;
-	EnterCriticalSection(&r->lock);
-	while (n < max && r->tail != r->head) {
-		out[n++] = r->ev[r->tail];
-		r->tail = (r->tail + 1) % RING_SIZE;
+	EnterCriticalSection(&r->consumer_lock);
+	ULONG tail = (ULONG)r->tail;
+	if ((ULONG)r->head_cache == tail) r->head_cache = load_acquire(&r->head);
+	ULONG avail = (ULONG)r->head_cache - tail;
+	ULONG n = avail < (ULONG)max ? avail : (ULONG)max;
+	if (n) {
+		ULONG idx = tail & r->mask;
+		ULONG first = r->size - idx;
+		if (first > n) first = n;
+		memcpy(out, &r->ev[idx], first * sizeof(*out));
+		memcpy(out + first, &r->ev[0], (n - first) * sizeof(*out));
+		store_release(&r->tail, (LONG)(tail + n));
 	}
-	LeaveCriticalSection(&r->lock);
-	return n;
+	LeaveCriticalSection(&r->consumer_lock);
+	return (int)n;
+}
+
+/* Raw Input cannot be filtered at the source, so masking happens here;
+ * a packet left without events produces no frame. */
+static int mask_passes(const struct ni_event *ev)
+{
+	const struct event_mask *m = (const struct event_mask *)InterlockedCompareExchangePointer((PVOID volatile *)&g.mask, NULL, NULL);
+	int type = ev->type, code = ev->code;
+	if (!m) return 1;
+	if (type == NI_EV_MOUSE) { type = code == NI_MOUSE_MOVE ? NI_EV_REL : NI_EV_KEY; code = -1; }
+	if (type <= NI_EV_SYN || type >= NI_EV_CNT) return 1;
+	if (m->set[NI_EV_SYN] && !ni_bit_test(m->bits[NI_EV_SYN], type)) return 0;
+	if (code < 0 || code >= mask_code_cnt[type] || !m->set[type]) return 1;
+	return ni_bit_test(m->bits[type], code);
 }
 
 static void emit_or_queue(const struct ni_event *ev)
 {
-	if (g.cb) g.cb(ev, g.cb_user); else ring_push(&g.queue, ev);
+	if (!mask_passes(ev)) return;
+	if (g.frame_len < (int)(sizeof(g.frame) / sizeof(g.frame[0])) - 1)
+		g.frame[g.frame_len++] = *ev;
+}
+
+static int cb_matches(const struct cb_table_entry *e, int device_id)
+{
+	return e->device_id == -1 || e->device_id == device_id;
+}
+
+/* Terminate the current packet with NI_SYN_REPORT and deliver it: high
+ * priority device callbacks, global callback or queue, other device
+ * callbacks. An exclusive device callback suppresses everything else. */
+static void flush_frame(HANDLE hdev, LONGLONG ts)
+{
+	if (!g.frame_len) return;
+	int device_id = (int)(intptr_t)hdev;
+	struct ni_event syn = {0};
+	syn.device_id = device_id; syn.timestamp_ns = ts;
+	syn.type = NI_EV_SYN; syn.code = NI_SYN_REPORT;
+	g.frame[g.frame_len++] = syn;
+
+	const struct cb_table *t = (const struct cb_table *)InterlockedCompareExchangePointer((PVOID volatile *)&g.cb_table, NULL, NULL);
+	const struct cb_table_entry *excl = NULL;
+	int nmatch = 0, queued = 0;
+	struct ni_device_info info = {0};
+	if (t) {
+		for (int k = 0; k < t->count; k++) {
+			const struct cb_table_entry *e = &t->entries[k];
+			if (!cb_matches(e, device_id)) continue;
+			nmatch++;
+			if ((e->flags & NI_CB_FLAG_EXCLUSIVE) && (!excl || excl->device_id == -1)) excl = e;
+		}
+		if (nmatch) {
+			UINT sz = (UINT)sizeof(info.path);
+			info.id = device_id;
+			if (GetRawInputDeviceInfoA(hdev, RIDI_DEVICENAME, info.path, &sz) == (UINT)-1) info.path[0] = '\0';
+		}
+	}
+
+	for (int i = 0; i < g.frame_len; i++) {
+		const struct ni_event *ev = &g.frame[i];
+		if (excl) { excl->callback(ev, &info, excl->user_data); continue; }
+		for (int k = 0; nmatch && k < t->count; k++) {
+			const struct cb_table_entry *e = &t->entries[k];
+			if ((e->flags & NI_CB_FLAG_HIGH_PRIORITY) && cb_matches(e, device_id)) e->callback(ev, &info, e->user_data);
+		}
+		if (g.cb) g.cb(ev, g.cb_user);
+		else if (!g.batch_cb) queued |= ring_push(&g.queue, ev);
+		for (int k = 0; nmatch && k < t->count; k++) {
+			const struct cb_table_entry *e = &t->entries[k];
+			if (!(e->flags & NI_CB_FLAG_HIGH_PRIORITY) && cb_matches(e, device_id)) e->callback(ev, &info, e->user_data);
+		}
+	}
+	if (queued) queue_signal();
+	if (g.batch_cb && !excl) g.batch_cb(g.frame, g.frame_len, g.batch_cb_user);
+	g.frame_len = 0;
 }
 
 /* Raw Input handling */
@@ -134,6 +387,7 @@ static void handle_rawinput(HRAWINPUT hri)
 		ev.code = (int)kb->MakeCode; /* best-effort scancode */
 		if (kb->Flags & RI_KEY_BREAK) ev.value = 0; else ev.value = 1;
 		emit_or_queue(&ev);
+		flush_frame(ri->header.hDevice, ts);
 		/* Produce basic text on keydown via WM_CHAR handled separately in message loop */
 	} else if (ri->header.dwType == RIM_TYPEMOUSE) {
 		const RAWMOUSE *m = &ri->data.mouse;
@@ -160,16 +414,36 @@ static void handle_rawinput(HRAWINPUT hri)
 				ev.type = NI_EV_REL; ev.code = NI_REL_WHEEL; ev.value = (int)(dz / WHEEL_DELTA); emit_or_queue(&ev);
 			}
 		}
+		flush_frame(ri->header.hDevice, ts);
 	}
 	free(ri);
 }
 
+/* ni_grab_device() hands the registration to the thread owning the window */
+#define WM_NI_GRAB (WM_APP + 1)
+
+/* Keyboard and mouse Raw Input for hwnd. A grab adds RIDEV_NOLEGACY, and
+ * RIDEV_CAPTUREMOUSE for the mouse, which Windows only accepts together. */
+static BOOL register_raw_input(HWND hwnd, BOOL grab)
+{
+	RAWINPUTDEVICE rid[2];
+	rid[0].usUsagePage = 0x01; rid[0].usUsage = 0x06; /* Keyboard */
+	rid[0].dwFlags = RIDEV_INPUTSINK | (grab ? RIDEV_NOLEGACY : 0); rid[0].hwndTarget = hwnd;
+	rid[1].usUsagePage = 0x01; rid[1].usUsage = 0x02; /* Mouse */
+	rid[1].dwFlags = RIDEV_INPUTSINK | (grab ? RIDEV_NOLEGACY | RIDEV_CAPTUREMOUSE : 0); rid[1].hwndTarget = hwnd;
+	return RegisterRawInputDevices(rid, 2, sizeof(RAWINPUTDEVICE));
+}
+
 static LRESULT CALLBACK wndproc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
 	switch (msg) {
 	case WM_INPUT:
 		handle_rawinput((HRAWINPUT)lParam);
 		break;
+	case WM_NI_GRAB:
+		if (!register_raw_input(hwnd, wParam != 0)) return -1;
+		g.grabbed = wParam != 0;
+		break;
 	case WM_CHAR: {
 		/* Emit a high-level key event with UTF-8 text for simple characters */
 		if (!g.key_cb) break;
@@ -203,12 +477,7 @@ static int create_message_window(void)
 	if (!hwnd) return -1;
 	g.hwnd = hwnd;
 	/* Register for raw input for keyboard and mouse */
-	RAWINPUTDEVICE rid[2];
-	rid[0].usUsagePage = 0x01; rid[0].usUsage = 0x06; /* Keyboard */
-	rid[0].dwFlags = RIDEV_INPUTSINK; rid[0].hwndTarget = hwnd;
-	rid[1].usUsagePage = 0x01; rid[1].usUsage = 0x02; /* Mouse */
-	rid[1].dwFlags = RIDEV_INPUTSINK; rid[1].hwndTarget = hwnd;
-	if (!RegisterRawInputDevices(rid, 2, sizeof(RAWINPUTDEVICE))) {
+	if (!register_raw_input(hwnd, FALSE)) {
 		DestroyWindow(hwnd); g.hwnd = NULL; return -1;
 	}
 	return 0;
@@ -232,20 +501,53 @@ static DWORD WINAPI worker_thread(LPVOID param)
 	return 0;
 }
 
-int ni_init(int flags)
+/* Map the config onto Win32 thread priorities; there is no SCHED_FIFO, so
+ * any rt_priority selects THREAD_PRIORITY_TIME_CRITICAL. */
+static int thread_priority_from_config(const struct ni_worker_config *cfg)
+{
+	if (cfg->rt_priority > 0) return THREAD_PRIORITY_TIME_CRITICAL;
+	if (cfg->nice_level <= -10) return THREAD_PRIORITY_HIGHEST;
+	if (cfg->nice_level < 0) return THREAD_PRIORITY_ABOVE_NORMAL;
+	if (cfg->nice_level >= 10) return THREAD_PRIORITY_LOWEST;
+	if (cfg->nice_level > 0) return THREAD_PRIORITY_BELOW_NORMAL;
+	return THREAD_PRIORITY_NORMAL;
+}
+
+int ni_init_with_worker_config(int flags, const struct ni_worker_config *config)
 {
 	if (flags != 0) return -1;
 	if (g.initialized) return 0;
+	struct ni_worker_config cfg;
+	if (config) cfg = *config; else ni_worker_config_defaults(&cfg);
+	if (cfg.cpu_affinity < -1 || cfg.cpu_affinity >= (int)(sizeof(DWORD_PTR) * 8)) return -1;
+	if (cfg.rt_priority < 0 || cfg.rt_priority > 99 || cfg.nice_level < -20 || cfg.nice_level > 19) return -1;
+	if (cfg.queue_capacity > RING_MAX_CAPACITY || cfg.overflow_policy < NI_OVERFLOW_DROP_NEWEST || cfg.overflow_policy > NI_OVERFLOW_COALESCE_REL) return -1;
+	if (cfg.clock != NI_CLOCK_MONOTONIC) return -1; /* QueryPerformanceCounter only */
 	memset(&g, 0, sizeof(g));
-	ring_init(&g.queue);
-	keyring_init(&g.key_queue);
+	/* each init sets up its critical section first, so free only what ran */
+	if (ring_init(&g.queue, cfg.queue_capacity, cfg.overflow_policy) != 0) { ring_free(&g.queue); return -1; }
+	if (keyring_init(&g.key_queue, cfg.queue_capacity) != 0) { keyring_free(&g.key_queue); ring_free(&g.queue); return -1; }
+	InitializeCriticalSection(&g.cb_lock);
+	g.event = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!g.event) { ring_free(&g.queue); keyring_free(&g.key_queue); DeleteCriticalSection(&g.cb_lock); return -1; }
 	g.stop = 0;
-	g.thread = CreateThread(NULL, 0, worker_thread, NULL, 0, &g.thread_id);
-	if (!g.thread) return -1;
+	/* start suspended so affinity and priority apply before the first message */
+	g.thread = CreateThread(NULL, cfg.stack_size, worker_thread, NULL, CREATE_SUSPENDED, &g.thread_id);
+	if (!g.thread) { CloseHandle(g.event); g.event = NULL; ring_free(&g.queue); keyring_free(&g.key_queue); DeleteCriticalSection(&g.cb_lock); return -1; }
+	if (cfg.cpu_affinity >= 0) SetThreadAffinityMask(g.thread, (DWORD_PTR)1 << cfg.cpu_affinity);
+	SetThreadPriority(g.thread, thread_priority_from_config(&cfg));
+	ResumeThread(g.thread);
 	g.initialized = 1;
 	return 0;
 }
 
+long long ni_now_ns(void) { return now_ns(); }
+
+int ni_init(int flags)
+{
+	return ni_init_with_worker_config(flags, NULL);
+}
+
 int ni_set_device_filter(ni_device_filter filter, void *user_data)
 {
 	/* No-op on Windows for now; we don't enumerate devices individually */
@@ -253,6 +555,36 @@ int ni_set_device_filter(ni_device_filter filter, void *user_data)
 	return 0;
 }
 
+int ni_grab_device(int device_id, int enable)
+{
+	/* Raw Input registers usages, not devices, so only -1 can be grabbed */
+	if (!g.initialized || device_id != -1 || !g.hwnd) return -1;
+	if (g.grabbed == (enable != 0)) return 0;
+	return SendMessageW(g.hwnd, WM_NI_GRAB, enable != 0, 0) == 0 ? 0 : -1;
+}
+
+int ni_set_event_mask(int device_id, int type, const unsigned char *codes, int nbits)
+{
+	if (!g.initialized || device_id != -1 || type < 0 || type >= NI_EV_CNT || !mask_code_cnt[type] || nbits < 0) return -1;
+	struct event_mask *m = (struct event_mask *)malloc(sizeof(*m));
+	if (!m) return -1;
+	EnterCriticalSection(&g.cb_lock);
+	if (g.mask) *m = *g.mask; else memset(m, 0, sizeof(*m));
+	m->set[type] = codes != NULL;
+	memset(m->bits[type], 0, sizeof(m->bits[type]));
+	int cnt = nbits < mask_code_cnt[type] ? nbits : mask_code_cnt[type];
+	for (int c = 0; codes && c < cnt; c++) if (ni_bit_test(codes, c)) m->bits[type][c / 8] |= (unsigned char)(1u << (c % 8));
+	m->retired_next = g.mask_retired; g.mask_retired = m;
+	InterlockedExchangePointer((PVOID volatile *)&g.mask, m);
+	LeaveCriticalSection(&g.cb_lock);
+	return 0;
+}
+
+/* per-device info and state tracking are Linux only */
+int ni_get_device_info(int device_id, struct ni_device_info *out) { (void)device_id; (void)out; return -1; }
+int ni_get_device_state(int device_id, struct ni_device_state *out) { (void)device_id; (void)out; return -1; }
+int ni_get_touch_state(int device_id, struct ni_touch_state *out) { (void)device_id; (void)out; return -1; }
+
 int ni_device_count(void)
 {
 	return g.device_count;
@@ -264,19 +596,154 @@ int ni_register_callback(ni_callback cb, void *user_data, int flags)
 	g.cb = cb; g.cb_user = user_data; return 0;
 }
 
+/* Rebuild and publish the registry snapshot. Caller holds cb_lock. */
+static void cb_table_refresh(void)
+{
+	int count = 0;
+	for (struct device_callback *c = g.dev_callbacks; c; c = c->next) count++;
+	struct cb_table *t = NULL;
+	if (count) {
+		t = (struct cb_table *)calloc(1, sizeof(*t) + (size_t)count * sizeof(t->entries[0]));
+		if (!t) return;
+		for (int pass = 0; pass < 2; pass++) {
+			for (struct device_callback *c = g.dev_callbacks; c; c = c->next) {
+				int high = (c->flags & NI_CB_FLAG_HIGH_PRIORITY) != 0;
+				if (high != (pass == 0)) continue;
+				struct cb_table_entry *e = &t->entries[t->count++];
+				e->device_id = c->device_id; e->flags = c->flags;
+				e->callback = c->callback; e->user_data = c->user_data;
+			}
+		}
+	}
+	struct cb_table *old = (struct cb_table *)InterlockedExchangePointer((PVOID volatile *)&g.cb_table, t);
+	if (old) { old->retired_next = g.cb_retired; g.cb_retired = old; }
+}
+
+int ni_register_device_callback(int device_id, ni_device_callback cb, void *user_data, int flags)
+{
+	if (!g.initialized || !cb) return -1;
+	/* frame batches are delivered through ni_register_batch_callback() */
+	if (flags & ~(NI_CB_FLAG_EXCLUSIVE | NI_CB_FLAG_HIGH_PRIORITY)) return -1;
+	EnterCriticalSection(&g.cb_lock);
+	struct device_callback **tail = &g.dev_callbacks;
+	for (; *tail; tail = &(*tail)->next) {
+		if ((flags & NI_CB_FLAG_EXCLUSIVE) && ((*tail)->flags & NI_CB_FLAG_EXCLUSIVE) && (*tail)->device_id == device_id) {
+			LeaveCriticalSection(&g.cb_lock); return -1;
+		}
+	}
+	struct device_callback *c = (struct device_callback *)calloc(1, sizeof(*c));
+	if (!c) { LeaveCriticalSection(&g.cb_lock); return -1; }
+	c->id = ++g.next_cb_id; c->device_id = device_id;
+	c->callback = cb; c->user_data = user_data; c->flags = flags;
+	*tail = c;
+	cb_table_refresh();
+	int id = c->id;
+	LeaveCriticalSection(&g.cb_lock);
+	return id;
+}
+
+int ni_unregister_device_callback(int callback_id)
+{
+	if (!g.initialized) return -1;
+	EnterCriticalSection(&g.cb_lock);
+	for (struct device_callback **pc = &g.dev_callbacks; *pc; pc = &(*pc)->next) {
+		struct device_callback *c = *pc;
+		if (c->id != callback_id) continue;
+		*pc = c->next;
+		free(c);
+		cb_table_refresh();
+		LeaveCriticalSection(&g.cb_lock);
+		return 0;
+	}
+	LeaveCriticalSection(&g.cb_lock);
+	return -1;
+}
+
+int ni_register_batch_callback(ni_batch_callback cb, void *user_data, int flags)
+{
+	if (!g.initialized || flags != 0) return -1;
+	g.batch_cb = cb; g.batch_cb_user = user_data; return 0;
+}
+
+/* Raw Input already reports button edges only; queue merging is posix only. */
+int ni_set_coalescing(int flags)
+{
+	if (!g.initialized || (flags & ~NI_COALESCE_BUTTONS)) return -1;
+	return 0;
+}
+
 int ni_poll(struct ni_event *evts, int max_events)
 {
 	if (!g.initialized || !evts || max_events <= 0) return -1;
-	return ring_pop_many(&g.queue, evts, max_events);
+	int n = ring_pop_many(&g.queue, evts, max_events);
+	if (n < max_events) queue_rearm();
+	return n;
+}
+
+/* in-place polling is Linux only for now */
+int ni_poll_acquire(struct ni_event_batch *batch, int max_events) { (void)batch; (void)max_events; return -1; }
+int ni_poll_release(struct ni_event_batch *batch) { (void)batch; return -1; }
+/* NI_INIT_FLAG_COMPACT is Linux only */
+int ni_poll_compact(struct ni_event_compact *evts, int max_events, int64_t *base_ns) { (void)evts; (void)max_events; (void)base_ns; return -1; }
+/* traces are Linux only */
+int ni_record_start(const char *path) { (void)path; return -1; }
+long long ni_record_stop(void) { return -1; }
+long long ni_replay_pending(void) { return -1; }
+int ni_get_stats(struct ni_stats *out) { (void)out; return -1; }
+int ni_get_device_stats(int device_id, struct ni_device_stats *out) { (void)device_id; (void)out; return -1; }
+
+uint64_t ni_dropped_events(void)
+{
+	if (!g.initialized) return 0;
+	return (uint64_t)(InterlockedCompareExchange64(&g.queue.dropped, 0, 0) + InterlockedCompareExchange64(&g.key_queue.dropped, 0, 0));
+}
+
+int ni_wait_events(int64_t timeout_ns)
+{
+	if (!g.initialized) return -1;
+	LONGLONG deadline = timeout_ns > 0 ? now_ns() + timeout_ns : 0;
+	for (;;) {
+		if (load_acquire(&g.queue.head) != load_acquire(&g.queue.tail)) return 1;
+		queue_rearm();
+		if (load_acquire(&g.queue.head) != load_acquire(&g.queue.tail)) return 1;
+		if (timeout_ns == 0 || g.stop) return 0;
+		DWORD ms = INFINITE;
+		if (timeout_ns > 0) {
+			LONGLONG left = deadline - now_ns();
+			if (left <= 0) return 0;
+			LONGLONG lms = (left + 999999) / 1000000; /* round up, never spin */
+			ms = lms > 0x7fffffff ? 0x7fffffff : (DWORD)lms;
+		}
+		if (WaitForSingleObject(g.event, ms) == WAIT_FAILED) return -1;
+	}
+}
+
+int ni_get_event_fd(void)
+{
+	return -1;
+}
+
+void *ni_get_event_handle(void)
+{
+	return g.initialized ? g.event : NULL;
 }
 
 int ni_shutdown(void)
 {
 	if (!g.initialized) return 0;
 	g.stop = 1;
+	queue_signal(); /* release ni_wait_events() callers */
 	if (g.hwnd) PostMessage(g.hwnd, WM_CLOSE, 0, 0);
 	WaitForSingleObject(g.thread, 2000);
 	CloseHandle(g.thread); g.thread = NULL;
+	while (g.dev_callbacks) { struct device_callback *c = g.dev_callbacks; g.dev_callbacks = c->next; free(c); }
+	if (g.cb_table) { g.cb_table->retired_next = g.cb_retired; g.cb_retired = g.cb_table; g.cb_table = NULL; }
+	while (g.cb_retired) { struct cb_table *t = g.cb_retired; g.cb_retired = t->retired_next; free(t); }
+	g.mask = NULL;
+	while (g.mask_retired) { struct event_mask *m = g.mask_retired; g.mask_retired = m->retired_next; free(m); }
+	DeleteCriticalSection(&g.cb_lock);
+	CloseHandle(g.event); g.event = NULL;
+	ring_free(&g.queue); keyring_free(&g.key_queue);
 	g.initialized = 0;
 	return 0;
 }